@@ -0,0 +1,179 @@
+/*
+ * Asynchronous elf module loading for esp32
+ *
+ * Copyright (C) 2017 by niicoooo <1niicoooo1@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Each load runs elfLoaderLoadAndRelocate on its own detached thread. The
+ * handle is shared by the thread and the caller and freed by the last one
+ * done with it: elfLoaderAsyncFinish can be called from the completion
+ * callback.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "async.h"
+
+
+#if INTERFACE
+#include "loader.h"
+
+typedef enum {
+    ELFLOADER_ASYNC_PENDING, /*!< Load running */
+    ELFLOADER_ASYNC_DONE, /*!< Module loaded and relocated */
+    ELFLOADER_ASYNC_FAILED, /*!< Load failed */
+    ELFLOADER_ASYNC_CANCELLED, /*!< Load cancelled by elfLoaderAsyncCancel */
+} ELFLoaderAsyncStatus_t;
+
+typedef struct ELFLoaderAsync_t ELFLoaderAsync_t;
+
+typedef void (*ELFLoaderAsyncCallback_t)(void *arg, ELFLoaderAsync_t *async, ELFLoaderAsyncStatus_t status);
+
+#define ELFLOADER_ASYNC_STACK_SIZE 6144
+
+#endif
+
+
+#ifdef __linux__
+
+#define MSG(...) printf(__VA_ARGS__); printf("\n");
+#define ERR(...) printf(__VA_ARGS__); printf("\n");
+
+#else
+
+#include "esp_log.h"
+static const char* TAG = "elfLoaderAsync";
+#define MSG(...) ESP_LOGI(TAG,  __VA_ARGS__);
+#define ERR(...) ESP_LOGE(TAG,  __VA_ARGS__);
+
+#endif
+
+struct ELFLoaderAsync_t {
+    ELFLoaderContext_t *ctx;
+    ELFLoaderAsyncCallback_t callback;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ELFLoaderAsyncStatus_t status;
+    int refs;
+};
+
+
+static void release(ELFLoaderAsync_t *async) {
+    pthread_mutex_lock(&async->lock);
+    int refs = --async->refs;
+    pthread_mutex_unlock(&async->lock);
+    if (refs == 0) {
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->lock);
+        free(async);
+    }
+}
+
+
+static void *loadThread(void *arg) {
+    ELFLoaderAsync_t *async = arg;
+    ELFLoaderAsyncStatus_t status = ELFLOADER_ASYNC_DONE;
+    if (elfLoaderLoadAndRelocate(async->ctx) != 0) {
+        status = elfLoaderIsCancelled(async->ctx) ? ELFLOADER_ASYNC_CANCELLED : ELFLOADER_ASYNC_FAILED;
+    }
+    pthread_mutex_lock(&async->lock);
+    async->status = status;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+    if (async->callback) {
+        async->callback(async->arg, async, status);
+    }
+    release(async);
+    return NULL;
+}
+
+
+/*
+ * Load and relocate ctx, an initialized context, on a new thread. The
+ * handle owns ctx, handed back by elfLoaderAsyncFinish: ctx is freed when
+ * the thread cannot be started. NULL on error.
+ */
+ELFLoaderAsync_t *elfLoaderLoadAsync(ELFLoaderContext_t *ctx, ELFLoaderAsyncCallback_t callback, void *arg) {
+    if (!ctx) {
+        return NULL;
+    }
+    ELFLoaderAsync_t *async = malloc(sizeof(ELFLoaderAsync_t));
+    assert(async);
+    memset(async, 0, sizeof(ELFLoaderAsync_t));
+    async->ctx = ctx;
+    async->callback = callback;
+    async->arg = arg;
+    async->status = ELFLOADER_ASYNC_PENDING;
+    async->refs = 2;
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->cond, NULL);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, ELFLOADER_ASYNC_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&thread, &attr, loadThread, async);
+    pthread_attr_destroy(&attr);
+    if (r != 0) {
+        ERR("Loader thread failled");
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->lock);
+        free(async);
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return async;
+}
+
+
+ELFLoaderAsyncStatus_t elfLoaderAsyncStatus(ELFLoaderAsync_t *async) {
+    pthread_mutex_lock(&async->lock);
+    ELFLoaderAsyncStatus_t status = async->status;
+    pthread_mutex_unlock(&async->lock);
+    return status;
+}
+
+
+ELFLoaderAsyncStatus_t elfLoaderAsyncWait(ELFLoaderAsync_t *async) {
+    pthread_mutex_lock(&async->lock);
+    while (async->status == ELFLOADER_ASYNC_PENDING) {
+        pthread_cond_wait(&async->cond, &async->lock);
+    }
+    ELFLoaderAsyncStatus_t status = async->status;
+    pthread_mutex_unlock(&async->lock);
+    return status;
+}
+
+
+void elfLoaderAsyncCancel(ELFLoaderAsync_t *async) {
+    elfLoaderCancel(async->ctx);
+}
+
+
+ELFLoaderContext_t *elfLoaderAsyncFinish(ELFLoaderAsync_t *async) {
+    ELFLoaderContext_t *ctx = async->ctx;
+    if (elfLoaderAsyncWait(async) != ELFLOADER_ASYNC_DONE) {
+        elfLoaderFree(ctx);
+        ctx = NULL;
+    }
+    release(async);
+    return ctx;
+}
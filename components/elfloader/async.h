@@ -0,0 +1,22 @@
+/* This file was automatically generated.  Do not edit! */
+#include "loader.h"
+
+typedef enum {
+    ELFLOADER_ASYNC_PENDING, /*!< Load running */
+    ELFLOADER_ASYNC_DONE, /*!< Module loaded and relocated */
+    ELFLOADER_ASYNC_FAILED, /*!< Load failed */
+    ELFLOADER_ASYNC_CANCELLED, /*!< Load cancelled by elfLoaderAsyncCancel */
+} ELFLoaderAsyncStatus_t;
+
+typedef struct ELFLoaderAsync_t ELFLoaderAsync_t;
+
+typedef void (*ELFLoaderAsyncCallback_t)(void *arg, ELFLoaderAsync_t *async, ELFLoaderAsyncStatus_t status);
+
+#define ELFLOADER_ASYNC_STACK_SIZE 6144
+
+ELFLoaderContext_t *elfLoaderAsyncFinish(ELFLoaderAsync_t *async);
+void elfLoaderAsyncCancel(ELFLoaderAsync_t *async);
+ELFLoaderAsyncStatus_t elfLoaderAsyncWait(ELFLoaderAsync_t *async);
+ELFLoaderAsyncStatus_t elfLoaderAsyncStatus(ELFLoaderAsync_t *async);
+ELFLoaderAsync_t *elfLoaderLoadAsync(ELFLoaderContext_t *ctx,ELFLoaderAsyncCallback_t callback,void *arg);
+
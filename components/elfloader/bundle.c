@@ -0,0 +1,253 @@
+/*
+ * A elf module bundle reader for esp32
+ *
+ * Copyright (C) 2017 by niicoooo <1niicoooo1@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Bundle layout, all fields are little endian uint32_t:
+ *
+ *   header      magic "ELFB", version, count, dirOffset, poolOffset, poolSize
+ *   directory   count entries, sorted by nameHash:
+ *               nameHash, nameOffset (in pool), offset, size, hash
+ *   pool        zero terminated module names
+ *   modules     elf files, 4 bytes aligned
+ *
+ * Hashes are 32 bits FNV-1a. See tools/elfbundle.py to build a bundle.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+#include "unaligned.h"
+
+
+#if INTERFACE
+#include "loader.h"
+
+#define ELFLOADER_BUNDLE_MAGIC 0x42464c45
+#define ELFLOADER_BUNDLE_VERSION 1
+
+typedef struct {
+    uint32_t nameHash; /*!< FNV-1a hash of module name */
+    uint32_t nameOffset; /*!< Offset of module name in string pool */
+    uint32_t offset; /*!< Offset of module elf file in bundle */
+    uint32_t size; /*!< Size of module elf file */
+    uint32_t hash; /*!< FNV-1a hash of module elf file */
+} ELFLoaderBundleEntry_t;
+
+typedef struct ELFLoaderBundle_t ELFLoaderBundle_t;
+
+#endif
+
+
+#ifdef __linux__
+
+#define MSG(...) printf(__VA_ARGS__); printf("\n");
+#define ERR(...) printf(__VA_ARGS__); printf("\n");
+
+#define BUNDLE_GETDATA(bundle, off, buffer, size) \
+    if(elfLoaderReadAt(bundle->fd, bundle->offset + (off), buffer, size) != 0) { goto err; }
+
+#else
+
+#include "esp_log.h"
+static const char* TAG = "elfLoaderBundle";
+#define MSG(...) ESP_LOGI(TAG,  __VA_ARGS__);
+#define ERR(...) ESP_LOGE(TAG,  __VA_ARGS__);
+
+#define BUNDLE_GETDATA(bundle, off, buffer, size) \
+    unalignedCpy(buffer, bundle->fd + bundle->offset + (off), size);
+
+#endif
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t dirOffset;
+    uint32_t poolOffset;
+    uint32_t poolSize;
+} ELFLoaderBundleHeader_t;
+
+struct ELFLoaderBundle_t {
+    LOADER_FD_T fd;
+    off_t offset;
+    uint32_t count;
+    uint32_t poolOffset;
+    uint32_t poolSize;
+    ELFLoaderBundleEntry_t *dir;
+};
+
+
+static uint32_t fnv1a(uint32_t h, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size--) {
+        h ^= *p++;
+        h *= 16777619;
+    }
+    return h;
+}
+
+
+static int readName(ELFLoaderBundle_t *bundle, uint32_t nameOffset, char *name, size_t nlen) {
+    if (nameOffset >= bundle->poolSize) {
+        return -1;
+    }
+    size_t len = bundle->poolSize - nameOffset;
+    if (len > nlen - 1) {
+        len = nlen - 1;
+    }
+    BUNDLE_GETDATA(bundle, bundle->poolOffset + nameOffset, name, len);
+    name[len] = 0;
+    return 0;
+#ifdef __linux__
+err:
+    return -1;
+#endif
+}
+
+
+void elfLoaderBundleClose(ELFLoaderBundle_t *bundle) {
+    if (bundle) {
+        free(bundle->dir);
+        free(bundle);
+    }
+}
+
+
+ELFLoaderBundle_t *elfLoaderBundleOpenAt(LOADER_FD_T fd, off_t offset) {
+    ELFLoaderBundle_t *bundle = malloc(sizeof(ELFLoaderBundle_t));
+    assert(bundle);
+    memset(bundle, 0, sizeof(ELFLoaderBundle_t));
+    bundle->fd = fd;
+    bundle->offset = offset;
+
+    ELFLoaderBundleHeader_t header;
+    BUNDLE_GETDATA(bundle, 0, &header, sizeof(header));
+    if (header.magic != ELFLOADER_BUNDLE_MAGIC || header.version != ELFLOADER_BUNDLE_VERSION) {
+        ERR("Bad bundle identification");
+        goto err;
+    }
+    bundle->count = header.count;
+    bundle->poolOffset = header.poolOffset;
+    bundle->poolSize = header.poolSize;
+
+    /* Only the directory is kept in memory, names are read back from the pool on hash match */
+    bundle->dir = malloc(header.count * sizeof(ELFLoaderBundleEntry_t));
+    if (header.count && !bundle->dir) {
+        ERR("Bundle directory malloc failled");
+        goto err;
+    }
+    BUNDLE_GETDATA(bundle, header.dirOffset, bundle->dir, header.count * sizeof(ELFLoaderBundleEntry_t));
+    MSG("Bundle: %i modules", header.count);
+    return bundle;
+
+err:
+    elfLoaderBundleClose(bundle);
+    return NULL;
+}
+
+
+ELFLoaderBundle_t *elfLoaderBundleOpen(LOADER_FD_T fd) {
+    return elfLoaderBundleOpenAt(fd, 0);
+}
+
+
+unsigned int elfLoaderBundleCount(ELFLoaderBundle_t *bundle) {
+    return bundle->count;
+}
+
+
+const ELFLoaderBundleEntry_t *elfLoaderBundleGetEntry(ELFLoaderBundle_t *bundle, unsigned int index) {
+    if (index >= bundle->count) {
+        return NULL;
+    }
+    return &bundle->dir[index];
+}
+
+
+int elfLoaderBundleGetName(ELFLoaderBundle_t *bundle, const ELFLoaderBundleEntry_t *entry, char *name, size_t nlen) {
+    return readName(bundle, entry->nameOffset, name, nlen);
+}
+
+
+const ELFLoaderBundleEntry_t *elfLoaderBundleFind(ELFLoaderBundle_t *bundle, const char *name) {
+    uint32_t h = fnv1a(2166136261, name, strlen(name));
+    /* Lower bound on nameHash, then check names of the colliding entries */
+    unsigned int lo = 0;
+    unsigned int hi = bundle->count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (bundle->dir[mid].nameHash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < bundle->count && bundle->dir[lo].nameHash == h; lo++) {
+        char entryName[33];
+        if (readName(bundle, bundle->dir[lo].nameOffset, entryName, sizeof(entryName)) == 0 && strcmp(entryName, name) == 0) {
+            return &bundle->dir[lo];
+        }
+    }
+    return NULL;
+}
+
+
+int elfLoaderBundleVerify(ELFLoaderBundle_t *bundle, const ELFLoaderBundleEntry_t *entry) {
+    uint8_t buffer[64];
+    uint32_t h = 2166136261;
+    for (uint32_t off = 0; off < entry->size; off += sizeof(buffer)) {
+        size_t len = entry->size - off;
+        if (len > sizeof(buffer)) {
+            len = sizeof(buffer);
+        }
+        BUNDLE_GETDATA(bundle, entry->offset + off, buffer, len);
+        h = fnv1a(h, buffer, len);
+    }
+    if (h != entry->hash) {
+        ERR("Bundle module hash mismatch: %08X != %08X", h, entry->hash);
+        return -1;
+    }
+    return 0;
+#ifdef __linux__
+err:
+    return -1;
+#endif
+}
+
+
+/* Context of a bundle module, not loaded yet */
+ELFLoaderContext_t *elfLoaderBundleInit(ELFLoaderBundle_t *bundle, const char *name, const ELFLoaderEnv_t *env) {
+    const ELFLoaderBundleEntry_t *entry = elfLoaderBundleFind(bundle, name);
+    if (!entry) {
+        ERR("Bundle module not found: %s", name);
+        return NULL;
+    }
+    return elfLoaderInitAt(bundle->fd, bundle->offset + entry->offset, env);
+}
+
+
+ELFLoaderContext_t *elfLoaderBundleLoad(ELFLoaderBundle_t *bundle, const char *name, const ELFLoaderEnv_t *env) {
+    ELFLoaderContext_t *ctx = elfLoaderBundleInit(bundle, name, env);
+    if (!ctx || elfLoaderLoadAndRelocate(ctx) != 0) {
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return ctx;
+}
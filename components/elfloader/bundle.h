@@ -0,0 +1,27 @@
+/* This file was automatically generated.  Do not edit! */
+
+#include "loader.h"
+
+#define ELFLOADER_BUNDLE_MAGIC 0x42464c45
+#define ELFLOADER_BUNDLE_VERSION 1
+
+typedef struct {
+    uint32_t nameHash; /*!< FNV-1a hash of module name */
+    uint32_t nameOffset; /*!< Offset of module name in string pool */
+    uint32_t offset; /*!< Offset of module elf file in bundle */
+    uint32_t size; /*!< Size of module elf file */
+    uint32_t hash; /*!< FNV-1a hash of module elf file */
+} ELFLoaderBundleEntry_t;
+
+typedef struct ELFLoaderBundle_t ELFLoaderBundle_t;
+
+ELFLoaderContext_t *elfLoaderBundleLoad(ELFLoaderBundle_t *bundle,const char *name,const ELFLoaderEnv_t *env);
+ELFLoaderContext_t *elfLoaderBundleInit(ELFLoaderBundle_t *bundle,const char *name,const ELFLoaderEnv_t *env);
+int elfLoaderBundleVerify(ELFLoaderBundle_t *bundle,const ELFLoaderBundleEntry_t *entry);
+const ELFLoaderBundleEntry_t *elfLoaderBundleFind(ELFLoaderBundle_t *bundle,const char *name);
+int elfLoaderBundleGetName(ELFLoaderBundle_t *bundle,const ELFLoaderBundleEntry_t *entry,char *name,size_t nlen);
+const ELFLoaderBundleEntry_t *elfLoaderBundleGetEntry(ELFLoaderBundle_t *bundle,unsigned int index);
+unsigned int elfLoaderBundleCount(ELFLoaderBundle_t *bundle);
+ELFLoaderBundle_t *elfLoaderBundleOpen(LOADER_FD_T fd);
+ELFLoaderBundle_t *elfLoaderBundleOpenAt(LOADER_FD_T fd,off_t offset);
+void elfLoaderBundleClose(ELFLoaderBundle_t *bundle);
@@ -0,0 +1,366 @@
+/*
+ * A resident elf module cache for esp32
+ *
+ * Copyright (C) 2017 by niicoooo <1niicoooo1@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Loaded modules stay resident until their memory is needed by another one.
+ * Memory is accounted with elfLoaderGetRequirements: exec against the exec
+ * budget, data and bss against the data budget. The least recently used
+ * module that is not in use is evicted first.
+ *
+ * The cache lock is not held while a module loads: resident modules can be
+ * used meanwhile, callers asking for the module being loaded wait for it.
+ * Prefetched modules are loaded with elfLoaderLoadAsync and are resident,
+ * unreferenced, once loaded.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "async.h"
+
+
+#if INTERFACE
+#include "loader.h"
+
+/* Context of the named module, not loaded yet, or NULL when there is no such module */
+typedef ELFLoaderContext_t *(*ELFLoaderCacheSource_t)(void *arg, const char *name, const ELFLoaderEnv_t *env);
+
+typedef struct {
+    unsigned int hits; /*!< Requests served by a resident module */
+    unsigned int misses; /*!< Requests that loaded the module */
+    unsigned int evictions; /*!< Modules freed to make room */
+    unsigned int prefetches; /*!< Prefetch loads started */
+    unsigned int prefetchHits; /*!< Prefetched modules later requested */
+    unsigned int prefetchWasted; /*!< Prefetched modules evicted or failed before being requested */
+    unsigned int modules; /*!< Resident modules */
+    size_t exec; /*!< Bytes of executable memory used by resident modules */
+    size_t data; /*!< Bytes of data memory used by resident modules */
+} ELFLoaderCacheStats_t;
+
+typedef struct ELFLoaderCache_t ELFLoaderCache_t;
+
+#endif
+
+
+#ifdef __linux__
+
+#define MSG(...) printf(__VA_ARGS__); printf("\n");
+#define ERR(...) printf(__VA_ARGS__); printf("\n");
+
+#else
+
+#include "esp_log.h"
+static const char* TAG = "elfLoaderCache";
+#define MSG(...) ESP_LOGI(TAG,  __VA_ARGS__);
+#define ERR(...) ESP_LOGE(TAG,  __VA_ARGS__);
+
+#endif
+
+typedef struct ELFLoaderCacheEntry_t {
+    struct ELFLoaderCache_t *cache;
+    char *name;
+    ELFLoaderContext_t *ctx;
+    size_t exec;
+    size_t data;
+    unsigned int refs;
+    unsigned int lastUse;
+    int loading;
+    int prefetched;
+    struct ELFLoaderCacheEntry_t *next;
+} ELFLoaderCacheEntry_t;
+
+struct ELFLoaderCache_t {
+    const ELFLoaderEnv_t *env;
+    ELFLoaderCacheSource_t source;
+    void *arg;
+    size_t execBudget;
+    size_t dataBudget;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int tick;
+    ELFLoaderCacheStats_t stats;
+    ELFLoaderCacheEntry_t *entries;
+};
+
+
+static ELFLoaderCacheEntry_t *findEntry(ELFLoaderCache_t *cache, const char *name) {
+    for (ELFLoaderCacheEntry_t *e = cache->entries; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+
+static void removeEntry(ELFLoaderCache_t *cache, ELFLoaderCacheEntry_t *entry) {
+    for (ELFLoaderCacheEntry_t **e = &cache->entries; *e != NULL; e = &(*e)->next) {
+        if (*e == entry) {
+            *e = entry->next;
+            break;
+        }
+    }
+    cache->stats.exec -= entry->exec;
+    cache->stats.data -= entry->data;
+    if (entry->ctx && !entry->loading) {
+        cache->stats.modules--;
+    }
+    if (entry->prefetched) {
+        cache->stats.prefetchWasted++;
+    }
+    elfLoaderFree(entry->ctx);
+    free(entry->name);
+    free(entry);
+}
+
+
+/* Evict unused modules, least recently used first, until exec and data bytes fit. Called locked */
+static int makeRoom(ELFLoaderCache_t *cache, size_t exec, size_t data) {
+    if (exec > cache->execBudget || data > cache->dataBudget) {
+        return -1;
+    }
+    while (cache->stats.exec + exec > cache->execBudget || cache->stats.data + data > cache->dataBudget) {
+        ELFLoaderCacheEntry_t *lru = NULL;
+        for (ELFLoaderCacheEntry_t *e = cache->entries; e != NULL; e = e->next) {
+            if (!e->refs && !e->loading && (!lru || e->lastUse < lru->lastUse)) {
+                lru = e;
+            }
+        }
+        if (!lru) {
+            return -1;
+        }
+        MSG("Evicting %s", lru->name);
+        removeEntry(cache, lru);
+        cache->stats.evictions++;
+    }
+    return 0;
+}
+
+
+/* New entry for a module to load. Called locked */
+static ELFLoaderCacheEntry_t *addEntry(ELFLoaderCache_t *cache, const char *name) {
+    ELFLoaderCacheEntry_t *entry = malloc(sizeof(ELFLoaderCacheEntry_t));
+    assert(entry);
+    memset(entry, 0, sizeof(ELFLoaderCacheEntry_t));
+    entry->cache = cache;
+    entry->name = strdup(name);
+    assert(entry->name);
+    entry->loading = 1;
+    entry->next = cache->entries;
+    cache->entries = entry;
+    return entry;
+}
+
+
+/* Context of the entry module, with its memory reserved: other loads see it as used */
+static ELFLoaderContext_t *reserve(ELFLoaderCache_t *cache, ELFLoaderCacheEntry_t *entry) {
+    ELFLoaderRequirements_t req;
+    ELFLoaderContext_t *ctx = cache->source(cache->arg, entry->name, cache->env);
+    if (!ctx || elfLoaderGetRequirements(ctx, &req) != 0) {
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    pthread_mutex_lock(&cache->lock);
+    int r = makeRoom(cache, req.exec, req.data + req.bss);
+    if (r == 0) {
+        entry->exec = req.exec;
+        entry->data = req.data + req.bss;
+        cache->stats.exec += entry->exec;
+        cache->stats.data += entry->data;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (r != 0) {
+        ERR("No room for %s", entry->name);
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+/* End the load of entry, ctx is NULL when it failed */
+static ELFLoaderContext_t *finish(ELFLoaderCache_t *cache, ELFLoaderCacheEntry_t *entry, ELFLoaderContext_t *ctx, unsigned int refs) {
+    pthread_mutex_lock(&cache->lock);
+    entry->ctx = ctx;
+    if (!ctx) {
+        removeEntry(cache, entry);
+    } else {
+        entry->loading = 0;
+        entry->refs = refs;
+        entry->lastUse = ++cache->tick;
+        cache->stats.modules++;
+    }
+    pthread_cond_broadcast(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+    return ctx;
+}
+
+
+ELFLoaderCache_t *elfLoaderCacheCreate(const ELFLoaderEnv_t *env, size_t execBudget, size_t dataBudget, ELFLoaderCacheSource_t source, void *arg) {
+    ELFLoaderCache_t *cache = malloc(sizeof(ELFLoaderCache_t));
+    assert(cache);
+    memset(cache, 0, sizeof(ELFLoaderCache_t));
+    cache->env = env;
+    cache->source = source;
+    cache->arg = arg;
+    cache->execBudget = execBudget;
+    cache->dataBudget = dataBudget;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+    return cache;
+}
+
+
+static int isLoading(ELFLoaderCache_t *cache) {
+    for (ELFLoaderCacheEntry_t *e = cache->entries; e != NULL; e = e->next) {
+        if (e->loading) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Wait for the prefetches, then free all modules: none may be in use */
+void elfLoaderCacheDestroy(ELFLoaderCache_t *cache) {
+    if (cache) {
+        pthread_mutex_lock(&cache->lock);
+        while (isLoading(cache)) {
+            pthread_cond_wait(&cache->cond, &cache->lock);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        while (cache->entries) {
+            assert(!cache->entries->refs);
+            removeEntry(cache, cache->entries);
+        }
+        pthread_cond_destroy(&cache->cond);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+    }
+}
+
+
+/*
+ * Get the named module, loading it on a miss or waiting for its prefetch.
+ * The module stays resident at least until released with
+ * elfLoaderCacheRelease. NULL when the module can not be loaded, or does not
+ * fit with the modules in use.
+ */
+ELFLoaderContext_t *elfLoaderCacheGet(ELFLoaderCache_t *cache, const char *name) {
+    pthread_mutex_lock(&cache->lock);
+    ELFLoaderCacheEntry_t *entry = findEntry(cache, name);
+    while (entry && entry->loading) {
+        pthread_cond_wait(&cache->cond, &cache->lock);
+        entry = findEntry(cache, name);
+    }
+    if (entry) {
+        cache->stats.hits++;
+        if (entry->prefetched) {
+            cache->stats.prefetchHits++;
+            entry->prefetched = 0;
+        }
+        entry->refs++;
+        entry->lastUse = ++cache->tick;
+        pthread_mutex_unlock(&cache->lock);
+        return entry->ctx;
+    }
+    cache->stats.misses++;
+    entry = addEntry(cache, name);
+    pthread_mutex_unlock(&cache->lock);
+
+    ELFLoaderContext_t *ctx = reserve(cache, entry);
+    if (ctx && elfLoaderLoadAndRelocate(ctx) != 0) {
+        elfLoaderFree(ctx);
+        ctx = NULL;
+    }
+    return finish(cache, entry, ctx, 1);
+}
+
+
+static void prefetchDone(void *arg, ELFLoaderAsync_t *async, ELFLoaderAsyncStatus_t status) {
+    ELFLoaderCacheEntry_t *entry = arg;
+    (void) status;
+    finish(entry->cache, entry, elfLoaderAsyncFinish(async), 0);
+}
+
+
+/*
+ * Start loading the named module in the background, unless it is resident or
+ * loading already. The load runs on its own thread, see elfLoaderLoadAsync;
+ * a later elfLoaderCacheGet waits for it.
+ */
+int elfLoaderCachePrefetch(ELFLoaderCache_t *cache, const char *name) {
+    pthread_mutex_lock(&cache->lock);
+    if (findEntry(cache, name)) {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    cache->stats.prefetches++;
+    ELFLoaderCacheEntry_t *entry = addEntry(cache, name);
+    entry->prefetched = 1;
+    pthread_mutex_unlock(&cache->lock);
+
+    ELFLoaderContext_t *ctx = reserve(cache, entry);
+    if (!ctx) {
+        finish(cache, entry, NULL, 0);
+        return -1;
+    }
+    if (!elfLoaderLoadAsync(ctx, prefetchDone, entry)) {
+        finish(cache, entry, NULL, 0);
+        return -1;
+    }
+    return 0;
+}
+
+
+void elfLoaderCacheRelease(ELFLoaderCache_t *cache, ELFLoaderContext_t *ctx) {
+    pthread_mutex_lock(&cache->lock);
+    for (ELFLoaderCacheEntry_t *e = cache->entries; e != NULL; e = e->next) {
+        if (e->ctx == ctx && !e->loading) {
+            assert(e->refs);
+            e->refs--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+/* Free all the modules not in use */
+void elfLoaderCacheFlush(ELFLoaderCache_t *cache) {
+    pthread_mutex_lock(&cache->lock);
+    ELFLoaderCacheEntry_t *e = cache->entries;
+    while (e != NULL) {
+        ELFLoaderCacheEntry_t *next = e->next;
+        if (!e->refs && !e->loading) {
+            removeEntry(cache, e);
+        }
+        e = next;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+void elfLoaderCacheGetStats(ELFLoaderCache_t *cache, ELFLoaderCacheStats_t *stats) {
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
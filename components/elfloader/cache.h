@@ -0,0 +1,28 @@
+/* This file was automatically generated.  Do not edit! */
+
+#include "loader.h"
+
+/* Context of the named module, not loaded yet, or NULL when there is no such module */
+typedef ELFLoaderContext_t *(*ELFLoaderCacheSource_t)(void *arg, const char *name, const ELFLoaderEnv_t *env);
+
+typedef struct {
+    unsigned int hits; /*!< Requests served by a resident module */
+    unsigned int misses; /*!< Requests that loaded the module */
+    unsigned int evictions; /*!< Modules freed to make room */
+    unsigned int prefetches; /*!< Prefetch loads started */
+    unsigned int prefetchHits; /*!< Prefetched modules later requested */
+    unsigned int prefetchWasted; /*!< Prefetched modules evicted or failed before being requested */
+    unsigned int modules; /*!< Resident modules */
+    size_t exec; /*!< Bytes of executable memory used by resident modules */
+    size_t data; /*!< Bytes of data memory used by resident modules */
+} ELFLoaderCacheStats_t;
+
+typedef struct ELFLoaderCache_t ELFLoaderCache_t;
+
+void elfLoaderCacheGetStats(ELFLoaderCache_t *cache,ELFLoaderCacheStats_t *stats);
+void elfLoaderCacheFlush(ELFLoaderCache_t *cache);
+void elfLoaderCacheRelease(ELFLoaderCache_t *cache,ELFLoaderContext_t *ctx);
+int elfLoaderCachePrefetch(ELFLoaderCache_t *cache,const char *name);
+ELFLoaderContext_t *elfLoaderCacheGet(ELFLoaderCache_t *cache,const char *name);
+void elfLoaderCacheDestroy(ELFLoaderCache_t *cache);
+ELFLoaderCache_t *elfLoaderCacheCreate(const ELFLoaderEnv_t *env,size_t execBudget,size_t dataBudget,ELFLoaderCacheSource_t source,void *arg);
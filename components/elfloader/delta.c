@@ -0,0 +1,274 @@
+/*
+ * A elf module delta applier for esp32
+ *
+ * Copyright (C) 2017 by niicoooo <1niicoooo1@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Rebuild a new module from the module currently stored and a delta built
+ * by tools/elfdelta.py. The delta is fed in chunks as it is received, the
+ * new module is written sequentially through a callback: RAM use does not
+ * depend on the module size.
+ *
+ * The old module is read through LOADER_FD_T, the new module must be written
+ * to another slot: COPY operations read the old module in any order.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "unaligned.h"
+
+
+#if INTERFACE
+#include "loader.h"
+
+#define ELFLOADER_DELTA_MAGIC 0x44464c45
+#define ELFLOADER_DELTA_VERSION 1
+
+typedef int (*ELFLoaderDeltaWrite_t)(void *arg, const void *data, size_t size);
+
+typedef struct ELFLoaderDelta_t ELFLoaderDelta_t;
+
+#endif
+
+
+#ifdef __linux__
+
+#define MSG(...) printf(__VA_ARGS__); printf("\n");
+#define ERR(...) printf(__VA_ARGS__); printf("\n");
+
+#define DELTA_GETDATA(delta, off, buffer, size) \
+    if(elfLoaderReadAt(delta->old, off, buffer, size) != 0) { goto err; }
+
+#else
+
+#include "esp_log.h"
+static const char* TAG = "elfLoaderDelta";
+#define MSG(...) ESP_LOGI(TAG,  __VA_ARGS__);
+#define ERR(...) ESP_LOGE(TAG,  __VA_ARGS__);
+
+#define DELTA_GETDATA(delta, off, buffer, size) \
+    unalignedCpy(buffer, delta->old + (off), size);
+
+#endif
+
+#define DELTA_OP_COPY 0x01
+#define DELTA_OP_ADD 0x02
+
+typedef enum {
+    DELTA_HEADER,
+    DELTA_OP,
+    DELTA_ADD_DATA,
+    DELTA_ERROR,
+} ELFLoaderDeltaState_t;
+
+struct ELFLoaderDelta_t {
+    LOADER_FD_T old;
+    ELFLoaderDeltaWrite_t write;
+    void *arg;
+
+    ELFLoaderDeltaState_t state;
+    uint8_t buffer[24];
+    size_t buffered;
+    size_t remaining;
+
+    uint32_t newSize;
+    uint32_t newHash;
+    uint32_t written;
+    uint32_t hash;
+};
+
+
+static uint32_t fnv1a(uint32_t h, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size--) {
+        h ^= *p++;
+        h *= 16777619;
+    }
+    return h;
+}
+
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+static int emit(ELFLoaderDelta_t *delta, const void *data, size_t size) {
+    if (delta->written + size > delta->newSize) {
+        ERR("Delta output overflow");
+        return -1;
+    }
+    if (delta->write(delta->arg, data, size) != 0) {
+        ERR("Delta write failed");
+        return -1;
+    }
+    delta->hash = fnv1a(delta->hash, data, size);
+    delta->written += size;
+    return 0;
+}
+
+
+static int checkOld(ELFLoaderDelta_t *delta, uint32_t oldSize, uint32_t oldHash) {
+    uint8_t chunk[64];
+    uint32_t h = 2166136261;
+    for (uint32_t off = 0; off < oldSize; off += sizeof(chunk)) {
+        size_t len = oldSize - off < sizeof(chunk) ? oldSize - off : sizeof(chunk);
+        DELTA_GETDATA(delta, off, chunk, len);
+        h = fnv1a(h, chunk, len);
+    }
+    if (h != oldHash) {
+        ERR("Delta does not apply to this module");
+        return -1;
+    }
+    return 0;
+#ifdef __linux__
+err:
+    ERR("Error reading old module");
+    return -1;
+#endif
+}
+
+
+static int copyOld(ELFLoaderDelta_t *delta, uint32_t off, uint32_t size) {
+    uint8_t chunk[64];
+    while (size > 0) {
+        size_t len = size < sizeof(chunk) ? size : sizeof(chunk);
+        DELTA_GETDATA(delta, off, chunk, len);
+        if (emit(delta, chunk, len) != 0) {
+            return -1;
+        }
+        off += len;
+        size -= len;
+    }
+    return 0;
+#ifdef __linux__
+err:
+    ERR("Error reading old module");
+    return -1;
+#endif
+}
+
+
+/* Accumulate up to size bytes of a header in delta->buffer, returns the bytes consumed */
+static size_t fill(ELFLoaderDelta_t *delta, const uint8_t *data, size_t len, size_t size) {
+    size_t n = size - delta->buffered;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(delta->buffer + delta->buffered, data, n);
+    delta->buffered += n;
+    return n;
+}
+
+
+ELFLoaderDelta_t *elfLoaderDeltaInit(LOADER_FD_T old, ELFLoaderDeltaWrite_t write, void *arg) {
+    ELFLoaderDelta_t *delta = malloc(sizeof(ELFLoaderDelta_t));
+    assert(delta);
+    memset(delta, 0, sizeof(ELFLoaderDelta_t));
+    delta->old = old;
+    delta->write = write;
+    delta->arg = arg;
+    delta->state = DELTA_HEADER;
+    delta->hash = 2166136261;
+    return delta;
+}
+
+
+int elfLoaderDeltaFeed(ELFLoaderDelta_t *delta, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size > 0 && delta->state != DELTA_ERROR) {
+        switch (delta->state) {
+        case DELTA_HEADER: {
+            size_t n = fill(delta, p, size, 24);
+            p += n;
+            size -= n;
+            if (delta->buffered == 24) {
+                delta->buffered = 0;
+                delta->newSize = get32(delta->buffer + 16);
+                delta->newHash = get32(delta->buffer + 20);
+                if (get32(delta->buffer) != ELFLOADER_DELTA_MAGIC || get32(delta->buffer + 4) != ELFLOADER_DELTA_VERSION) {
+                    ERR("Bad delta identification");
+                    delta->state = DELTA_ERROR;
+                } else if (checkOld(delta, get32(delta->buffer + 8), get32(delta->buffer + 12)) != 0) {
+                    delta->state = DELTA_ERROR;
+                } else {
+                    delta->state = DELTA_OP;
+                }
+            }
+            break;
+        }
+        case DELTA_OP: {
+            /* The opcode byte gives the size of the operation header */
+            size_t n = fill(delta, p, size, delta->buffered == 0 ? 1 : (delta->buffer[0] == DELTA_OP_COPY ? 9 : 5));
+            p += n;
+            size -= n;
+            if (delta->buffered < (delta->buffer[0] == DELTA_OP_COPY ? 9 : 5)) {
+                break;
+            }
+            delta->buffered = 0;
+            if (delta->buffer[0] == DELTA_OP_COPY) {
+                if (copyOld(delta, get32(delta->buffer + 1), get32(delta->buffer + 5)) != 0) {
+                    delta->state = DELTA_ERROR;
+                }
+            } else if (delta->buffer[0] == DELTA_OP_ADD) {
+                delta->remaining = get32(delta->buffer + 1);
+                delta->state = delta->remaining ? DELTA_ADD_DATA : DELTA_OP;
+            } else {
+                ERR("Bad delta operation %02X", delta->buffer[0]);
+                delta->state = DELTA_ERROR;
+            }
+            break;
+        }
+        case DELTA_ADD_DATA: {
+            size_t n = delta->remaining < size ? delta->remaining : size;
+            if (emit(delta, p, n) != 0) {
+                delta->state = DELTA_ERROR;
+                break;
+            }
+            p += n;
+            size -= n;
+            delta->remaining -= n;
+            if (delta->remaining == 0) {
+                delta->state = DELTA_OP;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return delta->state == DELTA_ERROR ? -1 : 0;
+}
+
+
+int elfLoaderDeltaFinish(ELFLoaderDelta_t *delta) {
+    int r = -1;
+    if (delta->state == DELTA_ERROR) {
+        ERR("Delta failed");
+    } else if (delta->state != DELTA_OP || delta->buffered != 0) {
+        ERR("Delta truncated");
+    } else if (delta->written != delta->newSize || delta->hash != delta->newHash) {
+        ERR("Delta result mismatch: %i bytes, hash %08X", delta->written, delta->hash);
+    } else {
+        MSG("Delta applied: %i bytes", delta->written);
+        r = 0;
+    }
+    free(delta);
+    return r;
+}
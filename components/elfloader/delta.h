@@ -0,0 +1,14 @@
+/* This file was automatically generated.  Do not edit! */
+
+#include "loader.h"
+
+#define ELFLOADER_DELTA_MAGIC 0x44464c45
+#define ELFLOADER_DELTA_VERSION 1
+
+typedef int (*ELFLoaderDeltaWrite_t)(void *arg, const void *data, size_t size);
+
+typedef struct ELFLoaderDelta_t ELFLoaderDelta_t;
+
+int elfLoaderDeltaFinish(ELFLoaderDelta_t *delta);
+int elfLoaderDeltaFeed(ELFLoaderDelta_t *delta,const void *data,size_t size);
+ELFLoaderDelta_t *elfLoaderDeltaInit(LOADER_FD_T old,ELFLoaderDeltaWrite_t write,void *arg);
@@ -0,0 +1,216 @@
+/*
+ * Loading of elf modules linked together, for esp32
+ *
+ * Copyright (C) 2017 by niicoooo <1niicoooo1@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * The sections of all the modules of a link set are placed in one exec and
+ * one data arena, sized with elfLoaderGetRequirements. The modules are
+ * loaded in two passes of elfLoaderStep: first up to their symbol index,
+ * then relocation. The undefined symbols missing from the env are resolved
+ * against all the modules of the set, whatever their order: modules can
+ * call each other directly, without going through the firmware.
+ *
+ * Sections that do not fit in the arenas, e.g. because of alignment, are
+ * allocated from the heap.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linkset.h"
+
+
+#if INTERFACE
+#include "loader.h"
+
+typedef struct ELFLoaderLinkSet_t ELFLoaderLinkSet_t;
+
+#endif
+
+
+#ifdef __linux__
+
+#define MSG(...) printf(__VA_ARGS__); printf("\n");
+#define ERR(...) printf(__VA_ARGS__); printf("\n");
+
+#include <malloc.h>
+#define LINKSET_ALLOC_EXEC(size) memalign(4, size)
+#define LINKSET_ALLOC_DATA(size) memalign(4, size)
+
+#else
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+static const char* TAG = "elfLoaderLinkSet";
+#define MSG(...) ESP_LOGI(TAG,  __VA_ARGS__);
+#define ERR(...) ESP_LOGE(TAG,  __VA_ARGS__);
+
+#define LINKSET_ALLOC_EXEC(size) heap_caps_malloc(size, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT)
+#define LINKSET_ALLOC_DATA(size) heap_caps_malloc(size, MALLOC_CAP_8BIT)
+
+#endif
+
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+} ELFLoaderArena_t;
+
+struct ELFLoaderLinkSet_t {
+    ELFLoaderContext_t **ctxs;
+    unsigned int count;
+    ELFLoaderArena_t exec;
+    ELFLoaderArena_t data;
+    ELFLoaderAllocator_t allocator;
+    ELFLoaderResolver_t resolver;
+};
+
+
+static void *arenaAlloc(void *arg, size_t size, size_t align, int exec) {
+    ELFLoaderLinkSet_t *set = arg;
+    ELFLoaderArena_t *arena = exec ? &set->exec : &set->data;
+    size_t offset = (arena->used + align - 1) & ~(align - 1);
+    if (arena->base && offset + size <= arena->size) {
+        arena->used = offset + size;
+        return arena->base + offset;
+    }
+    MSG("Arena full, %u bytes from the heap", (unsigned) size);
+    return exec ? LINKSET_ALLOC_EXEC(size) : LINKSET_ALLOC_DATA(size);
+}
+
+
+static void arenaFree(void *arg, void *ptr, int exec) {
+    ELFLoaderLinkSet_t *set = arg;
+    ELFLoaderArena_t *arena = exec ? &set->exec : &set->data;
+    if ((uint8_t*) ptr < arena->base || (uint8_t*) ptr >= arena->base + arena->size) {
+        free(ptr);
+    }
+}
+
+
+static void *resolve(void *arg, const char *name) {
+    ELFLoaderLinkSet_t *set = arg;
+    for (unsigned int i = 0; i < set->count; i++) {
+        void *addr = elfLoaderGetSymbol(set->ctxs[i], name);
+        if (addr) {
+            return addr;
+        }
+    }
+    return NULL;
+}
+
+
+void elfLoaderLinkSetFree(ELFLoaderLinkSet_t *set) {
+    if (set) {
+        for (unsigned int i = 0; i < set->count; i++) {
+            elfLoaderFree(set->ctxs[i]);
+        }
+        free(set->exec.base);
+        free(set->data.base);
+        free(set->ctxs);
+        free(set);
+    }
+}
+
+
+/*
+ * Load and relocate count modules together. ctxs are initialized contexts,
+ * owned by the link set from then on, and freed when the load fails.
+ */
+ELFLoaderLinkSet_t *elfLoaderLinkSetLoad(ELFLoaderContext_t *const *ctxs, unsigned int count) {
+    assert(count > 0);
+    ELFLoaderLinkSet_t *set = malloc(sizeof(ELFLoaderLinkSet_t));
+    assert(set);
+    memset(set, 0, sizeof(ELFLoaderLinkSet_t));
+    set->ctxs = malloc(count * sizeof(ELFLoaderContext_t*));
+    assert(set->ctxs);
+    memcpy(set->ctxs, ctxs, count * sizeof(ELFLoaderContext_t*));
+    set->count = count;
+    set->allocator.arg = set;
+    set->allocator.alloc = arenaAlloc;
+    set->allocator.free = arenaFree;
+    set->resolver.arg = set;
+    set->resolver.resolve = resolve;
+
+    for (unsigned int i = 0; i < count; i++) {
+        ELFLoaderRequirements_t req;
+        if (elfLoaderGetRequirements(ctxs[i], &req) != 0) {
+            goto err;
+        }
+        size_t align = req.align < 4 ? 4 : req.align;
+        set->exec.size += req.exec + align;
+        set->data.size += req.data + req.bss + align;
+        elfLoaderSetAllocator(ctxs[i], &set->allocator);
+        elfLoaderSetResolver(ctxs[i], &set->resolver);
+    }
+    set->exec.base = LINKSET_ALLOC_EXEC(set->exec.size);
+    set->data.base = LINKSET_ALLOC_DATA(set->data.size);
+    if (!set->exec.base || !set->data.base) {
+        ERR("Link set arenas malloc failled");
+        goto err;
+    }
+
+    /* Place and index all the modules, one step at a time not to start relocating */
+    for (unsigned int i = 0; i < count; i++) {
+        int r;
+        do {
+            r = elfLoaderStep(ctxs[i], 1);
+        } while (r > 0 && r < ELFLOADER_STEP_IMPORTS);
+        if (r < 0) {
+            goto err;
+        }
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        if (elfLoaderStep(ctxs[i], (unsigned int) -1) != ELFLOADER_STEP_DONE) {
+            goto err;
+        }
+    }
+    MSG("Link set: %u modules, %u exec and %u data bytes", count, (unsigned) set->exec.used, (unsigned) set->data.used);
+    return set;
+
+err:
+    ERR("Link set load failed");
+    elfLoaderLinkSetFree(set);
+    return NULL;
+}
+
+
+unsigned int elfLoaderLinkSetCount(ELFLoaderLinkSet_t *set) {
+    return set->count;
+}
+
+
+ELFLoaderContext_t *elfLoaderLinkSetGet(ELFLoaderLinkSet_t *set, unsigned int index) {
+    if (index >= set->count) {
+        return NULL;
+    }
+    return set->ctxs[index];
+}
+
+
+/* Address of a symbol of any module of the set, NULL if not found */
+void *elfLoaderLinkSetGetSymbol(ELFLoaderLinkSet_t *set, const char *name) {
+    return resolve(set, name);
+}
+
+
+/* Arena bytes used by the sections */
+void elfLoaderLinkSetGetUsage(ELFLoaderLinkSet_t *set, size_t *exec, size_t *data) {
+    *exec = set->exec.used;
+    *data = set->data.used;
+}
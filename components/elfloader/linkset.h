@@ -0,0 +1,12 @@
+/* This file was automatically generated.  Do not edit! */
+
+#include "loader.h"
+
+typedef struct ELFLoaderLinkSet_t ELFLoaderLinkSet_t;
+
+void elfLoaderLinkSetGetUsage(ELFLoaderLinkSet_t *set,size_t *exec,size_t *data);
+void *elfLoaderLinkSetGetSymbol(ELFLoaderLinkSet_t *set,const char *name);
+ELFLoaderContext_t *elfLoaderLinkSetGet(ELFLoaderLinkSet_t *set,unsigned int index);
+unsigned int elfLoaderLinkSetCount(ELFLoaderLinkSet_t *set);
+ELFLoaderLinkSet_t *elfLoaderLinkSetLoad(ELFLoaderContext_t *const *ctxs,unsigned int count);
+void elfLoaderLinkSetFree(ELFLoaderLinkSet_t *set);
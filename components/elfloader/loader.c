@@ -23,11 +23,21 @@
  * Modified by Jim Huang (jserv.tw@gmail.com)
  */
 
+/*
+ * Thread safety: the loader has no global state. Different contexts can be
+ * loaded, used and freed concurrently, also from the same file or buffer:
+ * reads are positional. The env is only read and can be shared. A context
+ * must be used by one thread at a time, and loads running at the same time
+ * must not share a digest state. Module functions can be called from any
+ * thread once loaded.
+ */
+
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "loader.h"
 #include "elf.h"
@@ -37,6 +47,7 @@
 #if INTERFACE
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifdef __linux__
 #define LOADER_FD_T FILE *
@@ -54,8 +65,81 @@ typedef struct {
     unsigned int exported_size; /*!< Elements on exported symbol array */
 } ELFLoaderEnv_t;
 
+typedef struct {
+    const void *data; /*!< Pointer to fragment data */
+    size_t size; /*!< Fragment size in bytes */
+} ELFLoaderFragment_t;
+
+typedef struct {
+    const ELFLoaderFragment_t *fragments; /*!< Pointer to fragments array, in stream order */
+    unsigned int fragments_size; /*!< Elements on fragments array */
+} ELFLoaderFragments_t;
+
+typedef struct {
+    void *arg; /*!< Reader argument, passed to the callback */
+    int (*read)(void *arg, off_t offset, void *buffer, size_t size); /*!< Read size bytes at offset, 0 on success */
+} ELFLoaderReader_t;
+
+typedef struct {
+    void *arg; /*!< Allocator argument, passed to the callbacks */
+    void *(*alloc)(void *arg, size_t size, size_t align, int exec); /*!< Section memory, NULL when out of memory */
+    void (*free)(void *arg, void *ptr, int exec); /*!< Release section memory, NULL when freed with the allocator */
+} ELFLoaderAllocator_t;
+
+typedef struct {
+    void *arg; /*!< Resolver argument, passed to the callback */
+    void *(*resolve)(void *arg, const char *name); /*!< Address of an undefined symbol, NULL when unknown */
+} ELFLoaderResolver_t;
+
+typedef struct {
+    void *state; /*!< Digest state, passed to the callbacks */
+    void (*init)(void *state); /*!< Start a new digest */
+    void (*update)(void *state, const void *data, size_t size); /*!< Hash size bytes of data */
+    void (*finish)(void *state, uint8_t *digest); /*!< Write the final digest */
+    size_t size; /*!< Digest size in bytes, at most ELFLOADER_DIGEST_MAX */
+} ELFLoaderDigest_t;
+
+#define ELFLOADER_DIGEST_MAX 64
+
+#define ELFLOADER_RELOC_THREADS_MAX 4
+
+/* Relocation entries from which the workers are used, overridden by the build */
+#ifndef ELFLOADER_RELOC_PARALLEL_MIN
+#define ELFLOADER_RELOC_PARALLEL_MIN 512
+#endif
+
+/* elfLoaderStep progress, the phase of the next step */
+#define ELFLOADER_STEP_DONE 0
+#define ELFLOADER_STEP_HEADER 1
+#define ELFLOADER_STEP_SECTIONS 2
+#define ELFLOADER_STEP_DATA 3
+#define ELFLOADER_STEP_DIGEST 4
+#define ELFLOADER_STEP_INDEX 5
+#define ELFLOADER_STEP_IMPORTS 6
+#define ELFLOADER_STEP_RELOCATE 7
+
+/* Largest section or digest data read by an elfLoaderStep step */
+#define ELFLOADER_STEP_CHUNK 256
+
+typedef struct {
+    size_t exec; /*!< Bytes of executable memory */
+    size_t data; /*!< Bytes of initialized data memory */
+    size_t bss; /*!< Bytes of zero initialized data memory */
+    size_t align; /*!< Largest section alignment */
+} ELFLoaderRequirements_t;
+
+typedef struct {
+    unsigned int hits; /*!< Functions acquired already loaded */
+    unsigned int misses; /*!< Functions acquired loaded on demand */
+    unsigned int evictions; /*!< Sections evicted */
+    size_t resident; /*!< Bytes of executable sections loaded */
+} ELFLoaderOverlayStats_t;
+
 typedef struct ELFLoaderContext_t ELFLoaderContext_t;
 
+/* Typed function pointer to a module symbol, called without going through elfLoaderRun */
+#define ELFLOADER_GET_FUNC(ctx, type, name) ((type) elfLoaderGetSymbol(ctx, name))
+
 #endif
 
 
@@ -69,9 +153,33 @@ typedef struct ELFLoaderContext_t ELFLoaderContext_t;
 //#define ERR(...) printf(__VA_ARGS__); printf("\n"); assert(0);
 #define ERR(...) printf(__VA_ARGS__); printf("\n");
 
-#define LOADER_GETDATA(ctx, off, buffer, size) \
-    if(fseek(ctx->fd, off, SEEK_SET) != 0) { assert(0); goto err; }\
-    if(fread(buffer, 1, size, ctx->fd) != size) { assert(0); goto err; }
+#define LOADER_MEMCPY(dest, src, size) memcpy(dest, src, size)
+
+/* Positional read: loads sharing a FILE* do not race on the file position */
+int elfLoaderReadAt(LOADER_FD_T fd, off_t off, void *buffer, size_t size) {
+    int n = fileno(fd);
+    if (n >= 0) {
+        char *dest = buffer;
+        while (size > 0) {
+            ssize_t r = pread(n, dest, size, off);
+            if (r <= 0) {
+                return -1;
+            }
+            dest += r;
+            off += r;
+            size -= r;
+        }
+        return 0;
+    }
+    /* Streams without a file descriptor, as fmemopen() ones: seek and read under the stream lock */
+    int r = 0;
+    flockfile(fd);
+    if (fseek(fd, off, SEEK_SET) != 0 || fread(buffer, 1, size, fd) != size) {
+        r = -1;
+    }
+    funlockfile(fd);
+    return r;
+}
 
 #else
 
@@ -85,24 +193,149 @@ static const char* TAG = "elfLoader";
 #define LOADER_ALLOC_EXEC(size) heap_caps_malloc(size, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT)
 #define LOADER_ALLOC_DATA(size) heap_caps_malloc(size, MALLOC_CAP_8BIT)
 
-#define LOADER_GETDATA(ctx, off, buffer, size) \
-    unalignedCpy(buffer, ctx->fd + off, size);
+#define LOADER_MEMCPY(dest, src, size) unalignedCpy(dest, (void*) (src), size)
+
+int elfLoaderReadAt(LOADER_FD_T fd, off_t off, void *buffer, size_t size) {
+    unalignedCpy(buffer, fd + off, size);
+    return 0;
+}
 
 #endif
 
+#define LOADER_GETDATA(ctx, off, buffer, size) \
+    if(readData(ctx, off, buffer, size) != 0) { goto err; }
+
+/* Stack of the relocation workers and of the pipeline producer */
+#define ELFLOADER_WORKER_STACK_SIZE 4096
+
+#define ELFLOADER_META_MAGIC 0x4d464c45
+#define ELFLOADER_META_VERSION 1
+#define ELFLOADER_META_EXEC 0x01
+#define ELFLOADER_META_NOBITS 0x02
+#define ELFLOADER_META_TEXT 0x04
+
+/* .elfloader.meta section, built by tools/elfmeta.py */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t execSize;
+    uint32_t dataSize;
+    uint32_t bssSize;
+    uint32_t align;
+    uint32_t symtabOffset;
+    uint32_t symtabCount;
+    uint32_t strtabOffset;
+    uint32_t sectionCount;
+    uint32_t importCount;
+    uint32_t exportCount;
+} ELFLoaderMeta_t;
+
+typedef struct {
+    uint32_t secIdx;
+    uint32_t flags;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t align;
+    uint32_t relSecIdx;
+} ELFLoaderMetaSection_t;
+
+typedef struct {
+    uint32_t symIdx;
+    uint32_t nameOffset;
+} ELFLoaderMetaImport_t;
+
+typedef struct {
+    uint32_t nameHash;
+    uint32_t nameOffset;
+    uint32_t secIdx;
+    uint32_t value;
+} ELFLoaderMetaExport_t;
+
+typedef struct {
+    int symIdx;
+    Elf32_Addr addr;
+} ELFLoaderImport_t;
+
+typedef struct {
+    uint32_t nameHash;
+    uint32_t nameOffset;
+    struct ELFLoaderSection_t *section;
+    Elf32_Addr value;
+} ELFLoaderIndexEntry_t;
+
+/* Relocation kept to move its sections, target 0 for an address outside the module */
+typedef struct {
+    uint16_t section;
+    uint16_t target;
+    uint32_t offset;
+    uint32_t value;
+    uint32_t op;
+} ELFLoaderRebaseEntry_t;
+
 typedef struct ELFLoaderSection_t {
     void *data;
     int secIdx;
     size_t size;
     off_t relSecIdx;
+    off_t offset;
+    int nobits;
+    int exec;
+    size_t align;
+    int shared;
+    int mapped;
+    int overlay;
+    int loading;
+    unsigned int refs;
+    unsigned int lastUse;
+    unsigned int visit;
+    int depsKnown;
+    unsigned int depCount;
+    struct ELFLoaderSection_t **deps;
+    uint32_t hash;
     struct ELFLoaderSection_t* next;
 } ELFLoaderSection_t;
 
+/* Section nodes, allocated ELFLOADER_SLAB_MIN at first then twice as many each time */
+#define ELFLOADER_SLAB_MIN 4
+
+typedef struct ELFLoaderSlab_t {
+    struct ELFLoaderSlab_t *next;
+    unsigned int size;
+    unsigned int used;
+    ELFLoaderSection_t nodes[];
+} ELFLoaderSlab_t;
+
+/* Fragments read cursor */
+typedef struct {
+    unsigned int idx;
+    off_t offset;
+} ELFLoaderCursor_t;
+
 struct ELFLoaderContext_t {
     LOADER_FD_T fd;
+    off_t fdOffset;
+    const ELFLoaderFragments_t *fragments;
+    const ELFLoaderReader_t *reader;
+    ELFLoaderCursor_t cursor;
     void* exec;
     void* text;
     const ELFLoaderEnv_t *env;
+    const ELFLoaderResolver_t *resolver;
+    const ELFLoaderAllocator_t *allocator;
+    const uint8_t *mapData;
+    const uint8_t *mapExec;
+    int loaded;
+    struct ELFLoaderContext_t *base;
+    int shareable;
+    unsigned int relocThreads;
+    int pipelined;
+    int cancelled;
+    int *cancel;
+
+    const ELFLoaderDigest_t *digest;
+    const uint8_t *digestExpected;
+    off_t digestMark;
+    off_t imageSize;
 
     size_t e_shnum;
     off_t e_shoff;
@@ -112,13 +345,119 @@ struct ELFLoaderContext_t {
     off_t symtab_offset;
     off_t strtab_offset;
 
+    off_t metaOffset;
+    ELFLoaderMeta_t meta;
+    ELFLoaderImport_t *imports;
+
+    ELFLoaderIndexEntry_t *index;
+    unsigned int indexCount;
+    int indexed;
+
+    int stepPhase;
+    unsigned int stepIdx;
+    ELFLoaderSection_t *stepSection;
+    size_t stepOffset;
+    size_t stepCount;
+    Elf32_Shdr stepRelHdr;
+
+    size_t overlayBudget;
+    unsigned int overlayCount;
+    unsigned int overlayTick;
+    unsigned int overlayVisit;
+    ELFLoaderSection_t **overlayList;
+    ELFLoaderOverlayStats_t overlayStats;
+    pthread_mutex_t overlayLock;
+
+    int hashed;
+
+    int rebasable;
+    ELFLoaderRebaseEntry_t *rebase;
+    size_t rebaseCount;
+    size_t rebaseSize;
+
+    ELFLoaderSlab_t *slabs;
+    ELFLoaderSection_t *freeNodes;
+    struct ELFLoaderContext_t *slabOwner;
+
     ELFLoaderSection_t* section;
+    ELFLoaderSection_t* patches;
 };
 
 
 /*** Read data functions ***/
 
 
+/*
+ * Threads reading a context alongside its loading thread, the relocation
+ * workers and the pipeline producer, have their own cursor: the context is
+ * otherwise only read by them.
+ */
+static __thread ELFLoaderCursor_t *threadCursor;
+
+static int readFragments(ELFLoaderContext_t *ctx, off_t off, void *buffer, size_t size) {
+    const ELFLoaderFragments_t *f = ctx->fragments;
+    ELFLoaderCursor_t *c = threadCursor ? threadCursor : &ctx->cursor;
+    /* Reads are mostly forward: restart from the cached fragment, or from the first one when seeking back */
+    if (off < c->offset) {
+        c->idx = 0;
+        c->offset = 0;
+    }
+    while (c->idx < f->fragments_size && off >= c->offset + f->fragments[c->idx].size) {
+        c->offset += f->fragments[c->idx].size;
+        c->idx++;
+    }
+    unsigned int idx = c->idx;
+    size_t pos = off - c->offset;
+    char *dest = buffer;
+    while (size > 0) {
+        if (idx >= f->fragments_size) {
+            ERR("Read out of fragments: offset %i", (int) off);
+            return -1;
+        }
+        size_t len = f->fragments[idx].size - pos;
+        if (len > size) {
+            len = size;
+        }
+        LOADER_MEMCPY(dest, (const char*) f->fragments[idx].data + pos, len);
+        dest += len;
+        size -= len;
+        pos = 0;
+        idx++;
+    }
+    return 0;
+}
+
+
+static int readReader(ELFLoaderContext_t *ctx, off_t off, void *buffer, size_t size) {
+    /* Readers write with plain byte accesses, IRAM destinations go through a bounce buffer */
+    char chunk[64];
+    char *dest = buffer;
+    while (size > 0) {
+        size_t len = size < sizeof(chunk) ? size : sizeof(chunk);
+        if (ctx->reader->read(ctx->reader->arg, off, chunk, len) != 0) {
+            ERR("Reader failed: offset %i", (int) off);
+            return -1;
+        }
+        LOADER_MEMCPY(dest, chunk, len);
+        dest += len;
+        off += len;
+        size -= len;
+    }
+    return 0;
+}
+
+
+static int readData(ELFLoaderContext_t *ctx, off_t off, void *buffer, size_t size) {
+    if (ctx->fragments) {
+        return readFragments(ctx, off, buffer, size);
+    }
+    if (ctx->reader) {
+        return readReader(ctx, off, buffer, size);
+    }
+    return elfLoaderReadAt(ctx->fd, ctx->fdOffset + off, buffer, size);
+}
+
+
 static int readSection(ELFLoaderContext_t *ctx, int n, Elf32_Shdr *h, char *name, size_t name_len) {
     off_t offset = ctx->e_shoff + n * sizeof(Elf32_Shdr);
     LOADER_GETDATA(ctx, offset, h, sizeof(Elf32_Shdr));
@@ -128,10 +467,8 @@ static int readSection(ELFLoaderContext_t *ctx, int n, Elf32_Shdr *h, char *name
         LOADER_GETDATA(ctx, offset, name, name_len);
     }
     return 0;
-#ifdef __linux
 err:
     return -1;
-#endif
 }
 
 static int readSymbol(ELFLoaderContext_t *ctx, int n, Elf32_Sym *sym, char *name, size_t nlen) {
@@ -145,16 +482,115 @@ static int readSymbol(ELFLoaderContext_t *ctx, int n, Elf32_Sym *sym, char *name
         return readSection(ctx, sym->st_shndx, &shdr, name, nlen);
     }
     return 0;
-#ifdef __linux
 err:
     return -1;
-#endif
+}
+
+
+static int readName(ELFLoaderContext_t *ctx, off_t offset, char *name, size_t nlen) {
+    LOADER_GETDATA(ctx, ctx->strtab_offset + offset, name, nlen - 1);
+    name[nlen - 1] = 0;
+    return 0;
+err:
+    return -1;
+}
+
+
+/*** Digest functions ***/
+
+
+static void digestUpdate(ELFLoaderContext_t *ctx, const void *data, size_t size) {
+    /* Loaded sections may be in IRAM: bounce through a buffer instead of hashing in place */
+    uint8_t buffer[64];
+    const char *src = data;
+    while (size > 0) {
+        size_t len = size < sizeof(buffer) ? size : sizeof(buffer);
+        LOADER_MEMCPY(buffer, src, len);
+        ctx->digest->update(ctx->digest->state, buffer, len);
+        src += len;
+        size -= len;
+    }
+}
+
+
+static int digestSkipTo(ELFLoaderContext_t *ctx, off_t off) {
+    uint8_t buffer[128];
+    while (ctx->digestMark < off) {
+        size_t len = off - ctx->digestMark;
+        if (len > sizeof(buffer)) {
+            len = sizeof(buffer);
+        }
+        LOADER_GETDATA(ctx, ctx->digestMark, buffer, len);
+        ctx->digest->update(ctx->digest->state, buffer, len);
+        ctx->digestMark += len;
+    }
+    return 0;
+err:
+    ERR("Error reading digest data");
+    return -1;
+}
+
+
+/*
+ * Hash data just read at offset off. The digest is computed in file order: bytes
+ * between the previous read and off are read once for the digest only, bytes
+ * already hashed are skipped.
+ */
+static int digestData(ELFLoaderContext_t *ctx, off_t off, const void *data, size_t size) {
+    if (!ctx->digest || off + (off_t) size <= ctx->digestMark) {
+        return 0;
+    }
+    if (digestSkipTo(ctx, off) != 0) {
+        return -1;
+    }
+    size_t skip = ctx->digestMark - off;
+    digestUpdate(ctx, (const char*) data + skip, size - skip);
+    ctx->digestMark = off + size;
+    return 0;
+}
+
+
+static int digestCheck(ELFLoaderContext_t *ctx) {
+    if (!ctx->digest) {
+        return 0;
+    }
+    uint8_t digest[ELFLOADER_DIGEST_MAX];
+    uint8_t embedded[ELFLOADER_DIGEST_MAX];
+    const uint8_t *expected = ctx->digestExpected;
+    if (digestSkipTo(ctx, ctx->imageSize) != 0) {
+        return -1;
+    }
+    ctx->digest->finish(ctx->digest->state, digest);
+    if (!expected) {
+        /* Embedded digest: appended right after the elf image */
+        LOADER_GETDATA(ctx, ctx->imageSize, embedded, ctx->digest->size);
+        expected = embedded;
+    }
+    if (memcmp(digest, expected, ctx->digest->size) != 0) {
+        ERR("Digest mismatch");
+        return -1;
+    }
+    MSG("Digest ok");
+    return 0;
+err:
+    ERR("Error reading embedded digest");
+    return -1;
 }
 
 
 /*** Relocation functions ***/
 
 
+/* Worker threads use copies of the context, the flag is always read through ctx->cancel */
+static int isCancelled(ELFLoaderContext_t *ctx) {
+    if (__atomic_load_n(ctx->cancel, __ATOMIC_RELAXED)) {
+        ERR("Load cancelled");
+        return 1;
+    }
+    return 0;
+}
+
+
 static const char *type2String(int symt) {
 #define STRCASE(name) case name: return #name;
     switch (symt) {
@@ -196,6 +632,11 @@ static int relocateSymbol(Elf32_Addr relAddr, int type, Elf32_Addr symAddr, Elf3
                 ERR("Relocation: L32R error");
                 return -1;
             }
+            /* The literal is below the instruction, within 256 KB */
+            if ((delta >= 0) || (delta < - (1 << 18))) {
+                ERR("Relocation: L32R out of range");
+                return -1;
+            }
             delta =  delta >> 2;
             unalignedSet8((void*)(relAddr + 1), ((uint8_t*)&delta)[0]);
             unalignedSet8((void*)(relAddr + 2), ((uint8_t*)&delta)[1]);
@@ -310,23 +751,58 @@ static ELFLoaderSection_t *findSection(ELFLoaderContext_t* ctx, int index) {
 }
 
 
+/* Undefined symbols not in the env: ask the resolver */
+static Elf32_Addr resolveSymAddr(ELFLoaderContext_t* ctx, const char *sName) {
+    void *addr = ctx->resolver ? ctx->resolver->resolve(ctx->resolver->arg, sName) : NULL;
+    return addr ? (Elf32_Addr) addr : 0xffffffff;
+}
+
+
 static Elf32_Addr findSymAddr(ELFLoaderContext_t* ctx, Elf32_Sym *sym, const char *sName) {
     for (int i = 0; i < ctx->env->exported_size; i++) {
         if (strcmp(ctx->env->exported[i].name, sName) == 0) {
             return (Elf32_Addr)(ctx->env->exported[i].ptr);
         }
     }
+    if (sym->st_shndx == SHN_UNDEF) {
+        return resolveSymAddr(ctx, sName);
+    }
     ELFLoaderSection_t *symSec = findSection(ctx, sym->st_shndx);
     if (symSec)
         return ((Elf32_Addr) symSec->data) + sym->st_value;
+    /* A patch finds the globals of the sections it does not load in its module */
+    if (ctx->base && ELF32_ST_BIND(sym->st_info) != STB_LOCAL) {
+        return resolveSymAddr(ctx, sName);
+    }
     return 0xffffffff;
 }
 
 
-static int relocateSection(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+static Elf32_Addr findImportAddr(ELFLoaderContext_t* ctx, int symIdx) {
+    /* Imports are sorted by symbol index */
+    int lo = 0;
+    int hi = ctx->meta.importCount;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ctx->imports[mid].symIdx == symIdx) {
+            return ctx->imports[mid].addr;
+        } else if (ctx->imports[mid].symIdx < symIdx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return 0xffffffff;
+}
+
+
+/* Read the relocation section header of s: 1 when there are entries to relocate, 0 when none */
+static int relocateBegin(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s, Elf32_Shdr *sectHdr) {
+    if (isCancelled(ctx)) {
+        return -1;
+    }
     char name[33] = "<unamed>";
-    Elf32_Shdr sectHdr;
-    if (readSection(ctx, s->relSecIdx, &sectHdr, name, sizeof(name)) != 0) {
+    if (readSection(ctx, s->relSecIdx, sectHdr, name, sizeof(name)) != 0) {
         ERR("Error reading section header");
         return -1;
     }
@@ -334,216 +810,2595 @@ static int relocateSection(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
         MSG("  Section %s: no relocation index", name);
         return 0;
     }
+    if (s->overlay && !s->loading) {
+        MSG("  Section %s: overlay, relocated when loaded", name);
+        return 0;
+    }
     if (!(s->data)) {
         ERR("Section not loaded: %s", name);
         return -1;
     }
 
     MSG("  Section %s", name);
-    int r = 0;
-    Elf32_Rela rel;
-    size_t relEntries = sectHdr.sh_size / sizeof(rel);
     MSG("  Offset   Sym  Type                      relAddr  symAddr  defValue                    Name + addend");
-    for (size_t relCount = 0; relCount < relEntries; relCount++) {
-        LOADER_GETDATA(ctx, sectHdr.sh_offset + relCount * (sizeof(rel)), &rel, sizeof(rel))
-        Elf32_Sym sym;
-        char name[33] = "<unnamed>";
-        int symEntry = ELF32_R_SYM(rel.r_info);
-        int relType = ELF32_R_TYPE(rel.r_info);
-        Elf32_Addr relAddr = ((Elf32_Addr) s->data) + rel.r_offset;		// data to be updated adress
-        readSymbol(ctx, symEntry, &sym, name, sizeof(name));
-        Elf32_Addr symAddr = findSymAddr(ctx, &sym, name) + rel.r_addend;								// target symbol adress
-        uint32_t from = 0;
-        uint32_t to = 0;
-        if (relType == R_XTENSA_NONE || relType == R_XTENSA_ASM_EXPAND) {
-//            MSG("  %08X %04X %04X %-20s %08X          %08X                    %s + %X", rel.r_offset, symEntry, relType, type2String(relType), relAddr, sym.st_value, name, rel.r_addend);
-        } else if ((symAddr == 0xffffffff) && (sym.st_value == 0x00000000)) {
-            ERR("Relocation - undefined symAddr: %s", name);
-            MSG("  %08X %04X %04X %-20s %08X %08X %08X                    %s + %X", rel.r_offset, symEntry, relType, type2String(relType), relAddr, symAddr, sym.st_value, name, rel.r_addend);
-            r = -1;
-        } else if(relocateSymbol(relAddr, relType, symAddr, sym.st_value, &from, &to) != 0) {
-            ERR("  %08X %04X %04X %-20s %08X %08X %08X %08X->%08X %s + %X", rel.r_offset, symEntry, relType, type2String(relType), relAddr, symAddr, sym.st_value, from, to, name, rel.r_addend);
-            r = -1;
-        } else {
-            MSG("  %08X %04X %04X %-20s %08X %08X %08X %08X->%08X %s + %X", rel.r_offset, symEntry, relType, type2String(relType), relAddr, symAddr, sym.st_value, from, to, name, rel.r_addend);
+    return 1;
+}
+
+
+/*
+ * Keep what is needed to move the sections of a rebasable module: the
+ * R_XTENSA_32 relocations to a module section, shifted when it moves, and
+ * all the R_XTENSA_SLOT0_OP ones, PC-relative, applied again from the
+ * instruction as it was before relocation.
+ */
+static int rebaseRecord(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s, Elf32_Rela *rel, Elf32_Sym *sym, Elf32_Addr symAddr, uint32_t from) {
+    int relType = ELF32_R_TYPE(rel->r_info);
+    ELFLoaderSection_t *target = NULL;
+    if (symAddr == 0xffffffff) {
+        symAddr = sym->st_value;
+    } else if (sym->st_shndx != SHN_UNDEF && sym->st_shndx < SHN_LORESERVE) {
+        target = findSection(ctx, sym->st_shndx);
+    }
+    /* The env symbols come first, even when the module defines them */
+    if (target && (target->mapped || symAddr - rel->r_addend != (Elf32_Addr) target->data + sym->st_value)) {
+        target = NULL;
+    }
+    if (!target && relType != R_XTENSA_SLOT0_OP) {
+        return 0;
+    }
+    if (ctx->rebaseCount == ctx->rebaseSize) {
+        ctx->rebaseSize = ctx->rebaseSize ? 2 * ctx->rebaseSize : 32;
+        ELFLoaderRebaseEntry_t *rebase = realloc(ctx->rebase, ctx->rebaseSize * sizeof(ELFLoaderRebaseEntry_t));
+        assert(rebase);
+        ctx->rebase = rebase;
+    }
+    ELFLoaderRebaseEntry_t *e = &ctx->rebase[ctx->rebaseCount++];
+    e->section = s->secIdx;
+    e->target = target ? target->secIdx : 0;
+    e->offset = rel->r_offset;
+    e->value = target ? symAddr - (Elf32_Addr) target->data : symAddr;
+    e->op = relType == R_XTENSA_SLOT0_OP ? from : 0;
+    return 0;
+}
+
+
+static int relocateEntry(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s, Elf32_Shdr *sectHdr, size_t relCount) {
+    Elf32_Rela rel;
+    LOADER_GETDATA(ctx, sectHdr->sh_offset + relCount * (sizeof(rel)), &rel, sizeof(rel))
+    Elf32_Sym sym;
+    char name[33] = "<unnamed>";
+    int symEntry = ELF32_R_SYM(rel.r_info);
+    int relType = ELF32_R_TYPE(rel.r_info);
+    Elf32_Addr relAddr = ((Elf32_Addr) s->data) + rel.r_offset;		// data to be updated adress
+    readSymbol(ctx, symEntry, &sym, name, sizeof(name));
+    Elf32_Addr symAddr;
+    if (ctx->imports && sym.st_shndx == SHN_UNDEF) {
+        symAddr = findImportAddr(ctx, symEntry) + rel.r_addend;
+    } else {
+        symAddr = findSymAddr(ctx, &sym, name) + rel.r_addend;								// target symbol adress
+    }
+    uint32_t from = 0;
+    uint32_t to = 0;
+    if (relType == R_XTENSA_NONE || relType == R_XTENSA_ASM_EXPAND) {
+//        MSG("  %08X %04X %04X %-20s %08X          %08X                    %s + %X", rel.r_offset, symEntry, relType, type2String(relType), relAddr, sym.st_value, name, rel.r_addend);
+    } else if ((symAddr == 0xffffffff) && (sym.st_value == 0x00000000)) {
+        ERR("Relocation - undefined symAddr: %s", name);
+        MSG("  %08X %04X %04X %-20s %08X %08X %08X                    %s + %X", rel.r_offset, symEntry, relType, type2String(relType), relAddr, symAddr, sym.st_value, name, rel.r_addend);
+        return -1;
+    } else if(relocateSymbol(relAddr, relType, symAddr, sym.st_value, &from, &to) != 0) {
+        ERR("  %08X %04X %04X %-20s %08X %08X %08X %08X->%08X %s + %X", rel.r_offset, symEntry, relType, type2String(relType), relAddr, symAddr, sym.st_value, from, to, name, rel.r_addend);
+        return -1;
+    } else {
+        MSG("  %08X %04X %04X %-20s %08X %08X %08X %08X->%08X %s + %X", rel.r_offset, symEntry, relType, type2String(relType), relAddr, symAddr, sym.st_value, from, to, name, rel.r_addend);
+        if (ctx->rebasable) {
+            return rebaseRecord(ctx, s, &rel, &sym, symAddr, from);
         }
     }
-    return r;
-#ifdef __linux
+    return 0;
 err:
     ERR("Error reading relocation data");
     return -1;
-#endif
 }
 
 
-/*** Main functions ***/
-
-
-void elfLoaderFree(ELFLoaderContext_t* ctx) {
-    if (ctx) {
-        ELFLoaderSection_t* section = ctx->section;
-        ELFLoaderSection_t* next;
-        while(section != NULL) {
-            if (section->data) {
-                free(section->data);
-            }
-            next = section->next;
-            free(section);
-            section = next;
-        }
-        free(ctx);
+static int relocateSection(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+    Elf32_Shdr sectHdr;
+    int r = relocateBegin(ctx, s, &sectHdr);
+    if (r <= 0) {
+        return r;
+    }
+    r = 0;
+    size_t relEntries = sectHdr.sh_size / sizeof(Elf32_Rela);
+    for (size_t relCount = 0; relCount < relEntries; relCount++) {
+        r |= relocateEntry(ctx, s, &sectHdr, relCount);
     }
+    return r;
 }
 
 
-ELFLoaderContext_t* elfLoaderInitLoadAndRelocate(LOADER_FD_T fd, const ELFLoaderEnv_t *env) {
-    MSG("ENV:");
-    for (int i = 0; i < env->exported_size; i++) {
-        MSG("  %08X %s", (unsigned int) env->exported[i].ptr, env->exported[i].name);
-    }
+typedef struct {
+    ELFLoaderContext_t *ctx;
+    pthread_mutex_t lock;
+    ELFLoaderSection_t *next;
+    int r;
+} ELFLoaderRelocJob_t;
 
-    ELFLoaderContext_t* ctx = malloc(sizeof(ELFLoaderContext_t));
-    assert(ctx);
 
-    memset(ctx, 0, sizeof(ELFLoaderContext_t));
-    ctx->fd = fd;
-    ctx->env = env;
-    {
-        Elf32_Ehdr header;
-        Elf32_Shdr section;
-        /* Load the ELF header, located at the start of the buffer. */
-        LOADER_GETDATA(ctx, 0, &header, sizeof(Elf32_Ehdr));
-
-        /* Make sure that we have a correct and compatible ELF header. */
-        char ElfMagic[] = { 0x7f, 'E', 'L', 'F', '\0' };
-        if (memcmp(header.e_ident, ElfMagic, strlen(ElfMagic)) != 0) {
-            ERR("Bad ELF Identification");
-            goto err;
+static void *relocateWorker(void *arg) {
+    ELFLoaderRelocJob_t *job = arg;
+    ELFLoaderCursor_t cursor = job->ctx->cursor;
+    threadCursor = &cursor;
+    int r = 0;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        ELFLoaderSection_t *section = job->next;
+        if (section) {
+            job->next = section->next;
         }
-
-        /* Load the section header, get the number of entries of the section header, get a pointer to the actual table of strings */
-        LOADER_GETDATA(ctx, header.e_shoff + header.e_shstrndx * sizeof(Elf32_Shdr), &section, sizeof(Elf32_Shdr));
-        ctx->e_shnum = header.e_shnum;
-        ctx->e_shoff = header.e_shoff;
-        ctx->shstrtab_offset = section.sh_offset;
+        pthread_mutex_unlock(&job->lock);
+        if (!section) {
+            break;
+        }
+        r |= relocateSection(job->ctx, section);
     }
+    threadCursor = NULL;
+    pthread_mutex_lock(&job->lock);
+    job->r |= r;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
 
-    {
-        /* Go through all sections, allocate and copy the relevant ones
-        ".symtab": segment contains the symbol table for this file
-        ".strtab": segment points to the actual string names used by the symbol table
-        */
-        MSG("Scanning ELF sections         relAddr      size");
-        for (int n = 1; n < ctx->e_shnum; n++) {
+
+/*
+ * Sections are relocated by up to relocThreads workers, the calling thread
+ * being one of them. The work is split by section and not by relocation
+ * entry: on the ESP32 byte writes to IRAM are read-modify-write of the
+ * whole word, relocations of a same section would race.
+ * Starting a thread costs more than relocating a small module, workers are
+ * only used from ELFLOADER_RELOC_PARALLEL_MIN relocation entries.
+ * The reader and resolver callbacks are not required to be thread-safe:
+ * with either set, sections are relocated by the calling thread.
+ */
+static int relocateSections(ELFLoaderContext_t *ctx) {
+    size_t entries = 0;
+    if (ctx->relocThreads > 1) {
+        for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
             Elf32_Shdr sectHdr;
-            char name[33] = "<unamed>";
-            if (readSection(ctx, n, &sectHdr, name, sizeof(name)) != 0) {
-                ERR("Error reading section");
-                goto err;
-            }
-            if (sectHdr.sh_flags & SHF_ALLOC) {
-                if (!sectHdr.sh_size) {
-                    MSG("  section %2d: %-15s no data", n, name);
-                } else {
-                    ELFLoaderSection_t* section = malloc(sizeof(ELFLoaderSection_t));
-                    assert(section);
-                    memset(section, 0, sizeof(ELFLoaderSection_t));
-                    section->next = ctx->section;
-                    ctx->section = section;
-                    if (sectHdr.sh_flags & SHF_EXECINSTR) {
-                        section->data = LOADER_ALLOC_EXEC(sectHdr.sh_size);
-                    } else {
-                        section->data = LOADER_ALLOC_DATA(sectHdr.sh_size);
-                    }
-                    if (!section->data) {
-                        ERR("Section malloc failled: %s", name);
-                        goto err;
-                    }
-                    section->secIdx = n;
-                    section->size = sectHdr.sh_size;
-                    if (sectHdr.sh_type != SHT_NOBITS) {
-                        LOADER_GETDATA(ctx, sectHdr.sh_offset, section->data, sectHdr.sh_size);
-                    }
-                    if (strcmp(name, ".text") == 0) {
-                        ctx->text = section->data;
-                    }
-                    MSG("  section %2d: %-15s %08X %6i", n, name, (unsigned int) section->data, sectHdr.sh_size);
-                }
-            } else if (sectHdr.sh_type == SHT_RELA) {
-                if (sectHdr.sh_info >= n) {
-                    ERR("Rela section: bad linked section (%i:%s -> %i)", n, name, sectHdr.sh_info);
-                    goto err;
-                }
-                ELFLoaderSection_t* section = findSection(ctx, sectHdr.sh_info);
-                if (section == NULL) {
-                    MSG("  section %2d: %-15s -> %2d: ignoring", n, name, sectHdr.sh_info);
-                } else {
-                    section->relSecIdx = n;
-                    MSG("  section %2d: %-15s -> %2d: ok", n, name, sectHdr.sh_info);
-                }
-            } else {
-                MSG("  section %2d: %s", n, name);
-                if (strcmp(name, ".symtab") == 0) {
-                    ctx->symtab_offset = sectHdr.sh_offset;
-                    ctx->symtab_count = sectHdr.sh_size / sizeof(Elf32_Sym);
-                } else if (strcmp(name, ".strtab") == 0) {
-                    ctx->strtab_offset = sectHdr.sh_offset;
-                }
+            if (section->relSecIdx) {
+                LOADER_GETDATA(ctx, ctx->e_shoff + section->relSecIdx * sizeof(Elf32_Shdr), &sectHdr, sizeof(Elf32_Shdr));
+                entries += sectHdr.sh_size / sizeof(Elf32_Rela);
             }
         }
-        if (ctx->symtab_offset == 0 || ctx->symtab_offset == 0) {
-            ERR("Missing .symtab or .strtab section");
-            goto err;
-        }
     }
-
-    {
-        MSG("Relocating sections");
+    /* The record of a rebasable module is kept by one thread */
+    if (ctx->relocThreads <= 1 || entries < ELFLOADER_RELOC_PARALLEL_MIN || !ctx->section || !ctx->section->next || ctx->rebasable || ctx->reader || ctx->resolver) {
         int r = 0;
         for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
             r |= relocateSection(ctx, section);
         }
-        if (r != 0) {
-            MSG("Relocation failed");
-            goto err;
+        return r;
+    }
+    ELFLoaderRelocJob_t job;
+    job.ctx = ctx;
+    job.next = ctx->section;
+    job.r = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (pthread_attr_setstacksize(&attr, ELFLOADER_WORKER_STACK_SIZE) != 0) {
+        MSG("Worker stack below the minimum, using the default one");
+    }
+    pthread_t threads[ELFLOADER_RELOC_THREADS_MAX - 1];
+    int started = 0;
+    for (int i = 0; i < ctx->relocThreads - 1; i++) {
+        if (pthread_create(&threads[started], &attr, relocateWorker, &job) == 0) {
+            started++;
         }
     }
-    return ctx;
+    relocateWorker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_attr_destroy(&attr);
+    pthread_mutex_destroy(&job.lock);
+    return job.r;
+err:
+    ERR("Error reading relocation section");
+    return -1;
+}
+
+
+/*** Pipelined load ***/
+
+
+#define ELFLOADER_PIPELINE_BUFFERS 4
+#define ELFLOADER_PIPELINE_CHUNK 1024
+
+typedef struct {
+    ELFLoaderSection_t *section;
+    size_t offset;
+    size_t size;
+} ELFLoaderChunk_t;
+
+typedef struct {
+    ELFLoaderContext_t *ctx;
+    ELFLoaderSection_t **sections;
+    int count;
+    char *buffers;
+    ELFLoaderChunk_t ring[ELFLOADER_PIPELINE_BUFFERS];
+    unsigned int head;
+    unsigned int tail;
+    int done;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ELFLoaderPipeline_t;
+
+
+static void pipelineSignal(ELFLoaderPipeline_t *p, unsigned int *counter, int *flag) {
+    pthread_mutex_lock(&p->lock);
+    if (counter) {
+        (*counter)++;
+    }
+    if (flag) {
+        *flag = 1;
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+/* Producer: read the section data in file order into the ring of buffers */
+static void *pipelineProducer(void *arg) {
+    ELFLoaderPipeline_t *p = arg;
+    /* The consumer reads relocation data meanwhile */
+    ELFLoaderCursor_t cursor = p->ctx->cursor;
+    threadCursor = &cursor;
+    for (int i = 0; i < p->count; i++) {
+        ELFLoaderSection_t *section = p->sections[i];
+        for (size_t off = 0; off < section->size; off += ELFLOADER_PIPELINE_CHUNK) {
+            pthread_mutex_lock(&p->lock);
+            while (p->head - p->tail == ELFLOADER_PIPELINE_BUFFERS && !p->error) {
+                pthread_cond_wait(&p->cond, &p->lock);
+            }
+            int error = p->error;
+            pthread_mutex_unlock(&p->lock);
+            if (error) {
+                return NULL;
+            }
+            ELFLoaderChunk_t *chunk = &p->ring[p->head % ELFLOADER_PIPELINE_BUFFERS];
+            chunk->section = section;
+            chunk->offset = off;
+            chunk->size = section->size - off < ELFLOADER_PIPELINE_CHUNK ? section->size - off : ELFLOADER_PIPELINE_CHUNK;
+            if (readData(p->ctx, section->offset + off, p->buffers + (p->head % ELFLOADER_PIPELINE_BUFFERS) * ELFLOADER_PIPELINE_CHUNK, chunk->size) != 0) {
+                ERR("Error reading section data");
+                pipelineSignal(p, NULL, &p->error);
+                return NULL;
+            }
+            pipelineSignal(p, &p->head, NULL);
+        }
+    }
+    pipelineSignal(p, NULL, &p->done);
+    return NULL;
+}
+
+
+/*
+ * Consumer: copy each chunk in place and relocate each section as soon as
+ * its data is complete, while the producer thread reads the next chunks.
+ * With a digest, relocation waits for the digest check, only the read
+ * overlaps the copy.
+ */
+static int pipelineConsumer(ELFLoaderPipeline_t *p) {
+    ELFLoaderContext_t *ctx = p->ctx;
+    int r = 0;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->head == p->tail && !p->done && !p->error) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        int empty = p->head == p->tail;
+        int error = p->error;
+        pthread_mutex_unlock(&p->lock);
+        if (error) {
+            return -1;
+        }
+        if (empty) {
+            return r;
+        }
+        ELFLoaderChunk_t *chunk = &p->ring[p->tail % ELFLOADER_PIPELINE_BUFFERS];
+        ELFLoaderSection_t *section = chunk->section;
+        char *dest = (char*) section->data + chunk->offset;
+        LOADER_MEMCPY(dest, p->buffers + (p->tail % ELFLOADER_PIPELINE_BUFFERS) * ELFLOADER_PIPELINE_CHUNK, chunk->size);
+        if (digestData(ctx, section->offset + chunk->offset, dest, chunk->size) != 0) {
+            pipelineSignal(p, NULL, &p->error);
+            return -1;
+        }
+        if (!ctx->digest && chunk->offset + chunk->size == section->size) {
+            r |= relocateSection(ctx, section);
+        }
+        pipelineSignal(p, &p->tail, NULL);
+    }
+}
+
+
+static int pipelineSections(ELFLoaderContext_t *ctx) {
+    ELFLoaderPipeline_t p;
+    memset(&p, 0, sizeof(p));
+    p.ctx = ctx;
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        p.count++;
+    }
+    p.sections = malloc(p.count * sizeof(ELFLoaderSection_t*) + 1);
+    p.buffers = malloc(ELFLOADER_PIPELINE_BUFFERS * ELFLOADER_PIPELINE_CHUNK);
+    if (!p.sections || !p.buffers) {
+        ERR("Pipeline malloc failled");
+        free(p.sections);
+        free(p.buffers);
+        return -1;
+    }
+    /* The section list is in reverse load order, data is read in load order as in the serial path */
+    int n = p.count;
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        p.sections[--n] = section;
+    }
+    int count = 0;
+    for (int i = 0; i < p.count; i++) {
+        if (!p.sections[i]->nobits && !p.sections[i]->mapped && !p.sections[i]->overlay) {
+            p.sections[count++] = p.sections[i];
+        }
+    }
+    p.count = count;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    pthread_t producer;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (pthread_attr_setstacksize(&attr, ELFLOADER_WORKER_STACK_SIZE) != 0) {
+        MSG("Producer stack below the minimum, using the default one");
+    }
+    int r = 0;
+    if (pthread_create(&producer, &attr, pipelineProducer, &p) == 0) {
+        r = pipelineConsumer(&p);
+        pthread_join(producer, NULL);
+    } else {
+        ERR("Pipeline thread failled, loading serially");
+        for (int i = 0; i < p.count && r == 0; i++) {
+            ELFLoaderSection_t *section = p.sections[i];
+            if (readData(ctx, section->offset, section->data, section->size) != 0 || digestData(ctx, section->offset, section->data, section->size) != 0) {
+                r = -1;
+            } else if (!ctx->digest) {
+                r |= relocateSection(ctx, section);
+            }
+        }
+    }
+    pthread_attr_destroy(&attr);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    free(p.sections);
+    free(p.buffers);
+
+    /* Sections without data have not been relocated by the consumer */
+    if (r == 0 && !ctx->digest) {
+        for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+            if (section->nobits) {
+                r |= relocateSection(ctx, section);
+            }
+        }
+    }
+    return r;
+}
+
+
+/*** Symbol index ***/
+
+
+static uint32_t nameHash(const char *name) {
+    uint32_t h = 2166136261;
+    while (*name) {
+        h ^= (uint8_t) *name++;
+        h *= 16777619;
+    }
+    return h;
+}
+
+
+/* Hash a .strtab name of any length */
+static int hashName(ELFLoaderContext_t *ctx, off_t offset, uint32_t *hash) {
+    char chunk[32];
+    uint32_t h = 2166136261;
+    for (;;) {
+        LOADER_GETDATA(ctx, ctx->strtab_offset + offset, chunk, sizeof(chunk));
+        for (int i = 0; i < sizeof(chunk); i++) {
+            if (!chunk[i]) {
+                *hash = h;
+                return 0;
+            }
+            h ^= (uint8_t) chunk[i];
+            h *= 16777619;
+        }
+        offset += sizeof(chunk);
+    }
+err:
+    return -1;
+}
+
+
+/* Compare a .strtab name of any length with name */
+static int matchName(ELFLoaderContext_t *ctx, off_t offset, const char *name) {
+    char chunk[32];
+    size_t len = strlen(name) + 1;
+    while (len > 0) {
+        size_t n = len < sizeof(chunk) ? len : sizeof(chunk);
+        LOADER_GETDATA(ctx, ctx->strtab_offset + offset, chunk, n);
+        if (memcmp(chunk, name, n) != 0) {
+            return 0;
+        }
+        name += n;
+        offset += n;
+        len -= n;
+    }
+    return 1;
+err:
+    return 0;
+}
+
+
+static int compareIndexEntry(const void *a, const void *b) {
+    uint32_t ha = ((const ELFLoaderIndexEntry_t*) a)->nameHash;
+    uint32_t hb = ((const ELFLoaderIndexEntry_t*) b)->nameHash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+
+/* Index the symbols defined by the module by name hash, once per load */
+static size_t indexSize(ELFLoaderContext_t* ctx) {
+    return ctx->metaOffset ? ctx->meta.exportCount : ctx->symtab_count;
+}
+
+
+static void indexBegin(ELFLoaderContext_t* ctx) {
+    ctx->index = malloc(indexSize(ctx) * sizeof(ELFLoaderIndexEntry_t) + 1);
+    assert(ctx->index);
+    ctx->indexCount = 0;
+}
+
+
+static int indexSymbol(ELFLoaderContext_t* ctx, int i) {
+    if (ctx->metaOffset) {
+        off_t offset = ctx->metaOffset + sizeof(ELFLoaderMeta_t) + ctx->meta.sectionCount * sizeof(ELFLoaderMetaSection_t) + ctx->meta.importCount * sizeof(ELFLoaderMetaImport_t);
+        ELFLoaderMetaExport_t m;
+        LOADER_GETDATA(ctx, offset + i * sizeof(m), &m, sizeof(m));
+        ELFLoaderSection_t *section = findSection(ctx, m.secIdx);
+        if (section) {
+            ELFLoaderIndexEntry_t *e = &ctx->index[ctx->indexCount++];
+            e->nameHash = m.nameHash;
+            e->nameOffset = m.nameOffset;
+            e->section = section;
+            e->value = m.value;
+        }
+    } else {
+        Elf32_Sym sym;
+        LOADER_GETDATA(ctx, ctx->symtab_offset + i * sizeof(Elf32_Sym), &sym, sizeof(Elf32_Sym));
+        int bind = ELF32_ST_BIND(sym.st_info);
+        if (!sym.st_name || (bind != STB_GLOBAL && bind != STB_WEAK) || sym.st_shndx == SHN_UNDEF || sym.st_shndx >= SHN_LORESERVE) {
+            return 0;
+        }
+        ELFLoaderSection_t *section = findSection(ctx, sym.st_shndx);
+        if (!section) {
+            return 0;
+        }
+        ELFLoaderIndexEntry_t *e = &ctx->index[ctx->indexCount];
+        if (hashName(ctx, sym.st_name, &e->nameHash) != 0) {
+            goto err;
+        }
+        e->nameOffset = sym.st_name;
+        e->section = section;
+        e->value = sym.st_value;
+        ctx->indexCount++;
+    }
+    return 0;
+err:
+    ERR("Error reading symbols");
+    return -1;
+}
+
+
+static void indexEnd(ELFLoaderContext_t* ctx) {
+    /* .elfloader.meta exports are already sorted by name hash */
+    if (!ctx->metaOffset) {
+        qsort(ctx->index, ctx->indexCount, sizeof(ELFLoaderIndexEntry_t), compareIndexEntry);
+        ELFLoaderIndexEntry_t *index = realloc(ctx->index, ctx->indexCount * sizeof(ELFLoaderIndexEntry_t) + 1);
+        if (index) {
+            ctx->index = index;
+        }
+    }
+    ctx->indexed = 1;
+    MSG("Indexed %i symbols", ctx->indexCount);
+}
+
+
+static int buildIndex(ELFLoaderContext_t* ctx) {
+    indexBegin(ctx);
+    for (int i = 0; i < indexSize(ctx); i++) {
+        if (indexSymbol(ctx, i) != 0) {
+            return -1;
+        }
+    }
+    indexEnd(ctx);
+    return 0;
+}
+
+
+static ELFLoaderIndexEntry_t *findIndexEntry(ELFLoaderContext_t *ctx, const char *name) {
+    uint32_t h = nameHash(name);
+    /* Lower bound on nameHash, then check names of the colliding entries */
+    unsigned int lo = 0;
+    unsigned int hi = ctx->indexCount;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (ctx->index[mid].nameHash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < ctx->indexCount && ctx->index[lo].nameHash == h; lo++) {
+        if (matchName(ctx, ctx->index[lo].nameOffset, name)) {
+            return &ctx->index[lo];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Symbols can be looked up once loaded, or once indexed during an incremental load.
+ * In overlay mode, functions not loaded are not found: see elfLoaderOverlayAcquire.
+ */
+void* elfLoaderGetSymbol(ELFLoaderContext_t *ctx, const char *name) {
+    if (!ctx->indexed) {
+        ERR("Module not loaded");
+        return NULL;
+    }
+    ELFLoaderIndexEntry_t *e = findIndexEntry(ctx, name);
+    if (!e || !e->section->data) {
+        return NULL;
+    }
+    return (void*) (((Elf32_Addr) e->section->data) + e->value);
+}
+
+
+int elfLoaderGetSymbols(ELFLoaderContext_t *ctx, const char *const *names, void **symbols, unsigned int count) {
+    int r = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        symbols[i] = elfLoaderGetSymbol(ctx, names[i]);
+        if (!symbols[i]) {
+            ERR("Symbol not found: %s", names[i]);
+            r = -1;
+        }
+    }
+    return r;
+}
+
+
+/*** Main functions ***/
+
+
+/*
+ * Section nodes come from slabs freed with the context: a load makes a few
+ * allocations for them instead of one per section, and they do not leave
+ * holes across the heap. A reload or a patch takes its nodes from the
+ * module it changes, which keeps them.
+ */
+static ELFLoaderSection_t *newSection(ELFLoaderContext_t* ctx) {
+    ELFLoaderContext_t *owner = ctx->slabOwner ? ctx->slabOwner : ctx;
+    ELFLoaderSection_t *section = owner->freeNodes;
+    if (section) {
+        owner->freeNodes = section->next;
+    } else {
+        ELFLoaderSlab_t *slab = owner->slabs;
+        if (!slab || slab->used == slab->size) {
+            unsigned int size = slab ? 2 * slab->size : ELFLOADER_SLAB_MIN;
+            slab = malloc(sizeof(ELFLoaderSlab_t) + size * sizeof(ELFLoaderSection_t));
+            assert(slab);
+            slab->next = owner->slabs;
+            slab->size = size;
+            slab->used = 0;
+            owner->slabs = slab;
+        }
+        section = &slab->nodes[slab->used++];
+    }
+    memset(section, 0, sizeof(ELFLoaderSection_t));
+    return section;
+}
+
+
+static void freeSections(ELFLoaderContext_t* ctx, ELFLoaderSection_t* section) {
+    ELFLoaderSection_t* next;
+    while(section != NULL) {
+        /* The shared sections of an instance belong to its base module */
+        int owned = section->data && !section->mapped && !(ctx->base && section->shared);
+        if (owned && !ctx->allocator) {
+            free(section->data);
+        } else if (owned && ctx->allocator->free) {
+            ctx->allocator->free(ctx->allocator->arg, section->data, section->exec);
+        }
+        next = section->next;
+        free(section->deps);
+        ELFLoaderContext_t *owner = ctx->slabOwner ? ctx->slabOwner : ctx;
+        section->next = owner->freeNodes;
+        owner->freeNodes = section;
+        section = next;
+    }
+}
+
+
+void elfLoaderFree(ELFLoaderContext_t* ctx) {
+    if (ctx) {
+        freeSections(ctx, ctx->section);
+        freeSections(ctx, ctx->patches);
+        if (ctx->overlayBudget) {
+            pthread_mutex_destroy(&ctx->overlayLock);
+        }
+        free(ctx->overlayList);
+        free(ctx->rebase);
+        while (ctx->slabs) {
+            ELFLoaderSlab_t *slab = ctx->slabs;
+            ctx->slabs = slab->next;
+            free(slab);
+        }
+        free(ctx->imports);
+        free(ctx->index);
+        free(ctx);
+    }
+}
+
+
+static ELFLoaderContext_t* initContext(const ELFLoaderEnv_t *env) {
+    MSG("ENV:");
+    for (int i = 0; i < env->exported_size; i++) {
+        MSG("  %08X %s", (unsigned int) env->exported[i].ptr, env->exported[i].name);
+    }
+
+    ELFLoaderContext_t* ctx = malloc(sizeof(ELFLoaderContext_t));
+    assert(ctx);
+
+    memset(ctx, 0, sizeof(ELFLoaderContext_t));
+    ctx->env = env;
+    ctx->cancel = &ctx->cancelled;
+    return ctx;
+}
+
+
+static int readHeader(ELFLoaderContext_t* ctx) {
+    Elf32_Ehdr header;
+    Elf32_Shdr section;
+    /* Load the ELF header, located at the start of the buffer. */
+    LOADER_GETDATA(ctx, 0, &header, sizeof(Elf32_Ehdr));
+
+    /* Make sure that we have a correct and compatible ELF header. */
+    char ElfMagic[] = { 0x7f, 'E', 'L', 'F', '\0' };
+    if (memcmp(header.e_ident, ElfMagic, strlen(ElfMagic)) != 0) {
+        ERR("Bad ELF Identification");
+        goto err;
+    }
+
+    /* Load the section header, get the number of entries of the section header, get a pointer to the actual table of strings */
+    LOADER_GETDATA(ctx, header.e_shoff + header.e_shstrndx * sizeof(Elf32_Shdr), &section, sizeof(Elf32_Shdr));
+    ctx->e_shnum = header.e_shnum;
+    ctx->e_shoff = header.e_shoff;
+    ctx->shstrtab_offset = section.sh_offset;
+    ctx->imageSize = header.e_shoff + header.e_shnum * sizeof(Elf32_Shdr);
+
+    /* The optional .elfloader.meta section is the last one */
+    char name[33] = "";
+    if (readSection(ctx, ctx->e_shnum - 1, &section, name, sizeof(name)) != 0) {
+        goto err;
+    }
+    if (strcmp(name, ".elfloader.meta") == 0 && section.sh_size >= sizeof(ELFLoaderMeta_t)) {
+        LOADER_GETDATA(ctx, section.sh_offset, &ctx->meta, sizeof(ELFLoaderMeta_t));
+        if (ctx->meta.magic != ELFLOADER_META_MAGIC || ctx->meta.version != ELFLOADER_META_VERSION) {
+            ERR("Bad .elfloader.meta section, ignoring");
+        } else {
+            ctx->metaOffset = section.sh_offset;
+            ctx->symtab_offset = ctx->meta.symtabOffset;
+            ctx->symtab_count = ctx->meta.symtabCount;
+            ctx->strtab_offset = ctx->meta.strtabOffset;
+            if (section.sh_offset + section.sh_size > ctx->imageSize) {
+                ctx->imageSize = section.sh_offset + section.sh_size;
+            }
+        }
+    }
+    return 0;
+err:
+    return -1;
+}
+
+
+static void *allocSection(ELFLoaderContext_t* ctx, size_t size, size_t align, int exec) {
+    if (ctx->allocator) {
+        return ctx->allocator->alloc(ctx->allocator->arg, size, align < 4 ? 4 : align, exec);
+    } else if (exec) {
+        return LOADER_ALLOC_EXEC(size);
+    } else {
+        return LOADER_ALLOC_DATA(size);
+    }
+}
+
+
+/* 1 when the relocation section relSecIdx has nothing to apply */
+static int isRelocationFree(ELFLoaderContext_t* ctx, off_t relSecIdx) {
+    if (!relSecIdx) {
+        return 1;
+    }
+    Elf32_Shdr relHdr;
+    LOADER_GETDATA(ctx, ctx->e_shoff + relSecIdx * sizeof(Elf32_Shdr), &relHdr, sizeof(Elf32_Shdr));
+    for (size_t i = 0; i < relHdr.sh_size / sizeof(Elf32_Rela); i++) {
+        Elf32_Rela rel;
+        LOADER_GETDATA(ctx, relHdr.sh_offset + i * sizeof(rel), &rel, sizeof(rel));
+        int relType = ELF32_R_TYPE(rel.r_info);
+        if (relType != R_XTENSA_NONE && relType != R_XTENSA_ASM_EXPAND) {
+            return 0;
+        }
+    }
+    return 1;
+err:
+    return 0;
+}
+
+
+/*
+ * Address of section n in the mapped image, NULL when it has to be copied:
+ * only read-only sections without relocation to apply, suitably aligned,
+ * are used in place. relSecIdx is -1 when not known yet, the relocation
+ * section then follows section n.
+ */
+static void *mappedSection(ELFLoaderContext_t* ctx, int n, int exec, off_t relSecIdx) {
+    const uint8_t *map = exec ? ctx->mapExec : ctx->mapData;
+    Elf32_Shdr sectHdr;
+    if (!map || isCancelled(ctx)) {
+        return NULL;
+    }
+    LOADER_GETDATA(ctx, ctx->e_shoff + n * sizeof(Elf32_Shdr), &sectHdr, sizeof(Elf32_Shdr));
+    const uint8_t *data = map + sectHdr.sh_offset;
+    if ((sectHdr.sh_flags & SHF_WRITE) || sectHdr.sh_type == SHT_NOBITS || (sectHdr.sh_addralign && (uintptr_t) data % sectHdr.sh_addralign)) {
+        return NULL;
+    }
+    for (int i = n + 1; relSecIdx < 0 && i < ctx->e_shnum; i++) {
+        Elf32_Shdr relHdr;
+        LOADER_GETDATA(ctx, ctx->e_shoff + i * sizeof(Elf32_Shdr), &relHdr, sizeof(Elf32_Shdr));
+        if (relHdr.sh_type == SHT_RELA && relHdr.sh_info == n) {
+            relSecIdx = i;
+        }
+    }
+    return isRelocationFree(ctx, relSecIdx < 0 ? 0 : relSecIdx) ? (void*) data : NULL;
+err:
+    return NULL;
+}
+
+
+static ELFLoaderSection_t* loadSection(ELFLoaderContext_t* ctx, int n, const char *name, int exec, int nobits, off_t offset, size_t size, size_t align, off_t relSecIdx) {
+    if (isCancelled(ctx)) {
+        return NULL;
+    }
+    ELFLoaderSection_t* section = newSection(ctx);
+    section->next = ctx->section;
+    ctx->section = section;
+    section->data = nobits ? NULL : mappedSection(ctx, n, exec, relSecIdx);
+    section->mapped = section->data != NULL;
+    section->overlay = exec && !section->mapped && ctx->overlayBudget;
+    if (!section->mapped && !section->overlay) {
+        section->data = allocSection(ctx, size, align, exec);
+    }
+    section->exec = exec ? 1 : 0;
+    section->align = align;
+    if (!section->data && !section->overlay) {
+        ERR("Section malloc failled: %s", name);
+        return NULL;
+    }
+    section->secIdx = n;
+    section->size = size;
+    section->offset = offset;
+    section->nobits = nobits;
+    /* Pipelined and incremental loads read the section data later, see pipelineSections and stepData */
+    if (!nobits && section->data && !section->mapped && !ctx->pipelined && !ctx->stepPhase) {
+        LOADER_GETDATA(ctx, offset, section->data, size);
+        if (digestData(ctx, offset, section->data, size) != 0) {
+            return NULL;
+        }
+    }
+    MSG("  section %2d: %-15s %08X %6u", n, name, (unsigned int) section->data, (unsigned) size);
+    return section;
+err:
+    return NULL;
+}
+
+
+static int scanSection(ELFLoaderContext_t* ctx, int n) {
+    Elf32_Shdr sectHdr;
+    char name[33] = "<unamed>";
+    if (readSection(ctx, n, &sectHdr, name, sizeof(name)) != 0) {
+        ERR("Error reading section");
+        return -1;
+    }
+    if (sectHdr.sh_type != SHT_NOBITS && sectHdr.sh_offset + sectHdr.sh_size > ctx->imageSize) {
+        ctx->imageSize = sectHdr.sh_offset + sectHdr.sh_size;
+    }
+    if (sectHdr.sh_flags & SHF_ALLOC) {
+        if (!sectHdr.sh_size) {
+            MSG("  section %2d: %-15s no data", n, name);
+        } else {
+            ELFLoaderSection_t* section = loadSection(ctx, n, name, sectHdr.sh_flags & SHF_EXECINSTR, sectHdr.sh_type == SHT_NOBITS, sectHdr.sh_offset, sectHdr.sh_size, sectHdr.sh_addralign, -1);
+            if (!section) {
+                return -1;
+            }
+            if (strcmp(name, ".text") == 0) {
+                ctx->text = section->data;
+            }
+        }
+    } else if (sectHdr.sh_type == SHT_RELA) {
+        if (sectHdr.sh_info >= n) {
+            ERR("Rela section: bad linked section (%i:%s -> %i)", n, name, sectHdr.sh_info);
+            return -1;
+        }
+        ELFLoaderSection_t* section = findSection(ctx, sectHdr.sh_info);
+        if (section == NULL) {
+            MSG("  section %2d: %-15s -> %2d: ignoring", n, name, sectHdr.sh_info);
+        } else {
+            section->relSecIdx = n;
+            MSG("  section %2d: %-15s -> %2d: ok", n, name, sectHdr.sh_info);
+        }
+    } else {
+        MSG("  section %2d: %s", n, name);
+        if (strcmp(name, ".symtab") == 0) {
+            ctx->symtab_offset = sectHdr.sh_offset;
+            ctx->symtab_count = sectHdr.sh_size / sizeof(Elf32_Sym);
+        } else if (strcmp(name, ".strtab") == 0) {
+            ctx->strtab_offset = sectHdr.sh_offset;
+        }
+    }
+    return 0;
+}
+
+
+static int scanSections(ELFLoaderContext_t* ctx) {
+    /* Go through all sections, allocate and copy the relevant ones
+    ".symtab": segment contains the symbol table for this file
+    ".strtab": segment points to the actual string names used by the symbol table
+    */
+    MSG("Scanning ELF sections         relAddr      size");
+    for (int n = 1; n < ctx->e_shnum; n++) {
+        if (scanSection(ctx, n) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int loadMetaSection(ELFLoaderContext_t* ctx, int i) {
+    ELFLoaderMetaSection_t m;
+    LOADER_GETDATA(ctx, ctx->metaOffset + sizeof(ELFLoaderMeta_t) + i * sizeof(m), &m, sizeof(m));
+    if (!(m.flags & ELFLOADER_META_NOBITS) && m.offset + m.size > ctx->imageSize) {
+        ctx->imageSize = m.offset + m.size;
+    }
+    ELFLoaderSection_t* section = loadSection(ctx, m.secIdx, "-", m.flags & ELFLOADER_META_EXEC, m.flags & ELFLOADER_META_NOBITS, m.offset, m.size, m.align, m.relSecIdx);
+    if (!section) {
+        return -1;
+    }
+    section->relSecIdx = m.relSecIdx;
+    if (m.flags & ELFLOADER_META_TEXT) {
+        ctx->text = section->data;
+    }
+    return 0;
+err:
+    ERR("Error reading .elfloader.meta");
+    return -1;
+}
+
+
+static int loadMetaSections(ELFLoaderContext_t* ctx) {
+    MSG("Loading ELF sections from .elfloader.meta");
+    for (int i = 0; i < ctx->meta.sectionCount; i++) {
+        if (loadMetaSection(ctx, i) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int resolveImport(ELFLoaderContext_t* ctx, int i) {
+    off_t offset = ctx->metaOffset + sizeof(ELFLoaderMeta_t) + ctx->meta.sectionCount * sizeof(ELFLoaderMetaSection_t);
+    ELFLoaderMetaImport_t m;
+    char name[33];
+    LOADER_GETDATA(ctx, offset + i * sizeof(m), &m, sizeof(m));
+    if (readName(ctx, m.nameOffset, name, sizeof(name)) != 0) {
+        goto err;
+    }
+    ctx->imports[i].symIdx = m.symIdx;
+    ctx->imports[i].addr = 0xffffffff;
+    for (int j = 0; j < ctx->env->exported_size; j++) {
+        if (strcmp(ctx->env->exported[j].name, name) == 0) {
+            ctx->imports[i].addr = (Elf32_Addr) ctx->env->exported[j].ptr;
+            break;
+        }
+    }
+    if (ctx->imports[i].addr == 0xffffffff) {
+        ctx->imports[i].addr = resolveSymAddr(ctx, name);
+    }
+    return 0;
+err:
+    ERR("Error reading .elfloader.meta imports");
+    return -1;
+}
+
+
+/* Resolve each import once against the env, instead of once per relocation */
+static int resolveImports(ELFLoaderContext_t* ctx) {
+    ctx->imports = malloc(ctx->meta.importCount * sizeof(ELFLoaderImport_t) + 1);
+    assert(ctx->imports);
+    for (int i = 0; i < ctx->meta.importCount; i++) {
+        if (resolveImport(ctx, i) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+int elfLoaderGetRequirements(ELFLoaderContext_t *ctx, ELFLoaderRequirements_t *req) {
+    memset(req, 0, sizeof(ELFLoaderRequirements_t));
+    if (!ctx->e_shnum && readHeader(ctx) != 0) {
+        return -1;
+    }
+    if (ctx->metaOffset) {
+        req->exec = ctx->meta.execSize;
+        req->data = ctx->meta.dataSize;
+        req->bss = ctx->meta.bssSize;
+        req->align = ctx->meta.align;
+        return 0;
+    }
+    req->align = 1;
+    for (int n = 1; n < ctx->e_shnum; n++) {
+        Elf32_Shdr sectHdr;
+        LOADER_GETDATA(ctx, ctx->e_shoff + n * sizeof(Elf32_Shdr), &sectHdr, sizeof(Elf32_Shdr));
+        if (!(sectHdr.sh_flags & SHF_ALLOC) || !sectHdr.sh_size) {
+            continue;
+        }
+        size_t align = sectHdr.sh_addralign ? sectHdr.sh_addralign : 1;
+        size_t *total = &req->data;
+        if (sectHdr.sh_flags & SHF_EXECINSTR) {
+            total = &req->exec;
+        } else if (sectHdr.sh_type == SHT_NOBITS) {
+            total = &req->bss;
+        }
+        *total = ((*total + align - 1) & ~(align - 1)) + sectHdr.sh_size;
+        if (align > req->align) {
+            req->align = align;
+        }
+    }
+    return 0;
+err:
+    return -1;
+}
+
+
+/*** Overlays ***/
+
+
+/*
+ * In overlay mode the executable sections are loaded on demand within a
+ * byte budget, and evicted least recently used first. A section is loaded
+ * with the executable sections its relocations target, e.g. the literals
+ * and the callees of a function built with -ffunction-sections: the
+ * resident sections are closed under reference, and evicting a section
+ * evicts the resident sections referencing it. elfLoaderOverlayAcquire
+ * pins the sections a function can reach until elfLoaderOverlayRelease.
+ * Executable sections referenced from data, e.g. by a table of function
+ * pointers, are loaded with the module and never evicted.
+ */
+
+
+/* The overlay sections the relocations of s target, read once */
+static int overlayDeps(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+    if (s->depsKnown) {
+        return 0;
+    }
+    if (s->relSecIdx) {
+        Elf32_Shdr relHdr;
+        LOADER_GETDATA(ctx, ctx->e_shoff + s->relSecIdx * sizeof(Elf32_Shdr), &relHdr, sizeof(Elf32_Shdr));
+        for (size_t i = 0; i < relHdr.sh_size / sizeof(Elf32_Rela); i++) {
+            Elf32_Rela rel;
+            Elf32_Sym sym;
+            LOADER_GETDATA(ctx, relHdr.sh_offset + i * sizeof(rel), &rel, sizeof(rel));
+            int relType = ELF32_R_TYPE(rel.r_info);
+            if (relType == R_XTENSA_NONE || relType == R_XTENSA_ASM_EXPAND) {
+                continue;
+            }
+            LOADER_GETDATA(ctx, ctx->symtab_offset + ELF32_R_SYM(rel.r_info) * sizeof(Elf32_Sym), &sym, sizeof(Elf32_Sym));
+            ELFLoaderSection_t *target = sym.st_shndx == SHN_UNDEF ? NULL : findSection(ctx, sym.st_shndx);
+            if (!target || !target->overlay || target == s) {
+                continue;
+            }
+            unsigned int j = 0;
+            while (j < s->depCount && s->deps[j] != target) {
+                j++;
+            }
+            if (j == s->depCount) {
+                ELFLoaderSection_t **deps = realloc(s->deps, (s->depCount + 1) * sizeof(ELFLoaderSection_t*));
+                assert(deps);
+                s->deps = deps;
+                s->deps[s->depCount++] = target;
+            }
+        }
+    }
+    s->depsKnown = 1;
+    return 0;
+err:
+    ERR("Error reading relocation data");
+    return -1;
+}
+
+
+/* The overlay sections reachable from s, s first, in ctx->overlayList. Returns their count, -1 on error */
+static int overlayClosure(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+    unsigned int visit = ++ctx->overlayVisit;
+    int count = 0;
+    s->visit = visit;
+    ctx->overlayList[count++] = s;
+    for (int i = 0; i < count; i++) {
+        if (overlayDeps(ctx, ctx->overlayList[i]) != 0) {
+            return -1;
+        }
+        for (unsigned int j = 0; j < ctx->overlayList[i]->depCount; j++) {
+            ELFLoaderSection_t *d = ctx->overlayList[i]->deps[j];
+            if (d->visit != visit) {
+                d->visit = visit;
+                ctx->overlayList[count++] = d;
+            }
+        }
+    }
+    return count;
+}
+
+
+static void overlayFree(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+    if (!ctx->allocator) {
+        free(s->data);
+    } else if (ctx->allocator->free) {
+        ctx->allocator->free(ctx->allocator->arg, s->data, s->exec);
+    }
+    s->data = NULL;
+}
+
+
+/* Evict s and the resident sections referencing it, none of them is pinned */
+static void overlayEvict(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+    MSG("Overlay: evicting section %i", s->secIdx);
+    overlayFree(ctx, s);
+    ctx->overlayStats.resident -= s->size;
+    ctx->overlayStats.evictions++;
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        for (unsigned int j = 0; section->data && section->overlay && j < section->depCount; j++) {
+            if (section->deps[j] == s) {
+                overlayEvict(ctx, section);
+            }
+        }
+    }
+}
+
+
+/* Unpin the first count sections of ctx->overlayList */
+static void overlayUnpin(ELFLoaderContext_t *ctx, int count) {
+    for (int i = 0; i < count; i++) {
+        ctx->overlayList[i]->refs--;
+    }
+}
+
+
+/* Load and pin the sections reachable from s. Returns 1 when some were loaded, -1 on error. Called locked */
+static int overlayLoad(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+    int count = overlayClosure(ctx, s);
+    if (count < 0) {
+        return -1;
+    }
+    size_t needed = 0;
+    for (int i = 0; i < count; i++) {
+        ELFLoaderSection_t *section = ctx->overlayList[i];
+        section->refs++;
+        section->lastUse = ++ctx->overlayTick;
+        if (!section->data) {
+            needed += section->size;
+        }
+    }
+    if (!needed) {
+        return 0;
+    }
+    while (ctx->overlayStats.resident + needed > ctx->overlayBudget) {
+        ELFLoaderSection_t *victim = NULL;
+        for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+            if (section->overlay && section->data && !section->refs && (!victim || section->lastUse < victim->lastUse)) {
+                victim = section;
+            }
+        }
+        if (!victim) {
+            ERR("Overlay budget exceeded: %u + %u bytes", (unsigned) ctx->overlayStats.resident, (unsigned) needed);
+            overlayUnpin(ctx, count);
+            return -1;
+        }
+        overlayEvict(ctx, victim);
+    }
+    /*
+     * The new sections are read and relocated once all of them are allocated,
+     * the referenced ones first: an L32R only reaches literals below it.
+     */
+    int r = 0;
+    for (int i = count - 1; i >= 0 && r == 0; i--) {
+        ELFLoaderSection_t *section = ctx->overlayList[i];
+        if (!section->data) {
+            section->data = allocSection(ctx, section->size, section->align, 1);
+            section->loading = 1;
+            if (!section->data) {
+                ERR("Section malloc failled");
+                r = -1;
+            }
+        }
+    }
+    for (int i = 0; i < count && r == 0; i++) {
+        ELFLoaderSection_t *section = ctx->overlayList[i];
+        if (section->loading && (readData(ctx, section->offset, section->data, section->size) != 0 || relocateSection(ctx, section) != 0)) {
+            r = -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        ELFLoaderSection_t *section = ctx->overlayList[i];
+        if (!section->loading) {
+            continue;
+        }
+        section->loading = 0;
+        if (r == 0) {
+            ctx->overlayStats.resident += section->size;
+        } else if (section->data) {
+            overlayFree(ctx, section);
+        }
+    }
+    if (r != 0) {
+        ERR("Overlay load failed");
+        overlayUnpin(ctx, count);
+        return -1;
+    }
+    return 1;
+}
+
+
+/* Load the overlay sections referenced from the other sections, for good */
+static int overlayBegin(ELFLoaderContext_t *ctx) {
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        ctx->overlayCount += section->overlay;
+    }
+    ctx->overlayList = malloc(ctx->overlayCount * sizeof(ELFLoaderSection_t*) + 1);
+    assert(ctx->overlayList);
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        if (section->overlay) {
+            continue;
+        }
+        int r = overlayDeps(ctx, section);
+        for (unsigned int i = 0; r == 0 && i < section->depCount; i++) {
+            r = overlayLoad(ctx, section->deps[i]) < 0 ? -1 : 0;
+        }
+        if (r != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* Load the executable sections on demand, within budget bytes. Call before loading */
+int elfLoaderSetOverlay(ELFLoaderContext_t *ctx, size_t budget) {
+    if (ctx->section || ctx->overlayBudget || ctx->rebasable) {
+        ERR("Sections already allocated or rebasable module");
+        return -1;
+    }
+    ctx->overlayBudget = budget;
+    pthread_mutex_init(&ctx->overlayLock, NULL);
+    return 0;
+}
+
+
+/*
+ * Address of the function name, with the sections it can reach loaded and
+ * pinned until elfLoaderOverlayRelease. NULL when not found or when they do
+ * not fit in the budget.
+ */
+void *elfLoaderOverlayAcquire(ELFLoaderContext_t *ctx, const char *name) {
+    ELFLoaderIndexEntry_t *e = ctx->indexed ? findIndexEntry(ctx, name) : NULL;
+    if (!e) {
+        ERR("Symbol not found: %s", name);
+        return NULL;
+    }
+    if (!e->section->overlay) {
+        return (void*) (((Elf32_Addr) e->section->data) + e->value);
+    }
+    pthread_mutex_lock(&ctx->overlayLock);
+    int r = overlayLoad(ctx, e->section);
+    if (r == 0) {
+        ctx->overlayStats.hits++;
+    } else if (r > 0) {
+        ctx->overlayStats.misses++;
+    }
+    pthread_mutex_unlock(&ctx->overlayLock);
+    return r < 0 ? NULL : (void*) (((Elf32_Addr) e->section->data) + e->value);
+}
+
+
+void elfLoaderOverlayRelease(ELFLoaderContext_t *ctx, void *func) {
+    pthread_mutex_lock(&ctx->overlayLock);
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        if (section->overlay && section->data && (uint8_t*) func >= (uint8_t*) section->data && (uint8_t*) func < (uint8_t*) section->data + section->size) {
+            overlayUnpin(ctx, overlayClosure(ctx, section));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctx->overlayLock);
+}
+
+
+void elfLoaderOverlayGetStats(ELFLoaderContext_t *ctx, ELFLoaderOverlayStats_t *stats) {
+    pthread_mutex_lock(&ctx->overlayLock);
+    *stats = ctx->overlayStats;
+    pthread_mutex_unlock(&ctx->overlayLock);
+}
+
+
+int elfLoaderLoadAndRelocate(ELFLoaderContext_t* ctx) {
+    if (ctx->digest) {
+        ctx->digest->init(ctx->digest->state);
+        ctx->digestMark = 0;
+    }
+    if (readHeader(ctx) != 0) {
+        goto err;
+    }
+
+    if (ctx->metaOffset) {
+        if (loadMetaSections(ctx) != 0) {
+            goto err;
+        }
+    } else {
+        if (scanSections(ctx) != 0) {
+            goto err;
+        }
+        if (ctx->symtab_offset == 0 || ctx->symtab_offset == 0) {
+            ERR("Missing .symtab or .strtab section");
+            goto err;
+        }
+    }
+
+    if (ctx->pipelined) {
+        if (ctx->metaOffset && resolveImports(ctx) != 0) {
+            goto err;
+        }
+        if (ctx->overlayBudget && overlayBegin(ctx) != 0) {
+            goto err;
+        }
+        MSG("Loading and relocating sections");
+        if (pipelineSections(ctx) != 0) {
+            MSG("Pipelined load failed");
+            goto err;
+        }
+        if (digestCheck(ctx) != 0) {
+            goto err;
+        }
+        if (ctx->digest) {
+            MSG("Relocating sections");
+            if (relocateSections(ctx) != 0) {
+                MSG("Relocation failed");
+                goto err;
+            }
+        }
+    } else {
+        /* Check the digest before relocating: the tables are read again, the section data is not */
+        if (digestCheck(ctx) != 0) {
+            goto err;
+        }
+
+        if (ctx->metaOffset && resolveImports(ctx) != 0) {
+            goto err;
+        }
+        if (ctx->overlayBudget && overlayBegin(ctx) != 0) {
+            goto err;
+        }
+
+        MSG("Relocating sections");
+        if (relocateSections(ctx) != 0) {
+            MSG("Relocation failed");
+            goto err;
+        }
+    }
+    free(ctx->imports);
+    ctx->imports = NULL;
+    if (buildIndex(ctx) != 0) {
+        goto err;
+    }
+    ctx->loaded = 1;
+    return 0;
+
+err:
+    return -1;
+}
+
+
+/*
+ * Incremental load: each step is one unit of work of a bounded size, the ELF
+ * header, a section header or .elfloader.meta entry, a chunk of section data
+ * or of digest data, an import, a relocation entry or a symbol to index.
+ * Phase changes are steps too. The work is done in the same order as
+ * elfLoaderLoadAndRelocate except for the symbol index, built before the
+ * relocation: from ELFLOADER_STEP_IMPORTS on, the module symbols can be
+ * looked up by the resolver of modules loaded together. Relocation is serial.
+ */
+
+
+/* The section loaded after s, the first loaded one for NULL: the list is in reverse load order */
+static ELFLoaderSection_t *stepNextSection(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+    ELFLoaderSection_t *section = ctx->section;
+    while (section && section->next != s) {
+        section = section->next;
+    }
+    return section;
+}
+
+
+static int stepData(ELFLoaderContext_t *ctx) {
+    ELFLoaderSection_t *s = ctx->stepSection;
+    if (!s->nobits && !s->mapped) {
+        off_t off = s->offset + ctx->stepOffset;
+        /* Hash the bytes before the section one chunk at a time too */
+        if (ctx->digest && ctx->digestMark + ELFLOADER_STEP_CHUNK < off) {
+            return digestSkipTo(ctx, ctx->digestMark + ELFLOADER_STEP_CHUNK);
+        }
+        size_t len = s->size - ctx->stepOffset;
+        if (len > ELFLOADER_STEP_CHUNK) {
+            len = ELFLOADER_STEP_CHUNK;
+        }
+        void *data = (char*) s->data + ctx->stepOffset;
+        LOADER_GETDATA(ctx, off, data, len);
+        if (digestData(ctx, off, data, len) != 0) {
+            return -1;
+        }
+        ctx->stepOffset += len;
+    }
+    if (s->nobits || s->mapped || ctx->stepOffset == s->size) {
+        ctx->stepSection = stepNextSection(ctx, s);
+        ctx->stepOffset = 0;
+    }
+    return 0;
+err:
+    return -1;
+}
+
+
+static int stepRelocate(ELFLoaderContext_t *ctx) {
+    ELFLoaderSection_t *s = ctx->stepSection;
+    if (!ctx->stepCount) {
+        int r = relocateBegin(ctx, s, &ctx->stepRelHdr);
+        if (r < 0) {
+            return -1;
+        }
+        ctx->stepCount = r ? ctx->stepRelHdr.sh_size / sizeof(Elf32_Rela) : 0;
+        ctx->stepOffset = 0;
+    } else {
+        if (relocateEntry(ctx, s, &ctx->stepRelHdr, ctx->stepOffset) != 0) {
+            return -1;
+        }
+        ctx->stepOffset++;
+    }
+    if (ctx->stepOffset == ctx->stepCount) {
+        ctx->stepSection = s->next;
+        ctx->stepCount = 0;
+    }
+    return 0;
+}
+
+
+static int step(ELFLoaderContext_t *ctx) {
+    switch (ctx->stepPhase) {
+    case ELFLOADER_STEP_HEADER:
+        if (ctx->digest) {
+            ctx->digest->init(ctx->digest->state);
+            ctx->digestMark = 0;
+        }
+        if (readHeader(ctx) != 0) {
+            return -1;
+        }
+        MSG("Scanning ELF sections");
+        ctx->stepIdx = ctx->metaOffset ? 0 : 1;
+        ctx->stepPhase = ELFLOADER_STEP_SECTIONS;
+        return 0;
+
+    case ELFLOADER_STEP_SECTIONS:
+        if (ctx->metaOffset && ctx->stepIdx < ctx->meta.sectionCount) {
+            return loadMetaSection(ctx, ctx->stepIdx++);
+        }
+        if (!ctx->metaOffset && ctx->stepIdx < ctx->e_shnum) {
+            return scanSection(ctx, ctx->stepIdx++);
+        }
+        if (!ctx->metaOffset && (ctx->symtab_offset == 0 || ctx->strtab_offset == 0)) {
+            ERR("Missing .symtab or .strtab section");
+            return -1;
+        }
+        MSG("Loading sections");
+        ctx->stepSection = stepNextSection(ctx, NULL);
+        ctx->stepOffset = 0;
+        ctx->stepPhase = ELFLOADER_STEP_DATA;
+        return 0;
+
+    case ELFLOADER_STEP_DATA:
+        if (ctx->stepSection) {
+            return stepData(ctx);
+        }
+        ctx->stepPhase = ELFLOADER_STEP_DIGEST;
+        return 0;
+
+    case ELFLOADER_STEP_DIGEST:
+        if (ctx->digest && ctx->digestMark < ctx->imageSize) {
+            off_t off = ctx->digestMark + ELFLOADER_STEP_CHUNK;
+            return digestSkipTo(ctx, off < ctx->imageSize ? off : ctx->imageSize);
+        }
+        if (digestCheck(ctx) != 0) {
+            return -1;
+        }
+        indexBegin(ctx);
+        ctx->stepIdx = 0;
+        ctx->stepPhase = ELFLOADER_STEP_INDEX;
+        return 0;
+
+    case ELFLOADER_STEP_INDEX:
+        if (ctx->stepIdx < indexSize(ctx)) {
+            return indexSymbol(ctx, ctx->stepIdx++);
+        }
+        indexEnd(ctx);
+        if (ctx->metaOffset) {
+            ctx->imports = malloc(ctx->meta.importCount * sizeof(ELFLoaderImport_t) + 1);
+            assert(ctx->imports);
+        }
+        ctx->stepIdx = 0;
+        ctx->stepPhase = ELFLOADER_STEP_IMPORTS;
+        return 0;
+
+    case ELFLOADER_STEP_IMPORTS:
+        if (ctx->metaOffset && ctx->stepIdx < ctx->meta.importCount) {
+            return resolveImport(ctx, ctx->stepIdx++);
+        }
+        MSG("Relocating sections");
+        ctx->stepSection = ctx->section;
+        ctx->stepCount = 0;
+        ctx->stepPhase = ELFLOADER_STEP_RELOCATE;
+        return 0;
+
+    case ELFLOADER_STEP_RELOCATE:
+        if (ctx->stepSection) {
+            return stepRelocate(ctx);
+        }
+        free(ctx->imports);
+        ctx->imports = NULL;
+        ctx->loaded = 1;
+        return 0;
+    }
+    return -1;
+}
+
+
+/*
+ * Run at most budget steps of an incremental load (one when budget is 0).
+ * Returns the phase of the next step while loading, ELFLOADER_STEP_DONE once
+ * loaded or -1 on error, the context has then to be freed. A context is loaded
+ * either incrementally or with elfLoaderLoadAndRelocate, not both.
+ */
+int elfLoaderStep(ELFLoaderContext_t *ctx, unsigned int budget) {
+    if (ctx->loaded) {
+        return ELFLOADER_STEP_DONE;
+    }
+    if (ctx->stepPhase < 0) {
+        return -1;
+    }
+    if (ctx->overlayBudget) {
+        ERR("Incremental load of an overlay module");
+        return -1;
+    }
+    if (!ctx->stepPhase) {
+        ctx->stepPhase = ELFLOADER_STEP_HEADER;
+    }
+    do {
+        if (isCancelled(ctx) || step(ctx) != 0) {
+            ERR("Incremental load failed");
+            ctx->stepPhase = -1;
+            return -1;
+        }
+    } while (!ctx->loaded && budget-- > 1);
+    return ctx->loaded ? ELFLOADER_STEP_DONE : ctx->stepPhase;
+}
+
+
+/*** Instances ***/
+
+
+/*
+ * An instance of a loaded module shares its read-only sections and has its
+ * own copy of the writable ones, initialized from the module source. A
+ * read-only section is private too when one of its relocations targets a
+ * private section: on the Xtensa a function using a global loads the
+ * address from its literal section, so the literals then the function and
+ * its callers are copied. The code and the constants that do not depend on
+ * the module state are shared.
+ */
+
+
+/* 1 when a relocation of s targets a private section */
+static int targetsPrivate(ELFLoaderContext_t* ctx, ELFLoaderSection_t *s) {
+    if (!s->relSecIdx) {
+        return 0;
+    }
+    Elf32_Shdr relHdr;
+    LOADER_GETDATA(ctx, ctx->e_shoff + s->relSecIdx * sizeof(Elf32_Shdr), &relHdr, sizeof(Elf32_Shdr));
+    for (size_t i = 0; i < relHdr.sh_size / sizeof(Elf32_Rela); i++) {
+        Elf32_Rela rel;
+        Elf32_Sym sym;
+        LOADER_GETDATA(ctx, relHdr.sh_offset + i * sizeof(rel), &rel, sizeof(rel));
+        int relType = ELF32_R_TYPE(rel.r_info);
+        if (relType == R_XTENSA_NONE || relType == R_XTENSA_ASM_EXPAND) {
+            continue;
+        }
+        LOADER_GETDATA(ctx, ctx->symtab_offset + ELF32_R_SYM(rel.r_info) * sizeof(Elf32_Sym), &sym, sizeof(Elf32_Sym));
+        ELFLoaderSection_t *target = sym.st_shndx == SHN_UNDEF ? NULL : findSection(ctx, sym.st_shndx);
+        if (target && !target->shared) {
+            return 1;
+        }
+    }
+    return 0;
+err:
+    ERR("Error reading relocation data");
+    return -1;
+}
+
+
+/* Mark the sections an instance can share with the module, once per module */
+static int markShared(ELFLoaderContext_t* ctx) {
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        Elf32_Shdr sectHdr;
+        LOADER_GETDATA(ctx, ctx->e_shoff + section->secIdx * sizeof(Elf32_Shdr), &sectHdr, sizeof(Elf32_Shdr));
+        section->shared = !(sectHdr.sh_flags & SHF_WRITE) && !section->nobits;
+    }
+    int changed;
+    do {
+        changed = 0;
+        for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+            if (!section->shared) {
+                continue;
+            }
+            int r = targetsPrivate(ctx, section);
+            if (r < 0) {
+                return -1;
+            }
+            if (r) {
+                section->shared = 0;
+                changed = 1;
+            }
+        }
+    } while (changed);
+    ctx->shareable = 1;
+    return 0;
+err:
+    ERR("Error reading section header");
+    return -1;
+}
+
+
+/*
+ * A new instance of the loaded module ctx: the shared sections are used in
+ * place, the private ones are allocated, read from the source again and
+ * relocated. The source of ctx has to stay readable, and ctx loaded, as
+ * long as instances are created and used. Free instances with elfLoaderFree.
+ */
+ELFLoaderContext_t* elfLoaderInstantiate(ELFLoaderContext_t* ctx) {
+    if (ctx->base) {
+        ctx = ctx->base;
+    }
+    if (!ctx->loaded || ctx->overlayBudget || ctx->patches || ctx->rebasable) {
+        ERR("Module not loaded, overlay, patched or rebasable module");
+        return NULL;
+    }
+    if (!ctx->shareable && markShared(ctx) != 0) {
+        return NULL;
+    }
+    ELFLoaderContext_t* inst = initContext(ctx->env);
+    inst->base = ctx;
+    inst->fd = ctx->fd;
+    inst->fdOffset = ctx->fdOffset;
+    inst->fragments = ctx->fragments;
+    inst->reader = ctx->reader;
+    inst->resolver = ctx->resolver;
+    inst->allocator = ctx->allocator;
+    inst->imageSize = ctx->imageSize;
+    inst->e_shnum = ctx->e_shnum;
+    inst->e_shoff = ctx->e_shoff;
+    inst->shstrtab_offset = ctx->shstrtab_offset;
+    inst->symtab_count = ctx->symtab_count;
+    inst->symtab_offset = ctx->symtab_offset;
+    inst->strtab_offset = ctx->strtab_offset;
+    inst->metaOffset = ctx->metaOffset;
+    inst->meta = ctx->meta;
+
+    ELFLoaderSection_t** tail = &inst->section;
+    for (ELFLoaderSection_t* s = ctx->section; s != NULL; s = s->next) {
+        ELFLoaderSection_t* section = newSection(inst);
+        *section = *s;
+        section->next = NULL;
+        *tail = section;
+        tail = &section->next;
+        if (!s->shared) {
+            section->data = allocSection(inst, s->size, s->align, s->exec);
+            if (!section->data) {
+                ERR("Section malloc failled");
+                goto err;
+            }
+            if (s->nobits) {
+                memset(section->data, 0, s->size);
+            } else {
+                LOADER_GETDATA(inst, s->offset, section->data, s->size);
+            }
+        }
+        if (s->data == ctx->text) {
+            inst->text = section->data;
+        }
+    }
+    for (ELFLoaderSection_t* section = inst->section; section != NULL; section = section->next) {
+        if (!section->shared && relocateSection(inst, section) != 0) {
+            goto err;
+        }
+    }
+    if (buildIndex(inst) != 0) {
+        goto err;
+    }
+    inst->loaded = 1;
+    return inst;
+err:
+    ERR("Instantiation failed");
+    elfLoaderFree(inst);
+    return NULL;
+}
+
+
+/*** Patches ***/
+
+
+/*
+ * A patch is an ELF built from the fixed source of a loaded module. The
+ * sections defining the patched functions are loaded from the patch, with
+ * the read-only sections they reference such as their literals and
+ * strings. Their references to the global symbols of the module, e.g. the
+ * unpatched functions, are resolved by name, and the other ones to
+ * writable sections use the module sections with the same name and size:
+ * the module data is left as is. The entry of each patched function is
+ * overwritten with a jump to the new one, so callers and function pointers
+ * reach it.
+ */
+
+#define PATCH_LOAD 1
+#define PATCH_MODULE 2
+#define PATCH_DONE 4
+
+
+/* Undefined symbols of a patch: the module symbols, then its resolver */
+static void *patchResolve(void *arg, const char *name) {
+    ELFLoaderContext_t *ctx = arg;
+    void *addr = elfLoaderGetSymbol(ctx, name);
+    if (!addr && ctx->resolver) {
+        addr = ctx->resolver->resolve(ctx->resolver->arg, name);
+    }
+    return addr;
+}
+
+
+/* The section of ctx named name, of size bytes */
+static ELFLoaderSection_t *patchModuleSection(ELFLoaderContext_t *ctx, const char *name, size_t size) {
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        Elf32_Shdr sectHdr;
+        char sectName[33] = "";
+        if (section->size == size && readSection(ctx, section->secIdx, &sectHdr, sectName, sizeof(sectName) - 1) == 0 && strcmp(sectName, name) == 0) {
+            return section;
+        }
+    }
+    return NULL;
+}
+
+
+/* Mark what to load from the patch: the sections flagged PATCH_LOAD, and the ones their relocations target */
+static int patchMark(ELFLoaderContext_t *ctx, ELFLoaderContext_t *patch, uint8_t *flags, const off_t *relSecIdx) {
+    int changed;
+    do {
+        changed = 0;
+        for (int n = 1; n < patch->e_shnum; n++) {
+            if ((flags[n] & (PATCH_LOAD | PATCH_DONE)) != PATCH_LOAD || !relSecIdx[n]) {
+                continue;
+            }
+            flags[n] |= PATCH_DONE;
+            Elf32_Shdr relHdr;
+            LOADER_GETDATA(patch, patch->e_shoff + relSecIdx[n] * sizeof(Elf32_Shdr), &relHdr, sizeof(Elf32_Shdr));
+            for (size_t i = 0; i < relHdr.sh_size / sizeof(Elf32_Rela); i++) {
+                Elf32_Rela rel;
+                Elf32_Sym sym;
+                Elf32_Shdr sectHdr;
+                char name[33] = "";
+                LOADER_GETDATA(patch, relHdr.sh_offset + i * sizeof(rel), &rel, sizeof(rel));
+                if (readSymbol(patch, ELF32_R_SYM(rel.r_info), &sym, name, sizeof(name) - 1) != 0) {
+                    goto err;
+                }
+                if (sym.st_shndx == SHN_UNDEF || sym.st_shndx >= patch->e_shnum || (flags[sym.st_shndx] & (PATCH_LOAD | PATCH_MODULE))) {
+                    continue;
+                }
+                if (ELF32_ST_BIND(sym.st_info) != STB_LOCAL && elfLoaderGetSymbol(ctx, name)) {
+                    continue;
+                }
+                LOADER_GETDATA(patch, patch->e_shoff + sym.st_shndx * sizeof(Elf32_Shdr), &sectHdr, sizeof(Elf32_Shdr));
+                if ((sectHdr.sh_flags & SHF_WRITE) || sectHdr.sh_type == SHT_NOBITS) {
+                    flags[sym.st_shndx] |= PATCH_MODULE;
+                } else {
+                    flags[sym.st_shndx] |= PATCH_LOAD;
+                    changed = 1;
+                }
+            }
+        }
+    } while (changed);
+    return 0;
+err:
+    ERR("Error reading relocation data");
+    return -1;
+}
+
+
+/* Load the marked sections of the patch, and point the other ones to the module sections */
+static int patchSections(ELFLoaderContext_t *ctx, ELFLoaderContext_t *patch, const uint8_t *flags, const off_t *relSecIdx) {
+    for (int n = 1; n < patch->e_shnum; n++) {
+        Elf32_Shdr sectHdr;
+        char name[33] = "";
+        if (!(flags[n] & (PATCH_LOAD | PATCH_MODULE)) || readSection(patch, n, &sectHdr, name, sizeof(name) - 1) != 0) {
+            continue;
+        }
+        if (flags[n] & PATCH_LOAD) {
+            ELFLoaderSection_t* section = loadSection(patch, n, name, sectHdr.sh_flags & SHF_EXECINSTR, 0, sectHdr.sh_offset, sectHdr.sh_size, sectHdr.sh_addralign, 0);
+            if (!section) {
+                return -1;
+            }
+            section->relSecIdx = relSecIdx[n];
+            continue;
+        }
+        ELFLoaderSection_t *m = patchModuleSection(ctx, name, sectHdr.sh_size);
+        if (!m) {
+            ERR("Section not in the module: %s", name);
+            return -1;
+        }
+        ELFLoaderSection_t* section = newSection(patch);
+        section->data = m->data;
+        section->secIdx = n;
+        section->size = m->size;
+        section->exec = m->exec;
+        section->nobits = m->nobits;
+        section->shared = 1;
+        section->next = patch->section;
+        patch->section = section;
+    }
+    return 0;
+}
+
+
+/*
+ * Replace the functions names of the loaded module ctx with the ones of
+ * patch, an initialized context not loaded yet, freed by the call. The
+ * functions must not run meanwhile. The sections loaded are freed with
+ * the module.
+ */
+int elfLoaderPatch(ELFLoaderContext_t *ctx, ELFLoaderContext_t *patch, const char *const *names, unsigned int count) {
+    ELFLoaderResolver_t resolver = { ctx, patchResolve };
+    uint8_t *flags = NULL;
+    off_t *relSecIdx = NULL;
+    Elf32_Sym *syms = malloc(count * sizeof(Elf32_Sym) + 1);
+    assert(syms);
+    memset(syms, 0, count * sizeof(Elf32_Sym));
+    if (!ctx->loaded || ctx->base || ctx->shareable || ctx->overlayBudget || ctx->rebasable) {
+        ERR("Module not loaded, instantiated, overlay or rebasable module");
+        goto err;
+    }
+    patch->base = ctx;
+    patch->slabOwner = ctx;
+    patch->resolver = &resolver;
+    patch->allocator = ctx->allocator;
+    if (readHeader(patch) != 0) {
+        goto err;
+    }
+    flags = malloc(patch->e_shnum);
+    relSecIdx = malloc(patch->e_shnum * sizeof(off_t));
+    assert(flags && relSecIdx);
+    memset(flags, 0, patch->e_shnum);
+    memset(relSecIdx, 0, patch->e_shnum * sizeof(off_t));
+    for (int n = 1; n < patch->e_shnum; n++) {
+        Elf32_Shdr sectHdr;
+        char name[33] = "";
+        if (readSection(patch, n, &sectHdr, name, sizeof(name) - 1) != 0) {
+            goto err;
+        }
+        if (sectHdr.sh_type == SHT_RELA && sectHdr.sh_info < patch->e_shnum) {
+            relSecIdx[sectHdr.sh_info] = n;
+        } else if (strcmp(name, ".symtab") == 0) {
+            patch->symtab_offset = sectHdr.sh_offset;
+            patch->symtab_count = sectHdr.sh_size / sizeof(Elf32_Sym);
+        } else if (strcmp(name, ".strtab") == 0) {
+            patch->strtab_offset = sectHdr.sh_offset;
+        }
+    }
+
+    /* The sections defining the functions */
+    for (int i = 0; i < patch->symtab_count; i++) {
+        Elf32_Sym sym;
+        char name[33] = "";
+        if (readSymbol(patch, i, &sym, name, sizeof(name) - 1) != 0) {
+            goto err;
+        }
+        int bind = ELF32_ST_BIND(sym.st_info);
+        if (sym.st_shndx == SHN_UNDEF || sym.st_shndx >= patch->e_shnum || (bind != STB_GLOBAL && bind != STB_WEAK)) {
+            continue;
+        }
+        for (unsigned int j = 0; j < count; j++) {
+            if (strcmp(name, names[j]) == 0) {
+                flags[sym.st_shndx] |= PATCH_LOAD;
+                syms[j] = sym;
+            }
+        }
+    }
+    for (unsigned int j = 0; j < count; j++) {
+        if (!syms[j].st_shndx || !elfLoaderGetSymbol(ctx, names[j])) {
+            ERR("Function not in the patch or the module: %s", names[j]);
+            goto err;
+        }
+    }
+    if (patchMark(ctx, patch, flags, relSecIdx) != 0 || patchSections(ctx, patch, flags, relSecIdx) != 0) {
+        goto err;
+    }
+    for (ELFLoaderSection_t* section = patch->section; section != NULL; section = section->next) {
+        if (!section->shared && relocateSection(patch, section) != 0) {
+            goto err;
+        }
+    }
+
+    /* Jump from the old entries once all are in range */
+    for (unsigned int j = 0; j < count; j++) {
+        Elf32_Addr from = (Elf32_Addr) elfLoaderGetSymbol(ctx, names[j]);
+        Elf32_Addr to = ((Elf32_Addr) findSection(patch, syms[j].st_shndx)->data) + syms[j].st_value;
+        int32_t delta = to - (from + 4);
+        if (delta < -(1 << 17) || delta >= (1 << 17)) {
+            ERR("Patch: %s out of jump range", names[j]);
+            goto err;
+        }
+    }
+    for (unsigned int j = 0; j < count; j++) {
+        Elf32_Addr from = (Elf32_Addr) elfLoaderGetSymbol(ctx, names[j]);
+        Elf32_Addr to = ((Elf32_Addr) findSection(patch, syms[j].st_shndx)->data) + syms[j].st_value;
+        uint32_t before, after;
+        /* J, its offset set as a relocation */
+        unalignedSet8((void*) from, 0x06);
+        unalignedSet8((void*) (from + 1), 0);
+        unalignedSet8((void*) (from + 2), 0);
+        relocateSymbol(from, R_XTENSA_SLOT0_OP, to, 0, &before, &after);
+        MSG("Patch: %s %08X -> %08X", names[j], (unsigned int) from, (unsigned int) to);
+    }
+
+    /* The module keeps the loaded sections */
+    ELFLoaderSection_t** tail = &patch->section;
+    while (*tail) {
+        ELFLoaderSection_t* section = *tail;
+        if (section->shared) {
+            tail = &section->next;
+        } else {
+            *tail = section->next;
+            section->next = ctx->patches;
+            ctx->patches = section;
+        }
+    }
+    free(syms);
+    free(flags);
+    free(relSecIdx);
+    elfLoaderFree(patch);
+    return 0;
+err:
+    ERR("Patch failed");
+    free(syms);
+    free(flags);
+    free(relSecIdx);
+    elfLoaderFree(patch);
+    return -1;
+}
+
+
+/*** Reloads ***/
+
 
+/*
+ * A reload replaces a loaded module with a new version, copying only the
+ * sections that changed. Sections are matched by name, and are unchanged
+ * when their data and relocation entries, symbols taken by name, hash the
+ * same. Unchanged sections stay in place with their current content, e.g.
+ * the module state in .data and .bss: only their relocations whose target
+ * moved are applied again. The other sections are allocated, read and
+ * relocated as on a load.
+ */
+
+
+static void hashBytes(uint32_t *hash, const void *data, size_t size) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; i++) {
+        *hash ^= p[i];
+        *hash *= 16777619;
+    }
+}
+
+
+/* Hash of section n of ctx: its header, data and relocation entries */
+static int sectionHash(ELFLoaderContext_t *ctx, int n, off_t relSecIdx, uint32_t *hash) {
+    Elf32_Shdr sectHdr;
+    uint8_t buffer[64];
+    *hash = 2166136261;
+    LOADER_GETDATA(ctx, ctx->e_shoff + n * sizeof(Elf32_Shdr), &sectHdr, sizeof(Elf32_Shdr));
+    hashBytes(hash, &sectHdr.sh_type, sizeof(sectHdr.sh_type));
+    hashBytes(hash, &sectHdr.sh_flags, sizeof(sectHdr.sh_flags));
+    hashBytes(hash, &sectHdr.sh_size, sizeof(sectHdr.sh_size));
+    hashBytes(hash, &sectHdr.sh_addralign, sizeof(sectHdr.sh_addralign));
+    for (size_t off = 0; sectHdr.sh_type != SHT_NOBITS && off < sectHdr.sh_size; off += sizeof(buffer)) {
+        size_t len = sectHdr.sh_size - off < sizeof(buffer) ? sectHdr.sh_size - off : sizeof(buffer);
+        LOADER_GETDATA(ctx, sectHdr.sh_offset + off, buffer, len);
+        hashBytes(hash, buffer, len);
+    }
+    if (relSecIdx) {
+        Elf32_Shdr relHdr;
+        LOADER_GETDATA(ctx, ctx->e_shoff + relSecIdx * sizeof(Elf32_Shdr), &relHdr, sizeof(Elf32_Shdr));
+        for (size_t i = 0; i < relHdr.sh_size / sizeof(Elf32_Rela); i++) {
+            Elf32_Rela rel;
+            Elf32_Sym sym;
+            char name[33] = "";
+            LOADER_GETDATA(ctx, relHdr.sh_offset + i * sizeof(rel), &rel, sizeof(rel));
+            if (readSymbol(ctx, ELF32_R_SYM(rel.r_info), &sym, name, sizeof(name) - 1) != 0) {
+                goto err;
+            }
+            uint32_t type = ELF32_R_TYPE(rel.r_info);
+            hashBytes(hash, &rel.r_offset, sizeof(rel.r_offset));
+            hashBytes(hash, &type, sizeof(type));
+            hashBytes(hash, &rel.r_addend, sizeof(rel.r_addend));
+            hashBytes(hash, name, strlen(name) + 1);
+        }
+    }
+    return 0;
 err:
-    elfLoaderFree(ctx);
-    return NULL;
+    ERR("Error reading section %i", n);
+    return -1;
 }
 
 
-int elfLoaderSetFunc(ELFLoaderContext_t *ctx, const char* funcname) {
-    ctx->exec = 0;
-    MSG("Scanning ELF symbols");
-    MSG("  Sym  Symbol                         sect value    size relAddr");
-    for (int symCount = 0; symCount < ctx->symtab_count; symCount++) {
+/* Bytes of a kept section before a fixup, put back when the reload fails */
+typedef struct {
+    Elf32_Addr addr;
+    uint8_t bytes[4];
+    size_t len;
+} ELFLoaderReloadUndo_t;
+
+typedef struct {
+    ELFLoaderReloadUndo_t *entries;
+    size_t count;
+} ELFLoaderReloadUndoLog_t;
+
+
+static void reloadUndo(ELFLoaderReloadUndoLog_t *log) {
+    while (log->count) {
+        ELFLoaderReloadUndo_t *e = &log->entries[--log->count];
+        for (size_t k = 0; k < e->len; k++) {
+            unalignedSet8((void*) (e->addr + k), e->bytes[k]);
+        }
+    }
+}
+
+
+/*
+ * Apply again the relocations of the unchanged section s whose target
+ * moved, old being s in ctx. The bytes overwritten are saved in log.
+ */
+static int reloadFixup(ELFLoaderContext_t *ctx, ELFLoaderContext_t *next, ELFLoaderSection_t *old, ELFLoaderSection_t *s, ELFLoaderReloadUndoLog_t *log) {
+    Elf32_Shdr relHdr;
+    Elf32_Shdr oldRelHdr;
+    LOADER_GETDATA(next, next->e_shoff + s->relSecIdx * sizeof(Elf32_Shdr), &relHdr, sizeof(Elf32_Shdr));
+    LOADER_GETDATA(ctx, ctx->e_shoff + old->relSecIdx * sizeof(Elf32_Shdr), &oldRelHdr, sizeof(Elf32_Shdr));
+    for (size_t i = 0; i < relHdr.sh_size / sizeof(Elf32_Rela); i++) {
+        Elf32_Rela rel;
+        Elf32_Rela oldRel;
         Elf32_Sym sym;
-        char name[33] = "<unnamed>";
-        if (readSymbol(ctx, symCount, &sym, name, sizeof(name)) != 0) {
-            ERR("Error reading symbol");
+        Elf32_Sym oldSym;
+        char name[33] = "";
+        char oldName[33] = "";
+        LOADER_GETDATA(next, relHdr.sh_offset + i * sizeof(rel), &rel, sizeof(rel));
+        LOADER_GETDATA(ctx, oldRelHdr.sh_offset + i * sizeof(oldRel), &oldRel, sizeof(oldRel));
+        int relType = ELF32_R_TYPE(rel.r_info);
+        if (relType == R_XTENSA_NONE || relType == R_XTENSA_ASM_EXPAND) {
+            continue;
+        }
+        if (readSymbol(next, ELF32_R_SYM(rel.r_info), &sym, name, sizeof(name) - 1) != 0 ||
+                readSymbol(ctx, ELF32_R_SYM(oldRel.r_info), &oldSym, oldName, sizeof(oldName) - 1) != 0) {
+            goto err;
+        }
+        Elf32_Addr symAddr = findSymAddr(next, &sym, name) + rel.r_addend;
+        if (symAddr == findSymAddr(ctx, &oldSym, oldName) + oldRel.r_addend) {
+            continue;
+        }
+        /* Back to the section data, then relocated to the new target */
+        Elf32_Addr relAddr = ((Elf32_Addr) s->data) + rel.r_offset;
+        uint8_t raw[4];
+        size_t len = relType == R_XTENSA_32 ? 4 : 3;
+        LOADER_GETDATA(next, s->offset + rel.r_offset, raw, len);
+        ELFLoaderReloadUndo_t *entries = realloc(log->entries, (log->count + 1) * sizeof(ELFLoaderReloadUndo_t));
+        assert(entries);
+        log->entries = entries;
+        ELFLoaderReloadUndo_t *e = &log->entries[log->count++];
+        e->addr = relAddr;
+        e->len = len;
+        for (size_t k = 0; k < len; k++) {
+            e->bytes[k] = unalignedGet8((void*) (relAddr + k));
+        }
+        for (size_t k = 0; k < len; k++) {
+            unalignedSet8((void*) (relAddr + k), raw[k]);
+        }
+        uint32_t from = 0;
+        uint32_t to = 0;
+        if (relocateSymbol(relAddr, relType, symAddr, sym.st_value, &from, &to) != 0) {
             return -1;
         }
-        if(strcmp(name, funcname) == 0) {
-            Elf32_Addr symAddr = findSymAddr(ctx, &sym, name);
-            if (symAddr == 0xffffffff) {
-                MSG("  %04X %-30s %04X %08X %04X ????????", symCount, name, sym.st_shndx, sym.st_value, sym.st_size);
-            } else {
-                ctx->exec = (void*)symAddr;
-                MSG("  %04X %-30s %04X %08X %04X %08X", symCount, name, sym.st_shndx, sym.st_value, sym.st_size, symAddr);
+        MSG("  %08X %04X %-20s %08X %08X->%08X %s + %X", rel.r_offset, relType, type2String(relType), relAddr, from, to, name, rel.r_addend);
+    }
+    return 0;
+err:
+    ERR("Error reading relocation data");
+    return -1;
+}
+
+
+/* Read the section headers of next and place its sections, reusing the unchanged ones of ctx. Returns the number of sections copied */
+static int reloadSections(ELFLoaderContext_t *ctx, ELFLoaderContext_t *next, off_t *relSecIdx, ELFLoaderSection_t **oldSections, uint8_t *kept) {
+    int copied = 0;
+    for (int n = 1; n < next->e_shnum; n++) {
+        Elf32_Shdr sectHdr;
+        char name[33] = "";
+        if (readSection(next, n, &sectHdr, name, sizeof(name) - 1) != 0) {
+            return -1;
+        }
+        if (sectHdr.sh_type == SHT_RELA && sectHdr.sh_info < next->e_shnum) {
+            relSecIdx[sectHdr.sh_info] = n;
+        } else if (strcmp(name, ".symtab") == 0) {
+            next->symtab_offset = sectHdr.sh_offset;
+            next->symtab_count = sectHdr.sh_size / sizeof(Elf32_Sym);
+        } else if (strcmp(name, ".strtab") == 0) {
+            next->strtab_offset = sectHdr.sh_offset;
+        }
+    }
+    for (int n = 1; n < next->e_shnum; n++) {
+        Elf32_Shdr sectHdr;
+        char name[33] = "";
+        uint32_t hash;
+        if (readSection(next, n, &sectHdr, name, sizeof(name) - 1) != 0 || !(sectHdr.sh_flags & SHF_ALLOC) || !sectHdr.sh_size) {
+            continue;
+        }
+        if (sectionHash(next, n, relSecIdx[n], &hash) != 0) {
+            return -1;
+        }
+        ELFLoaderSection_t *old = ctx->section;
+        while (old) {
+            Elf32_Shdr oldHdr;
+            char oldName[33] = "";
+            if (!kept[old->secIdx] && old->hash == hash && readSection(ctx, old->secIdx, &oldHdr, oldName, sizeof(oldName) - 1) == 0 && strcmp(oldName, name) == 0) {
+                break;
             }
+            old = old->next;
+        }
+        ELFLoaderSection_t* section;
+        if (old) {
+            section = newSection(next);
+            *section = *old;
+            section->deps = NULL;
+            section->next = next->section;
+            next->section = section;
+            section->secIdx = n;
+            section->offset = sectHdr.sh_offset;
+            section->relSecIdx = relSecIdx[n];
+            section->shared = 1;
+            kept[old->secIdx] = 1;
+            oldSections[n] = old;
         } else {
-            MSG("  %04X %-30s %04X %08X %04X", symCount, name, sym.st_shndx, sym.st_value, sym.st_size);
+            section = loadSection(next, n, name, sectHdr.sh_flags & SHF_EXECINSTR, sectHdr.sh_type == SHT_NOBITS, sectHdr.sh_offset, sectHdr.sh_size, sectHdr.sh_addralign, relSecIdx[n]);
+            if (!section) {
+                return -1;
+            }
+            section->relSecIdx = relSecIdx[n];
+            if (section->nobits) {
+                memset(section->data, 0, section->size);
+            }
+            copied++;
+        }
+        section->hash = hash;
+        if (strcmp(name, ".text") == 0) {
+            next->text = section->data;
+        }
+    }
+    return copied;
+}
+
+
+/*
+ * Replace the loaded module ctx with next, an initialized context of its
+ * new version not loaded yet, freed by the call. ctx then is the new
+ * version: its source has to stay readable for the next reload, and
+ * symbols in changed sections, e.g. the function of elfLoaderSetFunc,
+ * have to be looked up again. Returns the number of sections copied,
+ * -1 on error, ctx being unchanged.
+ */
+int elfLoaderReload(ELFLoaderContext_t *ctx, ELFLoaderContext_t *next) {
+    off_t *relSecIdx = NULL;
+    ELFLoaderSection_t **oldSections = NULL;
+    uint8_t *kept = NULL;
+    ELFLoaderReloadUndoLog_t log = { NULL, 0 };
+    int copied = -1;
+    if (!ctx->loaded || ctx->base || ctx->shareable || ctx->overlayBudget || ctx->patches || ctx->mapData || ctx->mapExec || ctx->rebasable) {
+        ERR("Module not loaded, or instantiated, overlay, patched, mapped or rebasable module");
+        goto err;
+    }
+    next->base = ctx;
+    next->slabOwner = ctx;
+    next->allocator = ctx->allocator;
+    if (!next->resolver) {
+        next->resolver = ctx->resolver;
+    }
+    if (readHeader(next) != 0) {
+        goto err;
+    }
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        if (!ctx->hashed && sectionHash(ctx, section->secIdx, section->relSecIdx, &section->hash) != 0) {
+            goto err;
+        }
+    }
+    ctx->hashed = 1;
+    relSecIdx = malloc(next->e_shnum * sizeof(off_t));
+    oldSections = malloc(next->e_shnum * sizeof(ELFLoaderSection_t*));
+    kept = malloc(ctx->e_shnum);
+    assert(relSecIdx && oldSections && kept);
+    memset(relSecIdx, 0, next->e_shnum * sizeof(off_t));
+    memset(oldSections, 0, next->e_shnum * sizeof(ELFLoaderSection_t*));
+    memset(kept, 0, ctx->e_shnum);
+
+    MSG("Reloading sections");
+    copied = reloadSections(ctx, next, relSecIdx, oldSections, kept);
+    if (copied < 0) {
+        goto err;
+    }
+    for (ELFLoaderSection_t* section = next->section; section != NULL; section = section->next) {
+        if (!section->shared && relocateSection(next, section) != 0) {
+            goto err;
+        }
+    }
+    if (buildIndex(next) != 0) {
+        goto err;
+    }
+    for (ELFLoaderSection_t* section = next->section; section != NULL; section = section->next) {
+        if (section->shared && section->relSecIdx && reloadFixup(ctx, next, oldSections[section->secIdx], section, &log) != 0) {
+            goto err;
+        }
+    }
+
+    /* The kept sections change hands, the other old ones are freed */
+    for (ELFLoaderSection_t* section = ctx->section; section != NULL; section = section->next) {
+        int inside = (uint8_t*) ctx->exec >= (uint8_t*) section->data && (uint8_t*) ctx->exec < (uint8_t*) section->data + section->size;
+        if (inside && !kept[section->secIdx]) {
+            ctx->exec = NULL;
+        }
+        if (kept[section->secIdx]) {
+            section->data = NULL;
+        }
+    }
+    freeSections(ctx, ctx->section);
+    for (ELFLoaderSection_t* section = next->section; section != NULL; section = section->next) {
+        section->shared = 0;
+    }
+    ctx->section = next->section;
+    next->section = NULL;
+    free(ctx->index);
+    ctx->index = next->index;
+    ctx->indexCount = next->indexCount;
+    next->index = NULL;
+    ctx->fd = next->fd;
+    ctx->fdOffset = next->fdOffset;
+    ctx->fragments = next->fragments;
+    ctx->reader = next->reader;
+    ctx->env = next->env;
+    ctx->resolver = next->resolver;
+    ctx->text = next->text;
+    ctx->imageSize = next->imageSize;
+    ctx->e_shnum = next->e_shnum;
+    ctx->e_shoff = next->e_shoff;
+    ctx->shstrtab_offset = next->shstrtab_offset;
+    ctx->symtab_count = next->symtab_count;
+    ctx->symtab_offset = next->symtab_offset;
+    ctx->strtab_offset = next->strtab_offset;
+    ctx->metaOffset = next->metaOffset;
+    ctx->meta = next->meta;
+    MSG("Reloaded: %i sections copied", copied);
+    free(log.entries);
+    free(relSecIdx);
+    free(oldSections);
+    free(kept);
+    elfLoaderFree(next);
+    return copied;
+err:
+    ERR("Reload failed");
+    /* The kept sections are shared until then: ctx gets them back as they were */
+    reloadUndo(&log);
+    free(log.entries);
+    free(relSecIdx);
+    free(oldSections);
+    free(kept);
+    elfLoaderFree(next);
+    return -1;
+}
+
+
+/*** Rebase ***/
+
+
+/*
+ * A rebasable module keeps a record of its relocations, so that its sections
+ * can be moved once loaded, e.g. to defragment the executable memory. It
+ * takes 16 bytes per relocation, less than the ELF tables, and the module
+ * source is not read again. The module must be quiescent while moved: no
+ * task running in it or returning to it, and no address in it held outside,
+ * as the ones given by elfLoaderGetSymbol or to the modules importing from
+ * it. Words set by a relocation to a moved section are shifted, even when
+ * the module changed them since.
+ */
+
+
+/* Keep the relocation record, before loading */
+int elfLoaderSetRebasable(ELFLoaderContext_t *ctx, int rebasable) {
+    if (ctx->section || ctx->overlayBudget) {
+        ERR("Sections already allocated or overlay module");
+        return -1;
+    }
+    ctx->rebasable = rebasable;
+    return 0;
+}
+
+
+static int isMovable(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+    return s->data && !s->mapped && !s->shared && (!ctx->allocator || ctx->allocator->free);
+}
+
+
+static void rebaseFree(ELFLoaderContext_t *ctx, void *data, int exec) {
+    if (!ctx->allocator) {
+        free(data);
+    } else {
+        ctx->allocator->free(ctx->allocator->arg, data, exec);
+    }
+}
+
+
+/* Apply e again, its target moved by delta */
+static int rebaseEntry(ELFLoaderContext_t *ctx, const ELFLoaderRebaseEntry_t *e, Elf32_Addr delta) {
+    Elf32_Addr relAddr = (Elf32_Addr) findSection(ctx, e->section)->data + e->offset;
+    if (!e->op) {
+        unalignedSet32((void*) relAddr, unalignedGet32((void*) relAddr) + delta);
+        return 0;
+    }
+    Elf32_Addr symAddr = e->value + (e->target ? (Elf32_Addr) findSection(ctx, e->target)->data : 0);
+    for (int i = 0; i < 3; i++) {
+        unalignedSet8((void*) (relAddr + i), e->op >> (i * 8));
+    }
+    uint32_t from = 0;
+    uint32_t to = 0;
+    return relocateSymbol(relAddr, R_XTENSA_SLOT0_OP, symAddr, 0, &from, &to);
+}
+
+
+/* Copy s to data and fix the relocations in and to it, s is unchanged on error */
+static int rebaseSection(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s, void *data) {
+    void *old = s->data;
+    Elf32_Addr delta = (Elf32_Addr) data - (Elf32_Addr) old;
+    LOADER_MEMCPY(data, old, s->size);
+    s->data = data;
+    for (size_t i = 0; i < ctx->rebaseCount; i++) {
+        ELFLoaderRebaseEntry_t *e = &ctx->rebase[i];
+        if (e->section == s->secIdx && (e->op || e->target == s->secIdx) && rebaseEntry(ctx, e, e->target == s->secIdx ? delta : 0) != 0) {
+            s->data = old;
+            return -1;
+        }
+    }
+    /* The relocations to s in the other sections are fixed in place, undone on error */
+    size_t i;
+    for (i = 0; i < ctx->rebaseCount; i++) {
+        ELFLoaderRebaseEntry_t *e = &ctx->rebase[i];
+        if (e->section != s->secIdx && e->target == s->secIdx && rebaseEntry(ctx, e, delta) != 0) {
+            break;
+        }
+    }
+    if (i < ctx->rebaseCount) {
+        s->data = old;
+        for (size_t j = 0; j <= i; j++) {
+            ELFLoaderRebaseEntry_t *e = &ctx->rebase[j];
+            if (e->section != s->secIdx && e->target == s->secIdx && (e->op || j < i)) {
+                rebaseEntry(ctx, e, -delta);
+            }
+        }
+        return -1;
+    }
+    if ((Elf32_Addr) ctx->exec - (Elf32_Addr) old < s->size) {
+        ctx->exec = (uint8_t*) data + ((uint8_t*) ctx->exec - (uint8_t*) old);
+    }
+    if (ctx->text == old) {
+        ctx->text = data;
+    }
+    return 0;
+}
+
+
+/* Move s to new memory from the allocator when it is at a lower address: 1 when moved */
+static int rebaseLower(ELFLoaderContext_t *ctx, ELFLoaderSection_t *s) {
+    void *data = allocSection(ctx, s->size, s->align, s->exec);
+    if (!data) {
+        return 0;
+    }
+    void *old = s->data;
+    if ((Elf32_Addr) data > (Elf32_Addr) old || rebaseSection(ctx, s, data) != 0) {
+        rebaseFree(ctx, data, s->exec);
+        return 0;
+    }
+    MSG("  section %2d: %08X -> %08X", s->secIdx, (unsigned int) old, (unsigned int) data);
+    rebaseFree(ctx, old, s->exec);
+    return 1;
+}
+
+
+/*
+ * Move the executable sections, or the data ones, of a loaded rebasable
+ * module to lower addresses when the allocator has room there. Returns the
+ * number of sections moved, -1 on error.
+ */
+int elfLoaderRebase(ELFLoaderContext_t *ctx, int exec) {
+    return elfLoaderCompact(&ctx, 1, exec);
+}
+
+
+typedef struct {
+    ELFLoaderContext_t *ctx;
+    ELFLoaderSection_t *section;
+} ELFLoaderRebaseSection_t;
+
+
+static int compareRebaseSection(const void *a, const void *b) {
+    Elf32_Addr da = (Elf32_Addr) ((const ELFLoaderRebaseSection_t*) a)->section->data;
+    Elf32_Addr db = (Elf32_Addr) ((const ELFLoaderRebaseSection_t*) b)->section->data;
+    return da < db ? -1 : da > db;
+}
+
+
+/*
+ * Defragment the executable memory, or the data one, used by loaded
+ * rebasable modules: from the lowest one up, each section is moved to a
+ * lower free block when the allocator finds one, which frees its block to
+ * the sections above, until none moves. Sections only move down, the
+ * free memory gathers at the top. Returns the number of moves, -1 on error.
+ */
+int elfLoaderCompact(ELFLoaderContext_t *const *ctxs, unsigned int count, int exec) {
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (!ctxs[i]->loaded || !ctxs[i]->rebasable) {
+            ERR("Module not loaded or not rebasable");
+            return -1;
+        }
+        for (ELFLoaderSection_t* section = ctxs[i]->section; section != NULL; section = section->next) {
+            n++;
+        }
+    }
+    ELFLoaderRebaseSection_t *sections = malloc(n * sizeof(ELFLoaderRebaseSection_t) + 1);
+    assert(sections);
+    n = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        for (ELFLoaderSection_t* section = ctxs[i]->section; section != NULL; section = section->next) {
+            if (section->exec == (exec ? 1 : 0) && isMovable(ctxs[i], section)) {
+                sections[n].ctx = ctxs[i];
+                sections[n++].section = section;
+            }
+        }
+    }
+    MSG("Compacting %i sections", n);
+    int moved = 0;
+    int r;
+    do {
+        r = 0;
+        qsort(sections, n, sizeof(ELFLoaderRebaseSection_t), compareRebaseSection);
+        for (unsigned int i = 0; i < n; i++) {
+            r += rebaseLower(sections[i].ctx, sections[i].section);
+        }
+        moved += r;
+    } while (r);
+    free(sections);
+    return moved;
+}
+
+
+static ELFLoaderContext_t* loadAndRelocate(ELFLoaderContext_t* ctx) {
+    if (elfLoaderLoadAndRelocate(ctx) != 0) {
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+ELFLoaderContext_t* elfLoaderInit(LOADER_FD_T fd, const ELFLoaderEnv_t *env) {
+    ELFLoaderContext_t* ctx = initContext(env);
+    ctx->fd = fd;
+    return ctx;
+}
+
+
+ELFLoaderContext_t* elfLoaderInitAt(LOADER_FD_T fd, off_t offset, const ELFLoaderEnv_t *env) {
+    ELFLoaderContext_t* ctx = initContext(env);
+    ctx->fd = fd;
+    ctx->fdOffset = offset;
+    return ctx;
+}
+
+
+ELFLoaderContext_t* elfLoaderInitFragments(const ELFLoaderFragments_t *fragments, const ELFLoaderEnv_t *env) {
+    ELFLoaderContext_t* ctx = initContext(env);
+    ctx->fragments = fragments;
+    return ctx;
+}
+
+
+ELFLoaderContext_t* elfLoaderInitReader(const ELFLoaderReader_t *reader, const ELFLoaderEnv_t *env) {
+    ELFLoaderContext_t* ctx = initContext(env);
+    ctx->reader = reader;
+    return ctx;
+}
+
+
+int elfLoaderSetDigest(ELFLoaderContext_t *ctx, const ELFLoaderDigest_t *digest, const uint8_t *expected) {
+    if (digest && digest->size > ELFLOADER_DIGEST_MAX) {
+        ERR("Digest too large: %u", (unsigned) digest->size);
+        return -1;
+    }
+    ctx->digest = digest;
+    ctx->digestExpected = expected;
+    return 0;
+}
+
+
+void elfLoaderCancel(ELFLoaderContext_t *ctx) {
+    __atomic_store_n(ctx->cancel, 1, __ATOMIC_RELAXED);
+}
+
+
+int elfLoaderIsCancelled(ELFLoaderContext_t *ctx) {
+    return __atomic_load_n(ctx->cancel, __ATOMIC_RELAXED);
+}
+
+
+/* Allocate the section memory with allocator, e.g. from an arena */
+int elfLoaderSetAllocator(ELFLoaderContext_t *ctx, const ELFLoaderAllocator_t *allocator) {
+    if (ctx->section) {
+        ERR("Sections already allocated");
+        return -1;
+    }
+    ctx->allocator = allocator;
+    return 0;
+}
+
+
+/*
+ * The ELF image is also mapped at data, and at exec on the instruction bus
+ * (NULL when not executable), e.g. a flash partition mapped twice with
+ * esp_partition_mmap. Read-only sections without relocation to apply are
+ * then used in place instead of being copied.
+ */
+int elfLoaderSetMapped(ELFLoaderContext_t *ctx, const void *data, const void *exec) {
+    if (ctx->section) {
+        ERR("Sections already allocated");
+        return -1;
+    }
+    ctx->mapData = data;
+    ctx->mapExec = exec;
+    return 0;
+}
+
+
+/* Resolve the undefined symbols missing from the env through resolver, e.g. against other modules */
+int elfLoaderSetResolver(ELFLoaderContext_t *ctx, const ELFLoaderResolver_t *resolver) {
+    ctx->resolver = resolver;
+    return 0;
+}
+
+
+int elfLoaderSetPipelined(ELFLoaderContext_t *ctx, int pipelined) {
+    ctx->pipelined = pipelined;
+    return 0;
+}
+
+
+int elfLoaderSetRelocationThreads(ELFLoaderContext_t *ctx, unsigned int threads) {
+    if (threads > ELFLOADER_RELOC_THREADS_MAX) {
+        ERR("Too many relocation threads: %i", threads);
+        return -1;
+    }
+    ctx->relocThreads = threads;
+    return 0;
+}
+
+
+ELFLoaderContext_t* elfLoaderInitLoadAndRelocate(LOADER_FD_T fd, const ELFLoaderEnv_t *env) {
+    return loadAndRelocate(elfLoaderInit(fd, env));
+}
+
+
+ELFLoaderContext_t* elfLoaderInitLoadAndRelocateAt(LOADER_FD_T fd, off_t offset, const ELFLoaderEnv_t *env) {
+    return loadAndRelocate(elfLoaderInitAt(fd, offset, env));
+}
+
+
+ELFLoaderContext_t* elfLoaderInitLoadAndRelocateFragments(const ELFLoaderFragments_t *fragments, const ELFLoaderEnv_t *env) {
+    return loadAndRelocate(elfLoaderInitFragments(fragments, env));
+}
+
+
+ELFLoaderContext_t* elfLoaderInitLoadAndRelocateReader(const ELFLoaderReader_t *reader, const ELFLoaderEnv_t *env) {
+    return loadAndRelocate(elfLoaderInitReader(reader, env));
+}
+
+
+/* Local symbols are not indexed: they are looked up in the symbol table, as before the index */
+static void *findLocalSymbol(ELFLoaderContext_t *ctx, const char *name) {
+    for (size_t i = 0; i < ctx->symtab_count; i++) {
+        Elf32_Sym sym;
+        char symName[33] = "";
+        if (readSymbol(ctx, i, &sym, symName, sizeof(symName) - 1) != 0) {
+            ERR("Error reading symbol");
+            return NULL;
         }
+        if (ELF32_ST_BIND(sym.st_info) != STB_LOCAL || strcmp(symName, name) != 0) {
+            continue;
+        }
+        ELFLoaderSection_t *section = findSection(ctx, sym.st_shndx);
+        if (section && section->data) {
+            return (void*) (((Elf32_Addr) section->data) + sym.st_value);
+        }
+    }
+    return NULL;
+}
+
+
+int elfLoaderSetFunc(ELFLoaderContext_t *ctx, const char* funcname) {
+    ctx->exec = elfLoaderGetSymbol(ctx, funcname);
+    if (ctx->exec == 0 && ctx->indexed) {
+        ctx->exec = findLocalSymbol(ctx, funcname);
     }
     if (ctx->exec == 0) {
         ERR("Function symbol not found: %s", funcname);
         return -1;
     }
+    MSG("  %-30s %08X", funcname, (unsigned int) ctx->exec);
     return 0;
 }
 
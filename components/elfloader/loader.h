@@ -1,6 +1,13 @@
+#ifndef LOADER_H
+#define LOADER_H
+
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #if defined(__linux__)
 #define LOADER_FD_T FILE *
@@ -21,12 +28,122 @@ typedef struct {
     unsigned int exported_size; /*!< Elements on exported symbol array */
 } ELFLoaderEnv_t;
 
+typedef struct {
+    const void *data; /*!< Pointer to fragment data */
+    size_t size; /*!< Fragment size in bytes */
+} ELFLoaderFragment_t;
+
+typedef struct {
+    const ELFLoaderFragment_t *fragments; /*!< Pointer to fragments array, in stream order */
+    unsigned int fragments_size; /*!< Elements on fragments array */
+} ELFLoaderFragments_t;
+
+typedef struct {
+    void *arg; /*!< Reader argument, passed to the callback */
+    int (*read)(void *arg, off_t offset, void *buffer, size_t size); /*!< Read size bytes at offset, 0 on success */
+} ELFLoaderReader_t;
+
+typedef struct {
+    void *arg; /*!< Allocator argument, passed to the callbacks */
+    void *(*alloc)(void *arg, size_t size, size_t align, int exec); /*!< Section memory, NULL when out of memory */
+    void (*free)(void *arg, void *ptr, int exec); /*!< Release section memory, NULL when freed with the allocator */
+} ELFLoaderAllocator_t;
+
+typedef struct {
+    void *arg; /*!< Resolver argument, passed to the callback */
+    void *(*resolve)(void *arg, const char *name); /*!< Address of an undefined symbol, NULL when unknown */
+} ELFLoaderResolver_t;
+
+typedef struct {
+    void *state; /*!< Digest state, passed to the callbacks */
+    void (*init)(void *state); /*!< Start a new digest */
+    void (*update)(void *state, const void *data, size_t size); /*!< Hash size bytes of data */
+    void (*finish)(void *state, uint8_t *digest); /*!< Write the final digest */
+    size_t size; /*!< Digest size in bytes, at most ELFLOADER_DIGEST_MAX */
+} ELFLoaderDigest_t;
+
+#define ELFLOADER_DIGEST_MAX 64
+
+#define ELFLOADER_RELOC_THREADS_MAX 4
+
+/* Relocation entries from which the workers are used, overridden by the build */
+#ifndef ELFLOADER_RELOC_PARALLEL_MIN
+#define ELFLOADER_RELOC_PARALLEL_MIN 512
+#endif
+
+/* elfLoaderStep progress, the phase of the next step */
+#define ELFLOADER_STEP_DONE 0
+#define ELFLOADER_STEP_HEADER 1
+#define ELFLOADER_STEP_SECTIONS 2
+#define ELFLOADER_STEP_DATA 3
+#define ELFLOADER_STEP_DIGEST 4
+#define ELFLOADER_STEP_INDEX 5
+#define ELFLOADER_STEP_IMPORTS 6
+#define ELFLOADER_STEP_RELOCATE 7
+
+/* Largest section or digest data read by an elfLoaderStep step */
+#define ELFLOADER_STEP_CHUNK 256
+
+typedef struct {
+    size_t exec; /*!< Bytes of executable memory */
+    size_t data; /*!< Bytes of initialized data memory */
+    size_t bss; /*!< Bytes of zero initialized data memory */
+    size_t align; /*!< Largest section alignment */
+} ELFLoaderRequirements_t;
+
+typedef struct {
+    unsigned int hits; /*!< Functions acquired already loaded */
+    unsigned int misses; /*!< Functions acquired loaded on demand */
+    unsigned int evictions; /*!< Sections evicted */
+    size_t resident; /*!< Bytes of executable sections loaded */
+} ELFLoaderOverlayStats_t;
+
 typedef struct ELFLoaderContext_t ELFLoaderContext_t;
 
+/* Typed function pointer to a module symbol, called without going through elfLoaderRun */
+#define ELFLOADER_GET_FUNC(ctx, type, name) ((type) elfLoaderGetSymbol(ctx, name))
 
+
+int elfLoaderReadAt(LOADER_FD_T fd,off_t off,void *buffer,size_t size);
 int elfLoader(LOADER_FD_T fd,const ELFLoaderEnv_t *env,char *funcname,int arg);
 intptr_t elfLoaderRun(ELFLoaderContext_t *ctx,intptr_t arg);
 int elfLoaderSetFunc(ELFLoaderContext_t *ctx,const char *funcname);
+int elfLoaderGetSymbols(ELFLoaderContext_t *ctx,const char *const *names,void **symbols,unsigned int count);
+void *elfLoaderGetSymbol(ELFLoaderContext_t *ctx,const char *name);
+int elfLoaderIsCancelled(ELFLoaderContext_t *ctx);
+void elfLoaderCancel(ELFLoaderContext_t *ctx);
+int elfLoaderSetPipelined(ELFLoaderContext_t *ctx,int pipelined);
+int elfLoaderSetResolver(ELFLoaderContext_t *ctx,const ELFLoaderResolver_t *resolver);
+int elfLoaderSetMapped(ELFLoaderContext_t *ctx,const void *data,const void *exec);
+int elfLoaderSetAllocator(ELFLoaderContext_t *ctx,const ELFLoaderAllocator_t *allocator);
+int elfLoaderSetRelocationThreads(ELFLoaderContext_t *ctx,unsigned int threads);
+int elfLoaderSetDigest(ELFLoaderContext_t *ctx,const ELFLoaderDigest_t *digest,const uint8_t *expected);
+ELFLoaderContext_t *elfLoaderInitReader(const ELFLoaderReader_t *reader,const ELFLoaderEnv_t *env);
+ELFLoaderContext_t *elfLoaderInitFragments(const ELFLoaderFragments_t *fragments,const ELFLoaderEnv_t *env);
+ELFLoaderContext_t *elfLoaderInitAt(LOADER_FD_T fd,off_t offset,const ELFLoaderEnv_t *env);
+ELFLoaderContext_t *elfLoaderInit(LOADER_FD_T fd,const ELFLoaderEnv_t *env);
+int elfLoaderCompact(ELFLoaderContext_t *const *ctxs,unsigned int count,int exec);
+int elfLoaderRebase(ELFLoaderContext_t *ctx,int exec);
+int elfLoaderSetRebasable(ELFLoaderContext_t *ctx,int rebasable);
+int elfLoaderReload(ELFLoaderContext_t *ctx,ELFLoaderContext_t *next);
+int elfLoaderPatch(ELFLoaderContext_t *ctx,ELFLoaderContext_t *patch,const char *const *names,unsigned int count);
+ELFLoaderContext_t *elfLoaderInstantiate(ELFLoaderContext_t *ctx);
+int elfLoaderStep(ELFLoaderContext_t *ctx,unsigned int budget);
+int elfLoaderLoadAndRelocate(ELFLoaderContext_t *ctx);
+void elfLoaderOverlayGetStats(ELFLoaderContext_t *ctx,ELFLoaderOverlayStats_t *stats);
+void elfLoaderOverlayRelease(ELFLoaderContext_t *ctx,void *func);
+void *elfLoaderOverlayAcquire(ELFLoaderContext_t *ctx,const char *name);
+int elfLoaderSetOverlay(ELFLoaderContext_t *ctx,size_t budget);
+int elfLoaderGetRequirements(ELFLoaderContext_t *ctx,ELFLoaderRequirements_t *req);
 ELFLoaderContext_t *elfLoaderInitLoadAndRelocate(LOADER_FD_T fd,const ELFLoaderEnv_t *env);
+ELFLoaderContext_t *elfLoaderInitLoadAndRelocateAt(LOADER_FD_T fd,off_t offset,const ELFLoaderEnv_t *env);
+ELFLoaderContext_t *elfLoaderInitLoadAndRelocateFragments(const ELFLoaderFragments_t *fragments,const ELFLoaderEnv_t *env);
+ELFLoaderContext_t *elfLoaderInitLoadAndRelocateReader(const ELFLoaderReader_t *reader,const ELFLoaderEnv_t *env);
 void elfLoaderFree(ELFLoaderContext_t *ctx);
 void* elfLoaderGetTextAddr(ELFLoaderContext_t *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * C++ helpers for the elf module loader for esp32
+ *
+ * Copyright (C) 2017 by niicoooo <1niicoooo1@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef LOADER_HPP
+#define LOADER_HPP
+
+#include <stddef.h>
+#include <utility>
+
+#include "loader.h"
+
+extern "C" {
+#include "async.h"
+}
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+
+namespace elfloader {
+
+/*
+ * Typed function pointer to a module symbol, nullptr if not found:
+ *
+ *   auto process = elfloader::get<int(const int16_t*, size_t)>(ctx, "process");
+ *   process(samples, count);
+ *
+ * The call is a plain indirect call, as for a firmware function pointer.
+ */
+template<typename F>
+inline F* get(ELFLoaderContext_t *ctx, const char *name) noexcept {
+    return reinterpret_cast<F*>(elfLoaderGetSymbol(ctx, name));
+}
+
+
+/*
+ * Env built at compile time from a static symbols array:
+ *
+ *   static const ELFLoaderSymbol_t exports[] = { { "puts", (void*) puts } };
+ *   static constexpr ELFLoaderEnv_t env = elfloader::makeEnv(exports);
+ */
+template<size_t N>
+constexpr ELFLoaderEnv_t makeEnv(const ELFLoaderSymbol_t (&symbols)[N]) noexcept {
+    return ELFLoaderEnv_t{ symbols, N };
+}
+
+
+/*
+ * Non-owning view of a module symbol, valid while its module is loaded.
+ * T is the object type, or the function type for functions.
+ */
+template<typename T>
+class Symbol {
+    T *ptr;
+
+public:
+    constexpr Symbol() noexcept : ptr(nullptr) {}
+    explicit constexpr Symbol(T *ptr) noexcept : ptr(ptr) {}
+
+    T *get() const noexcept { return ptr; }
+    explicit operator bool() const noexcept { return ptr != nullptr; }
+    T &operator*() const noexcept { return *ptr; }
+    T *operator->() const noexcept { return ptr; }
+
+    template<typename... Args>
+    auto operator()(Args&&... args) const -> decltype((*ptr)(std::forward<Args>(args)...)) {
+        return (*ptr)(std::forward<Args>(args)...);
+    }
+};
+
+
+/*
+ * Owner of a loaded module, freed on destruction. Move-only, it is the
+ * size of a pointer and moves without allocating:
+ *
+ *   elfloader::Module module = elfloader::Module::load(data, env);
+ *   if (!module) {
+ *       return -1;
+ *   }
+ *   auto process = module.symbol<int(int)>("process");
+ */
+class Module {
+    ELFLoaderContext_t *ctx;
+
+public:
+    constexpr Module() noexcept : ctx(nullptr) {}
+    explicit constexpr Module(ELFLoaderContext_t *ctx) noexcept : ctx(ctx) {}
+    ~Module() { elfLoaderFree(ctx); }
+
+    Module(const Module&) = delete;
+    Module &operator=(const Module&) = delete;
+    Module(Module &&other) noexcept : ctx(other.ctx) { other.ctx = nullptr; }
+    Module &operator=(Module &&other) noexcept {
+        if (this != &other) {
+            elfLoaderFree(ctx);
+            ctx = other.ctx;
+            other.ctx = nullptr;
+        }
+        return *this;
+    }
+
+    static Module load(LOADER_FD_T fd, const ELFLoaderEnv_t &env) noexcept {
+        return Module(elfLoaderInitLoadAndRelocate(fd, &env));
+    }
+    static Module loadAt(LOADER_FD_T fd, off_t offset, const ELFLoaderEnv_t &env) noexcept {
+        return Module(elfLoaderInitLoadAndRelocateAt(fd, offset, &env));
+    }
+    static Module loadFragments(const ELFLoaderFragments_t &fragments, const ELFLoaderEnv_t &env) noexcept {
+        return Module(elfLoaderInitLoadAndRelocateFragments(&fragments, &env));
+    }
+
+    ELFLoaderContext_t *get() const noexcept { return ctx; }
+    explicit operator bool() const noexcept { return ctx != nullptr; }
+    ELFLoaderContext_t *release() noexcept {
+        ELFLoaderContext_t *r = ctx;
+        ctx = nullptr;
+        return r;
+    }
+
+    template<typename T>
+    Symbol<T> symbol(const char *name) const noexcept {
+        return Symbol<T>(ctx ? reinterpret_cast<T*>(elfLoaderGetSymbol(ctx, name)) : nullptr);
+    }
+};
+
+
+#if defined(__cpp_impl_coroutine)
+
+/*
+ * Awaitable asynchronous load, the coroutine resumes on the loader thread:
+ *
+ *   elfloader::Module module = co_await elfloader::loadAsync(elfLoaderInit(data, &env));
+ */
+class LoadAwaiter {
+    ELFLoaderContext_t *ctx;
+    ELFLoaderAsync_t *async;
+    std::coroutine_handle<> handle;
+
+    static void done(void *arg, ELFLoaderAsync_t *async, ELFLoaderAsyncStatus_t) noexcept {
+        LoadAwaiter *self = static_cast<LoadAwaiter*>(arg);
+        self->async = async;
+        self->handle.resume();
+    }
+
+public:
+    explicit LoadAwaiter(ELFLoaderContext_t *ctx) noexcept : ctx(ctx), async(nullptr) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        handle = h;
+        /* Once started, the load may resume the coroutine before returning here */
+        return elfLoaderLoadAsync(ctx, done, this) != nullptr;
+    }
+    Module await_resume() noexcept {
+        if (!async) {
+            /* Not started, ctx freed by elfLoaderLoadAsync */
+            return Module();
+        }
+        return Module(elfLoaderAsyncFinish(async));
+    }
+};
+
+inline LoadAwaiter loadAsync(ELFLoaderContext_t *ctx) noexcept {
+    return LoadAwaiter(ctx);
+}
+
+#endif
+
+}
+
+#endif
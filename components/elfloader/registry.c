@@ -0,0 +1,292 @@
+/*
+ * A registry of loaded elf modules linked against each other, for esp32
+ *
+ * Copyright (C) 2017 by niicoooo <1niicoooo1@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Modules loaded through the registry publish their global symbols. The
+ * undefined symbols of the next modules, missing from the env, are resolved
+ * against the published modules in load order: a shared library is loaded
+ * once and used by all its clients.
+ *
+ * A module holds a reference on each module it resolved a symbol from, a
+ * module can only be unloaded once no loaded module uses it.
+ *
+ * Lookups do not lock: loads and unloads are serialized by the registry
+ * lock and publish the module list with atomic stores, readers walk it
+ * inside a read section that only counts them. An unloaded module is
+ * unlinked first, then freed once the readers that could still see it have
+ * left, counted with two alternating counters as in SRCU.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "registry.h"
+
+
+#if INTERFACE
+#include "loader.h"
+
+typedef struct ELFLoaderRegistry_t ELFLoaderRegistry_t;
+
+#endif
+
+
+#ifdef __linux__
+
+#define MSG(...) printf(__VA_ARGS__); printf("\n");
+#define ERR(...) printf(__VA_ARGS__); printf("\n");
+
+#else
+
+#include "esp_log.h"
+static const char* TAG = "elfLoaderRegistry";
+#define MSG(...) ESP_LOGI(TAG,  __VA_ARGS__);
+#define ERR(...) ESP_LOGE(TAG,  __VA_ARGS__);
+
+#endif
+
+typedef struct ELFLoaderRegistryModule_t {
+    struct ELFLoaderRegistry_t *registry;
+    char *name;
+    ELFLoaderContext_t *ctx;
+    unsigned int refs;
+    struct ELFLoaderRegistryModule_t **deps;
+    unsigned int depCount;
+    struct ELFLoaderRegistryModule_t *next;
+} ELFLoaderRegistryModule_t;
+
+struct ELFLoaderRegistry_t {
+    pthread_mutex_t lock;
+    pthread_mutex_t syncLock;
+    ELFLoaderRegistryModule_t *modules;
+    unsigned int epoch;
+    unsigned int readers[2];
+};
+
+
+#define NEXT(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+
+static ELFLoaderRegistryModule_t *findModule(ELFLoaderRegistry_t *registry, const char *name) {
+    for (ELFLoaderRegistryModule_t *m = NEXT(registry->modules); m != NULL; m = NEXT(m->next)) {
+        if (strcmp(m->name, name) == 0) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+
+/* Release the references of module on its dependencies. Called locked */
+static void releaseDeps(ELFLoaderRegistryModule_t *module) {
+    for (unsigned int i = 0; i < module->depCount; i++) {
+        module->deps[i]->refs--;
+    }
+}
+
+
+static void freeModule(ELFLoaderRegistryModule_t *module) {
+    elfLoaderFree(module->ctx);
+    free(module->deps);
+    free(module->name);
+    free(module);
+}
+
+
+/* Wait for the readers that entered before the call to leave */
+static void synchronize(ELFLoaderRegistry_t *registry) {
+    pthread_mutex_lock(&registry->syncLock);
+    for (int i = 0; i < 2; i++) {
+        unsigned int epoch = __atomic_fetch_add(&registry->epoch, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&registry->readers[epoch & 1], __ATOMIC_SEQ_CST)) {
+            usleep(100);
+        }
+    }
+    pthread_mutex_unlock(&registry->syncLock);
+}
+
+
+/*
+ * Enter a read section, returns the token to leave it. The modules found
+ * and the symbols looked up in the section stay loaded until it is left.
+ * Never blocks, sections can be nested.
+ */
+int elfLoaderRegistryEnter(ELFLoaderRegistry_t *registry) {
+    int token = __atomic_load_n(&registry->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&registry->readers[token], 1, __ATOMIC_SEQ_CST);
+    return token;
+}
+
+
+void elfLoaderRegistryLeave(ELFLoaderRegistry_t *registry, int token) {
+    __atomic_fetch_sub(&registry->readers[token], 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Resolver of the module being loaded, records the modules it depends on */
+static void *resolve(void *arg, const char *name) {
+    ELFLoaderRegistryModule_t *module = arg;
+    ELFLoaderRegistry_t *registry = module->registry;
+    void *addr = NULL;
+    pthread_mutex_lock(&registry->lock);
+    for (ELFLoaderRegistryModule_t *m = registry->modules; m != NULL && !addr; m = m->next) {
+        addr = elfLoaderGetSymbol(m->ctx, name);
+        if (addr) {
+            unsigned int i = 0;
+            while (i < module->depCount && module->deps[i] != m) {
+                i++;
+            }
+            if (i == module->depCount) {
+                ELFLoaderRegistryModule_t **deps = realloc(module->deps, (module->depCount + 1) * sizeof(ELFLoaderRegistryModule_t*));
+                assert(deps);
+                module->deps = deps;
+                module->deps[module->depCount++] = m;
+                m->refs++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry->lock);
+    return addr;
+}
+
+
+ELFLoaderRegistry_t *elfLoaderRegistryCreate(void) {
+    ELFLoaderRegistry_t *registry = malloc(sizeof(ELFLoaderRegistry_t));
+    assert(registry);
+    memset(registry, 0, sizeof(ELFLoaderRegistry_t));
+    pthread_mutex_init(&registry->lock, NULL);
+    pthread_mutex_init(&registry->syncLock, NULL);
+    return registry;
+}
+
+
+/* Unload all the modules, clients first. No reader may be left */
+void elfLoaderRegistryDestroy(ELFLoaderRegistry_t *registry) {
+    if (registry) {
+        while (registry->modules) {
+            ELFLoaderRegistryModule_t **m = &registry->modules;
+            while ((*m)->refs) {
+                m = &(*m)->next;
+                assert(*m);
+            }
+            ELFLoaderRegistryModule_t *module = *m;
+            *m = module->next;
+            releaseDeps(module);
+            freeModule(module);
+        }
+        pthread_mutex_destroy(&registry->lock);
+        pthread_mutex_destroy(&registry->syncLock);
+        free(registry);
+    }
+}
+
+
+/*
+ * Load and relocate ctx, resolving its undefined symbols against the env
+ * then against the modules of the registry, and publish it under name. The
+ * registry owns ctx, it is freed when the load fails.
+ */
+int elfLoaderRegistryLoad(ELFLoaderRegistry_t *registry, const char *name, ELFLoaderContext_t *ctx) {
+    ELFLoaderRegistryModule_t *module = malloc(sizeof(ELFLoaderRegistryModule_t));
+    assert(module);
+    memset(module, 0, sizeof(ELFLoaderRegistryModule_t));
+    module->registry = registry;
+    module->name = strdup(name);
+    assert(module->name);
+    module->ctx = ctx;
+
+    ELFLoaderResolver_t resolver = { module, resolve };
+    elfLoaderSetResolver(ctx, &resolver);
+    int r = elfLoaderLoadAndRelocate(ctx);
+    elfLoaderSetResolver(ctx, NULL);
+
+    pthread_mutex_lock(&registry->lock);
+    if (r == 0 && findModule(registry, name)) {
+        ERR("Module already loaded: %s", name);
+        r = -1;
+    }
+    if (r != 0) {
+        releaseDeps(module);
+        freeModule(module);
+    } else {
+        ELFLoaderRegistryModule_t **m = &registry->modules;
+        while (*m) {
+            m = &(*m)->next;
+        }
+        __atomic_store_n(m, module, __ATOMIC_RELEASE);
+        MSG("Module %s loaded, %i dependencies", name, module->depCount);
+    }
+    pthread_mutex_unlock(&registry->lock);
+    return r;
+}
+
+
+/*
+ * Unload the named module, -1 when other loaded modules use it. Waits for
+ * the readers that could still use it to leave: never call it from a read
+ * section.
+ */
+int elfLoaderRegistryUnload(ELFLoaderRegistry_t *registry, const char *name) {
+    pthread_mutex_lock(&registry->lock);
+    ELFLoaderRegistryModule_t **m = &registry->modules;
+    while (*m && strcmp((*m)->name, name) != 0) {
+        m = &(*m)->next;
+    }
+    ELFLoaderRegistryModule_t *module = NULL;
+    if (!*m) {
+        ERR("Module not loaded: %s", name);
+    } else if ((*m)->refs) {
+        ERR("Module %s in use by %i modules", name, (*m)->refs);
+    } else {
+        module = *m;
+        __atomic_store_n(m, module->next, __ATOMIC_RELEASE);
+        releaseDeps(module);
+    }
+    pthread_mutex_unlock(&registry->lock);
+    if (!module) {
+        return -1;
+    }
+    synchronize(registry);
+    freeModule(module);
+    return 0;
+}
+
+
+/* Module loaded under name, use it inside a read section when modules are unloaded concurrently */
+ELFLoaderContext_t *elfLoaderRegistryGet(ELFLoaderRegistry_t *registry, const char *name) {
+    int token = elfLoaderRegistryEnter(registry);
+    ELFLoaderRegistryModule_t *module = findModule(registry, name);
+    ELFLoaderContext_t *ctx = module ? module->ctx : NULL;
+    elfLoaderRegistryLeave(registry, token);
+    return ctx;
+}
+
+
+/* Address of a symbol published by a module of the registry, NULL if not found. Never blocks */
+void *elfLoaderRegistryGetSymbol(ELFLoaderRegistry_t *registry, const char *name) {
+    void *addr = NULL;
+    int token = elfLoaderRegistryEnter(registry);
+    for (ELFLoaderRegistryModule_t *m = NEXT(registry->modules); m != NULL && !addr; m = NEXT(m->next)) {
+        addr = elfLoaderGetSymbol(m->ctx, name);
+    }
+    elfLoaderRegistryLeave(registry, token);
+    return addr;
+}
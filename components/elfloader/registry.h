@@ -0,0 +1,14 @@
+/* This file was automatically generated.  Do not edit! */
+
+#include "loader.h"
+
+typedef struct ELFLoaderRegistry_t ELFLoaderRegistry_t;
+
+void *elfLoaderRegistryGetSymbol(ELFLoaderRegistry_t *registry,const char *name);
+ELFLoaderContext_t *elfLoaderRegistryGet(ELFLoaderRegistry_t *registry,const char *name);
+int elfLoaderRegistryUnload(ELFLoaderRegistry_t *registry,const char *name);
+int elfLoaderRegistryLoad(ELFLoaderRegistry_t *registry,const char *name,ELFLoaderContext_t *ctx);
+void elfLoaderRegistryDestroy(ELFLoaderRegistry_t *registry);
+ELFLoaderRegistry_t *elfLoaderRegistryCreate(void);
+void elfLoaderRegistryLeave(ELFLoaderRegistry_t *registry,int token);
+int elfLoaderRegistryEnter(ELFLoaderRegistry_t *registry);
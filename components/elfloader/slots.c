@@ -0,0 +1,233 @@
+/*
+ * Module slots for the elf loader, for esp32
+ *
+ * Copyright (C) 2017 by niicoooo <1niicoooo1@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * The exec and data memory of all the slots is reserved once, when the
+ * slots are created. A module is loaded in a free slot, its sections placed
+ * one after the other in the slot arenas, and unloading it frees the whole
+ * slot at once: the sections are not freed one by one, and loads and
+ * unloads make no heap allocation for the sections, so they cannot
+ * fragment it however they are interleaved.
+ *
+ * Slots are sized for the largest module, e.g. with elfLoaderGetRequirements:
+ * a module whose sections do not fit fails to load. The sections are not
+ * freed before the unload, overlay modules fill their slot.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "slots.h"
+
+
+#if INTERFACE
+#include "loader.h"
+
+typedef struct ELFLoaderSlots_t ELFLoaderSlots_t;
+
+#endif
+
+
+#ifdef __linux__
+
+#define MSG(...) printf(__VA_ARGS__); printf("\n");
+#define ERR(...) printf(__VA_ARGS__); printf("\n");
+
+#include <malloc.h>
+#define SLOTS_ALLOC_EXEC(size) memalign(4, size)
+#define SLOTS_ALLOC_DATA(size) memalign(4, size)
+
+#else
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+static const char* TAG = "elfLoaderSlots";
+#define MSG(...) ESP_LOGI(TAG,  __VA_ARGS__);
+#define ERR(...) ESP_LOGE(TAG,  __VA_ARGS__);
+
+#define SLOTS_ALLOC_EXEC(size) heap_caps_malloc(size, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT)
+#define SLOTS_ALLOC_DATA(size) heap_caps_malloc(size, MALLOC_CAP_8BIT)
+
+#endif
+
+typedef struct {
+    ELFLoaderContext_t *ctx;
+    int busy;
+    uint8_t *exec;
+    uint8_t *data;
+    size_t execUsed;
+    size_t dataUsed;
+    size_t execSize;
+    size_t dataSize;
+    ELFLoaderAllocator_t allocator;
+} ELFLoaderSlot_t;
+
+struct ELFLoaderSlots_t {
+    pthread_mutex_t lock;
+    uint8_t *exec;
+    uint8_t *data;
+    unsigned int count;
+    ELFLoaderSlot_t slot[];
+};
+
+
+static void *slotAlloc(void *arg, size_t size, size_t align, int exec) {
+    ELFLoaderSlot_t *slot = arg;
+    uint8_t *base = exec ? slot->exec : slot->data;
+    size_t *used = exec ? &slot->execUsed : &slot->dataUsed;
+    /* Aligned in memory, the slots themselves being only 4 bytes aligned */
+    size_t offset = (((uintptr_t) base + *used + align - 1) & ~(uintptr_t) (align - 1)) - (uintptr_t) base;
+    if (offset + size > (exec ? slot->execSize : slot->dataSize)) {
+        ERR("Slot full: %u %s bytes", (unsigned) size, exec ? "exec" : "data");
+        return NULL;
+    }
+    *used = offset + size;
+    return base + offset;
+}
+
+
+/*
+ * Create count slots of exec and data bytes each, data including the
+ * zero initialized one. NULL when the memory is not available.
+ */
+ELFLoaderSlots_t *elfLoaderSlotsCreate(unsigned int count, size_t exec, size_t data) {
+    exec = (exec + 3) & ~3;
+    data = (data + 3) & ~3;
+    ELFLoaderSlots_t *slots = malloc(sizeof(ELFLoaderSlots_t) + count * sizeof(ELFLoaderSlot_t));
+    assert(slots);
+    memset(slots, 0, sizeof(ELFLoaderSlots_t) + count * sizeof(ELFLoaderSlot_t));
+    slots->count = count;
+    slots->exec = exec ? SLOTS_ALLOC_EXEC(count * exec) : NULL;
+    slots->data = data ? SLOTS_ALLOC_DATA(count * data) : NULL;
+    if ((exec && !slots->exec) || (data && !slots->data)) {
+        ERR("Slots malloc failled");
+        free(slots->exec);
+        free(slots->data);
+        free(slots);
+        return NULL;
+    }
+    pthread_mutex_init(&slots->lock, NULL);
+    for (unsigned int i = 0; i < count; i++) {
+        ELFLoaderSlot_t *slot = &slots->slot[i];
+        slot->exec = slots->exec + i * exec;
+        slot->data = slots->data + i * data;
+        slot->execSize = exec;
+        slot->dataSize = data;
+        slot->allocator.arg = slot;
+        slot->allocator.alloc = slotAlloc;
+        slot->allocator.free = NULL;
+    }
+    MSG("Slots: %u of %u exec and %u data bytes", count, (unsigned) exec, (unsigned) data);
+    return slots;
+}
+
+
+/* Unload the modules still loaded, then free the slots memory */
+void elfLoaderSlotsDestroy(ELFLoaderSlots_t *slots) {
+    if (slots) {
+        for (unsigned int i = 0; i < slots->count; i++) {
+            elfLoaderFree(slots->slot[i].ctx);
+        }
+        pthread_mutex_destroy(&slots->lock);
+        free(slots->exec);
+        free(slots->data);
+        free(slots);
+    }
+}
+
+
+static void release(ELFLoaderSlots_t *slots, ELFLoaderSlot_t *slot) {
+    pthread_mutex_lock(&slots->lock);
+    slot->execUsed = 0;
+    slot->dataUsed = 0;
+    slot->ctx = NULL;
+    slot->busy = 0;
+    pthread_mutex_unlock(&slots->lock);
+}
+
+
+/*
+ * Load and relocate ctx, an initialized context, in a free slot. ctx is
+ * owned by the slot from then on, and freed when the load fails. The slot
+ * is reserved while loading, and the module is in it, e.g. for
+ * elfLoaderSlotsGet, once loaded. Returns the slot index, -1 on error.
+ */
+int elfLoaderSlotsLoad(ELFLoaderSlots_t *slots, ELFLoaderContext_t *ctx) {
+    if (!ctx) {
+        ERR("No module to load");
+        return -1;
+    }
+    pthread_mutex_lock(&slots->lock);
+    unsigned int i = 0;
+    while (i < slots->count && slots->slot[i].busy) {
+        i++;
+    }
+    if (i < slots->count) {
+        slots->slot[i].busy = 1;
+    }
+    pthread_mutex_unlock(&slots->lock);
+    if (i == slots->count) {
+        ERR("No free slot");
+        elfLoaderFree(ctx);
+        return -1;
+    }
+    ELFLoaderSlot_t *slot = &slots->slot[i];
+    if (elfLoaderSetAllocator(ctx, &slot->allocator) != 0 || elfLoaderLoadAndRelocate(ctx) != 0) {
+        ERR("Slot %u: load failed", i);
+        elfLoaderFree(ctx);
+        release(slots, slot);
+        return -1;
+    }
+    MSG("Slot %u: %u exec and %u data bytes", i, (unsigned) slot->execUsed, (unsigned) slot->dataUsed);
+    pthread_mutex_lock(&slots->lock);
+    slot->ctx = ctx;
+    pthread_mutex_unlock(&slots->lock);
+    return i;
+}
+
+
+/* Free ctx, loaded with elfLoaderSlotsLoad, and its slot: -1 when not in a slot */
+int elfLoaderSlotsUnload(ELFLoaderSlots_t *slots, ELFLoaderContext_t *ctx) {
+    pthread_mutex_lock(&slots->lock);
+    unsigned int i = 0;
+    while (i < slots->count && (!ctx || slots->slot[i].ctx != ctx)) {
+        i++;
+    }
+    pthread_mutex_unlock(&slots->lock);
+    if (i == slots->count) {
+        ERR("Module not in a slot");
+        return -1;
+    }
+    elfLoaderFree(ctx);
+    release(slots, &slots->slot[i]);
+    return 0;
+}
+
+
+/* Module loaded in slot index, NULL when free or still loading */
+ELFLoaderContext_t *elfLoaderSlotsGet(ELFLoaderSlots_t *slots, unsigned int index) {
+    if (index >= slots->count) {
+        return NULL;
+    }
+    pthread_mutex_lock(&slots->lock);
+    ELFLoaderContext_t *ctx = slots->slot[index].ctx;
+    pthread_mutex_unlock(&slots->lock);
+    return ctx;
+}
@@ -0,0 +1,11 @@
+/* This file was automatically generated.  Do not edit! */
+
+#include "loader.h"
+
+typedef struct ELFLoaderSlots_t ELFLoaderSlots_t;
+
+ELFLoaderContext_t *elfLoaderSlotsGet(ELFLoaderSlots_t *slots,unsigned int index);
+int elfLoaderSlotsUnload(ELFLoaderSlots_t *slots,ELFLoaderContext_t *ctx);
+int elfLoaderSlotsLoad(ELFLoaderSlots_t *slots,ELFLoaderContext_t *ctx);
+void elfLoaderSlotsDestroy(ELFLoaderSlots_t *slots);
+ELFLoaderSlots_t *elfLoaderSlotsCreate(unsigned int count,size_t exec,size_t data);
@@ -0,0 +1,11 @@
+unsigned char payload_build_test_delta_bin[] = {
+  0x45, 0x4c, 0x46, 0x44, 0x01, 0x00, 0x00, 0x00, 0x08, 0x06, 0x00, 0x00,
+  0x76, 0x76, 0xef, 0xbe, 0x08, 0x06, 0x00, 0x00, 0xc0, 0x04, 0x78, 0x09,
+  0x01, 0x00, 0x00, 0x00, 0x00, 0x44, 0x00, 0x00, 0x00, 0x02, 0x01, 0x00,
+  0x00, 0x00, 0xa2, 0x01, 0x45, 0x00, 0x00, 0x00, 0x16, 0x00, 0x00, 0x00,
+  0x02, 0x0b, 0x00, 0x00, 0x00, 0x0b, 0x22, 0x29, 0x07, 0x28, 0x07, 0xe6,
+  0x12, 0xe7, 0x0c, 0x02, 0x01, 0x66, 0x00, 0x00, 0x00, 0x2d, 0x02, 0x00,
+  0x00, 0x02, 0x01, 0x00, 0x00, 0x00, 0x32, 0x01, 0x94, 0x02, 0x00, 0x00,
+  0x74, 0x03, 0x00, 0x00
+};
+unsigned int payload_build_test_delta_bin_len = 88;
@@ -0,0 +1,11 @@
+#include <stdint.h>
+
+
+intptr_t overlay_value(intptr_t arg) {
+    return 0x12345678;
+}
+
+
+intptr_t local_main(intptr_t arg) {
+    return arg + 1;
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "unity.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "loader.h"
+#include "async.h"
+
+
+extern unsigned char payload_build_test_argvalue_elf[];
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+extern unsigned char payload_build_test_printf_gdb_elf[];
+extern unsigned int payload_build_test_printf_gdb_elf_len;
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+/* Callbacks run on the loader threads */
+static int completed;
+
+static void onDone(void *arg, ELFLoaderAsync_t *async, ELFLoaderAsyncStatus_t status) {
+    if (status == ELFLOADER_ASYNC_DONE) {
+        __atomic_add_fetch(&completed, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+/* Reads wait for the test to open the gate */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int open;
+} Gate_t;
+
+static int gatedRead(void *arg, off_t offset, void *buffer, size_t size) {
+    Gate_t *gate = arg;
+    pthread_mutex_lock(&gate->lock);
+    while (!gate->open) {
+        pthread_cond_wait(&gate->cond, &gate->lock);
+    }
+    pthread_mutex_unlock(&gate->lock);
+    if (offset + size > payload_build_test_printf_gdb_elf_len) {
+        return -1;
+    }
+    memcpy(buffer, payload_build_test_printf_gdb_elf + offset, size);
+    return 0;
+}
+
+
+TEST_CASE("async load", "[esp32-elfloader-async]") {
+    unsigned char *elfs[] = { payload_build_test_argvalue_elf, payload_build_test_printf_multiplefuncs_elf, payload_build_test_printf_gdb_elf };
+    ELFLoaderAsync_t *async[3];
+    __atomic_store_n(&completed, 0, __ATOMIC_SEQ_CST);
+    TEST_ASSERT( elfLoaderLoadAsync(NULL, onDone, NULL) == NULL );
+    for (int i = 0; i < 3; i++) {
+        async[i] = elfLoaderLoadAsync(elfLoaderInit(elfs[i], &env), onDone, NULL);
+        TEST_ASSERT( async[i] != NULL );
+    }
+    /* Poll the last one, wait for the others */
+    while (elfLoaderAsyncStatus(async[2]) == ELFLOADER_ASYNC_PENDING) {
+        vTaskDelay(1);
+    }
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT( elfLoaderAsyncWait(async[i]) == ELFLOADER_ASYNC_DONE );
+        ELFLoaderContext_t *ctx = elfLoaderAsyncFinish(async[i]);
+        TEST_ASSERT( ctx != NULL );
+        TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") != NULL );
+        elfLoaderFree(ctx);
+    }
+    /* The callbacks may still be running, for at most a second */
+    for (int i = 0; i < 100 && __atomic_load_n(&completed, __ATOMIC_SEQ_CST) < 3; i++) {
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+    TEST_ASSERT( __atomic_load_n(&completed, __ATOMIC_SEQ_CST) == 3 );
+}
+
+
+TEST_CASE("async load cancel", "[esp32-elfloader-async]") {
+    Gate_t gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+    ELFLoaderReader_t reader = { &gate, gatedRead };
+    ELFLoaderAsync_t *async = elfLoaderLoadAsync(elfLoaderInitReader(&reader, &env), NULL, NULL);
+    TEST_ASSERT( async != NULL );
+    /* The load cannot end before the gate is open */
+    TEST_ASSERT( elfLoaderAsyncStatus(async) == ELFLOADER_ASYNC_PENDING );
+    elfLoaderAsyncCancel(async);
+    pthread_mutex_lock(&gate.lock);
+    gate.open = 1;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.lock);
+    TEST_ASSERT( elfLoaderAsyncWait(async) == ELFLOADER_ASYNC_CANCELLED );
+    TEST_ASSERT( elfLoaderAsyncFinish(async) == NULL );
+}
@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "bundle.h"
+#include "payload-build/test-bundle-obj.h"
+
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+static intptr_t bundleRun(ELFLoaderBundle_t *bundle, const char *name, intptr_t arg) {
+    ELFLoaderContext_t* ctx = elfLoaderBundleLoad(bundle, name, &env);
+    if (ctx == NULL) {
+        printf("BundleLoad failed: %s\n", name);
+        return -1;
+    }
+    if (elfLoaderSetFunc(ctx, "local_main") != 0) {
+        printf("SetFunc failed\n");
+        elfLoaderFree(ctx);
+        return -1;
+    }
+    intptr_t result = elfLoaderRun(ctx, arg);
+    elfLoaderFree(ctx);
+    return result;
+}
+
+
+TEST_CASE("bundle", "[esp32-elfloader-bundle]") {
+    ELFLoaderBundle_t *bundle = elfLoaderBundleOpen(payload_build_test_bundle_bin);
+    TEST_ASSERT( bundle != NULL );
+    TEST_ASSERT( elfLoaderBundleCount(bundle) == 4 );
+
+    for (unsigned int i = 0; i < elfLoaderBundleCount(bundle); i++) {
+        char name[33];
+        const ELFLoaderBundleEntry_t *entry = elfLoaderBundleGetEntry(bundle, i);
+        TEST_ASSERT( elfLoaderBundleGetName(bundle, entry, name, sizeof(name)) == 0 );
+        TEST_ASSERT( elfLoaderBundleFind(bundle, name) == entry );
+        TEST_ASSERT( elfLoaderBundleVerify(bundle, entry) == 0 );
+    }
+    TEST_ASSERT( elfLoaderBundleFind(bundle, "test-missing") == NULL );
+
+    TEST_ASSERT( bundleRun(bundle, "test-argvalue", 0x11) == 0x12 );
+    TEST_ASSERT( bundleRun(bundle, "test-return-value", 0) == 0x12345678 );
+    TEST_ASSERT( bundleRun(bundle, "test-return-rwdata", 0) == 0x12345678 );
+    TEST_ASSERT( bundleRun(bundle, "test-loops1", 0) == 10 );
+
+    elfLoaderBundleClose(bundle);
+}
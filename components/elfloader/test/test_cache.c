@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "cache.h"
+
+
+extern unsigned char payload_build_test_argvalue_elf[];
+extern unsigned char payload_build_test_return_value_elf[];
+extern unsigned char payload_build_test_return_rwdata_elf[];
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+
+static unsigned char *payloads[] = {
+    payload_build_test_argvalue_elf,
+    payload_build_test_return_value_elf,
+    payload_build_test_return_rwdata_elf,
+    payload_build_test_printf_multiplefuncs_elf,
+};
+
+#define PLUGINS 30
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+/* "plugin-<n>": 30 plugins built from the test payloads */
+static ELFLoaderContext_t *pluginSource(void *arg, const char *name, const ELFLoaderEnv_t *env) {
+    int n;
+    if (sscanf(name, "plugin-%i", &n) != 1 || n < 0 || n >= PLUGINS) {
+        return NULL;
+    }
+    return elfLoaderInit(payloads[n % (sizeof(payloads) / sizeof(*payloads))], env);
+}
+
+
+/* Budget for about count average plugins */
+static ELFLoaderCache_t *createCache(int count) {
+    size_t exec = 0, data = 0;
+    for (int i = 0; i < sizeof(payloads) / sizeof(*payloads); i++) {
+        ELFLoaderRequirements_t req;
+        ELFLoaderContext_t *ctx = elfLoaderInit(payloads[i], &env);
+        TEST_ASSERT( elfLoaderGetRequirements(ctx, &req) == 0 );
+        exec += req.exec;
+        data += req.data + req.bss;
+        elfLoaderFree(ctx);
+    }
+    int n = sizeof(payloads) / sizeof(*payloads);
+    return elfLoaderCacheCreate(&env, exec * count / n, data * count / n + 64, pluginSource, NULL);
+}
+
+
+static ELFLoaderContext_t *getPlugin(ELFLoaderCache_t *cache, int n) {
+    char name[16];
+    sprintf(name, "plugin-%i", n);
+    return elfLoaderCacheGet(cache, name);
+}
+
+
+TEST_CASE("module cache", "[esp32-elfloader-cache]") {
+    ELFLoaderCache_t *cache = createCache(4);
+    ELFLoaderCacheStats_t stats;
+
+    ELFLoaderContext_t *ctx = getPlugin(cache, 0);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( getPlugin(cache, 0) == ctx );
+    elfLoaderCacheRelease(cache, ctx);
+    elfLoaderCacheGetStats(cache, &stats);
+    TEST_ASSERT( stats.hits == 1 && stats.misses == 1 && stats.modules == 1 );
+    TEST_ASSERT( elfLoaderCacheGet(cache, "plugin-missing") == NULL );
+
+    /* Plugin 0 is in use, it must stay resident */
+    for (int i = 1; i < PLUGINS; i++) {
+        ELFLoaderContext_t *other = getPlugin(cache, i);
+        TEST_ASSERT( other != NULL );
+        elfLoaderCacheRelease(cache, other);
+    }
+    elfLoaderCacheGetStats(cache, &stats);
+    TEST_ASSERT( stats.evictions > 0 );
+    TEST_ASSERT( stats.modules < PLUGINS );
+    TEST_ASSERT( getPlugin(cache, 0) == ctx );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0x11) == 0x12 );
+    elfLoaderCacheRelease(cache, ctx);
+    elfLoaderCacheRelease(cache, ctx);
+
+    elfLoaderCacheFlush(cache);
+    elfLoaderCacheGetStats(cache, &stats);
+    TEST_ASSERT( stats.modules == 0 && stats.exec == 0 && stats.data == 0 );
+    elfLoaderCacheDestroy(cache);
+
+    /* Nothing fits */
+    cache = elfLoaderCacheCreate(&env, 1, 1, pluginSource, NULL);
+    TEST_ASSERT( getPlugin(cache, 0) == NULL );
+    elfLoaderCacheDestroy(cache);
+}
+
+
+TEST_CASE("module cache benchmark", "[esp32-elfloader-cache][benchmark]") {
+    const int switches = 2000;
+    ELFLoaderCache_t *cache = createCache(4);
+    for (int cached = 0; cached <= 1; cached++) {
+        /* A working set of 4 plugins moving every 100 switches, 1 switch in 10 to a random plugin */
+        unsigned int seed = 7;
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < switches; i++) {
+            seed = seed * 1103515245 + 12345;
+            int n = (seed >> 16) % 10 == 0 ? (seed >> 8) % PLUGINS : (i / 100 + (seed >> 20) % 4) % PLUGINS;
+            if (cached) {
+                ELFLoaderContext_t *ctx = getPlugin(cache, n);
+                TEST_ASSERT( ctx != NULL );
+                elfLoaderCacheRelease(cache, ctx);
+            } else {
+                char name[16];
+                sprintf(name, "plugin-%i", n);
+                ELFLoaderContext_t *ctx = pluginSource(NULL, name, &env);
+                TEST_ASSERT( elfLoaderLoadAndRelocate(ctx) == 0 );
+                elfLoaderFree(ctx);
+            }
+        }
+        printf("%s: %i us/switch\n", cached ? "cache" : "no cache", (int) ((esp_timer_get_time() - start) / switches));
+    }
+    ELFLoaderCacheStats_t stats;
+    elfLoaderCacheGetStats(cache, &stats);
+    printf("hits %u misses %u evictions %u\n", stats.hits, stats.misses, stats.evictions);
+    elfLoaderCacheDestroy(cache);
+}
+
+
+TEST_CASE("module cache prefetch", "[esp32-elfloader-cache]") {
+    ELFLoaderCache_t *cache = createCache(4);
+    ELFLoaderCacheStats_t stats;
+    TEST_ASSERT( elfLoaderCachePrefetch(cache, "plugin-0") == 0 );
+    TEST_ASSERT( elfLoaderCachePrefetch(cache, "plugin-0") == 0 );
+    TEST_ASSERT( elfLoaderCachePrefetch(cache, "plugin-missing") == -1 );
+    ELFLoaderContext_t *ctx = getPlugin(cache, 0);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0x11) == 0x12 );
+    elfLoaderCacheRelease(cache, ctx);
+    elfLoaderCacheGetStats(cache, &stats);
+    TEST_ASSERT( stats.prefetches == 2 && stats.prefetchHits == 1 && stats.prefetchWasted == 1 );
+    TEST_ASSERT( stats.hits == 1 && stats.misses == 0 );
+
+    /* Destroy waits for a prefetch in flight */
+    TEST_ASSERT( elfLoaderCachePrefetch(cache, "plugin-1") == 0 );
+    elfLoaderCacheDestroy(cache);
+}
+
+
+TEST_CASE("module cache prefetch benchmark", "[esp32-elfloader-cache][benchmark]") {
+    const int switches = 100;
+    for (int prefetch = 0; prefetch <= 1; prefetch++) {
+        /* Room for 3 plugins, each runs for 10 ms: every switch is a miss without prefetch */
+        ELFLoaderCache_t *cache = createCache(3);
+        int64_t latency = 0, worst = 0;
+        for (int i = 0; i < switches; i++) {
+            int64_t start = esp_timer_get_time();
+            ELFLoaderContext_t *ctx = getPlugin(cache, i % PLUGINS);
+            int64_t t = esp_timer_get_time() - start;
+            TEST_ASSERT( ctx != NULL );
+            latency += t;
+            worst = t > worst ? t : worst;
+            if (prefetch) {
+                char name[16];
+                sprintf(name, "plugin-%i", (i + 1) % PLUGINS);
+                elfLoaderCachePrefetch(cache, name);
+            }
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+            elfLoaderCacheRelease(cache, ctx);
+        }
+        ELFLoaderCacheStats_t stats;
+        elfLoaderCacheGetStats(cache, &stats);
+        printf("%s: %i us/switch, %i us worst, prefetch hits %u/%u\n", prefetch ? "prefetch" : "no prefetch", (int) (latency / switches), (int) worst, stats.prefetchHits, stats.prefetches);
+        elfLoaderCacheDestroy(cache);
+    }
+}
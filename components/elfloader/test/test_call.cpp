@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "loader.hpp"
+
+
+extern "C" unsigned char payload_build_test_argvalue_elf[];
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+static intptr_t __attribute__((noinline)) firmware_main(intptr_t arg) {
+    return arg + 1;
+}
+
+
+TEST_CASE("typed call", "[esp32-elfloader-call]") {
+    ELFLoaderContext_t* ctx = elfLoaderInitLoadAndRelocate(payload_build_test_argvalue_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+
+    auto local_main = elfloader::get<intptr_t(intptr_t)>(ctx, "local_main");
+    TEST_ASSERT( local_main != nullptr );
+    TEST_ASSERT( local_main(0x11) == 0x12 );
+    TEST_ASSERT( elfloader::get<void(void)>(ctx, "missing") == nullptr );
+
+    typedef intptr_t (*local_main_t)(intptr_t);
+    local_main_t f = ELFLOADER_GET_FUNC(ctx, local_main_t, "local_main");
+    TEST_ASSERT( f == local_main );
+
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("typed call benchmark", "[esp32-elfloader-call][benchmark]") {
+    const int runLoops = 100;
+    const int callLoops = 100000;
+    ELFLoaderContext_t* ctx = elfLoaderInitLoadAndRelocate(payload_build_test_argvalue_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    auto local_main = elfloader::get<intptr_t(intptr_t)>(ctx, "local_main");
+    intptr_t (*volatile firmware)(intptr_t) = firmware_main;
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < runLoops; i++) {
+        TEST_ASSERT( elfLoaderRun(ctx, i) == i + 1 );
+    }
+    int64_t run = esp_timer_get_time() - start;
+
+    int64_t sum = 0;
+    start = esp_timer_get_time();
+    for (int i = 0; i < callLoops; i++) {
+        sum += local_main(i);
+    }
+    int64_t typed = esp_timer_get_time() - start;
+    TEST_ASSERT( sum == (int64_t) callLoops * (callLoops + 1) / 2 );
+
+    sum = 0;
+    start = esp_timer_get_time();
+    for (int i = 0; i < callLoops; i++) {
+        sum += firmware(i);
+    }
+    int64_t native = esp_timer_get_time() - start;
+    TEST_ASSERT( sum == (int64_t) callLoops * (callLoops + 1) / 2 );
+
+    printf("elfLoaderRun:    %i ns/call\n", (int) (run * 1000 / runLoops));
+    printf("typed pointer:   %i ns/call\n", (int) (typed * 1000 / callLoops));
+    printf("firmware call:   %i ns/call\n", (int) (native * 1000 / callLoops));
+    elfLoaderFree(ctx);
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "delta.h"
+#include "payload-build/test-delta-obj.h"
+
+
+extern unsigned char payload_build_test_loops1_elf[];
+extern unsigned char payload_build_test_loops2_elf[];
+extern unsigned int payload_build_test_loops2_elf_len;
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts },
+    { "printf", (void*) printf }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} slot_t;
+
+static int slotWrite(void *arg, const void *data, size_t size) {
+    slot_t *slot = arg;
+    if (slot->size + size > slot->capacity) {
+        return -1;
+    }
+    memcpy(slot->data + slot->size, data, size);
+    slot->size += size;
+    return 0;
+}
+
+
+static int applyDelta(void *old, slot_t *slot, size_t chunk) {
+    ELFLoaderDelta_t *delta = elfLoaderDeltaInit(old, slotWrite, slot);
+    int r = 0;
+    for (size_t off = 0; off < payload_build_test_delta_bin_len; off += chunk) {
+        size_t len = payload_build_test_delta_bin_len - off;
+        r |= elfLoaderDeltaFeed(delta, payload_build_test_delta_bin + off, len < chunk ? len : chunk);
+    }
+    r |= elfLoaderDeltaFinish(delta);
+    return r;
+}
+
+
+TEST_CASE("delta", "[esp32-elfloader-delta]") {
+    slot_t slot = { malloc(payload_build_test_loops2_elf_len), 0, payload_build_test_loops2_elf_len };
+    TEST_ASSERT( slot.data != NULL );
+
+    TEST_ASSERT( applyDelta(payload_build_test_loops1_elf, &slot, 7) == 0 );
+    TEST_ASSERT( slot.size == payload_build_test_loops2_elf_len );
+    TEST_ASSERT( memcmp(slot.data, payload_build_test_loops2_elf, slot.size) == 0 );
+
+    ELFLoaderContext_t* ctx = elfLoaderInitLoadAndRelocate(slot.data, &env);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    elfLoaderFree(ctx);
+
+    /* The delta does not apply to another module */
+    slot.size = 0;
+    TEST_ASSERT( applyDelta(payload_build_test_loops2_elf, &slot, payload_build_test_delta_bin_len) != 0 );
+
+    free(slot.data);
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_printf_gdb_elf[];
+extern unsigned int payload_build_test_printf_gdb_elf_len;
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+static void sha256Init(void *state) {
+    mbedtls_sha256_init(state);
+    mbedtls_sha256_starts(state, 0);
+}
+
+static void sha256Update(void *state, const void *data, size_t size) {
+    mbedtls_sha256_update(state, data, size);
+}
+
+static void sha256Finish(void *state, uint8_t *digest) {
+    mbedtls_sha256_finish(state, digest);
+    mbedtls_sha256_free(state);
+}
+
+static mbedtls_sha256_context sha256State;
+static const ELFLoaderDigest_t sha256 = { &sha256State, sha256Init, sha256Update, sha256Finish, 32 };
+
+
+static ELFLoaderContext_t *loadWithDigest(void *elf, const uint8_t *expected) {
+    ELFLoaderContext_t* ctx = elfLoaderInit(elf, &env);
+    elfLoaderSetDigest(ctx, &sha256, expected);
+    if (elfLoaderLoadAndRelocate(ctx) != 0) {
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+TEST_CASE("digest", "[esp32-elfloader-digest]") {
+    uint8_t digest[32];
+    sha256Init(&sha256State);
+    sha256Update(&sha256State, payload_build_test_printf_gdb_elf, payload_build_test_printf_gdb_elf_len);
+    sha256Finish(&sha256State, digest);
+
+    /* Detached digest */
+    ELFLoaderContext_t* ctx = loadWithDigest(payload_build_test_printf_gdb_elf, digest);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    elfLoaderFree(ctx);
+
+    /* Embedded digest, appended to the elf file */
+    uint8_t *signedElf = malloc(payload_build_test_printf_gdb_elf_len + sizeof(digest));
+    TEST_ASSERT( signedElf != NULL );
+    memcpy(signedElf, payload_build_test_printf_gdb_elf, payload_build_test_printf_gdb_elf_len);
+    memcpy(signedElf + payload_build_test_printf_gdb_elf_len, digest, sizeof(digest));
+    ctx = loadWithDigest(signedElf, NULL);
+    TEST_ASSERT( ctx != NULL );
+    elfLoaderFree(ctx);
+
+    /* Tampered module */
+    signedElf[payload_build_test_printf_gdb_elf_len / 2] ^= 0x01;
+    TEST_ASSERT( loadWithDigest(signedElf, NULL) == NULL );
+    free(signedElf);
+
+    digest[0] ^= 0x01;
+    TEST_ASSERT( loadWithDigest(payload_build_test_printf_gdb_elf, digest) == NULL );
+}
+
+
+TEST_CASE("digest benchmark", "[esp32-elfloader-digest][benchmark]") {
+    const int loops = 100;
+    uint8_t digest[32];
+    sha256Init(&sha256State);
+    sha256Update(&sha256State, payload_build_test_printf_gdb_elf, payload_build_test_printf_gdb_elf_len);
+    sha256Finish(&sha256State, digest);
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < loops; i++) {
+        uint8_t check[32];
+        sha256Init(&sha256State);
+        sha256Update(&sha256State, payload_build_test_printf_gdb_elf, payload_build_test_printf_gdb_elf_len);
+        sha256Finish(&sha256State, check);
+        TEST_ASSERT( memcmp(check, digest, sizeof(digest)) == 0 );
+        ELFLoaderContext_t* ctx = elfLoaderInitLoadAndRelocate(payload_build_test_printf_gdb_elf, &env);
+        TEST_ASSERT( ctx != NULL );
+        elfLoaderFree(ctx);
+    }
+    int64_t separate = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < loops; i++) {
+        ELFLoaderContext_t* ctx = loadWithDigest(payload_build_test_printf_gdb_elf, digest);
+        TEST_ASSERT( ctx != NULL );
+        elfLoaderFree(ctx);
+    }
+    int64_t single = esp_timer_get_time() - start;
+
+    printf("load then hash: %i us/load, %i KB/s\n", (int) (separate / loops), (int) ((int64_t) payload_build_test_printf_gdb_elf_len * loops * 1000000 / 1024 / separate));
+    printf("verify in load: %i us/load, %i KB/s\n", (int) (single / loops), (int) ((int64_t) payload_build_test_printf_gdb_elf_len * loops * 1000000 / 1024 / single));
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_return_rwdata_elf[];
+extern unsigned int payload_build_test_return_rwdata_elf_len;
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+static intptr_t loadFragmentsAndRun(size_t fragSize) {
+    ELFLoaderFragment_t fragments[(payload_build_test_return_rwdata_elf_len + fragSize - 1) / fragSize];
+    unsigned int count = 0;
+    for (size_t off = 0; off < payload_build_test_return_rwdata_elf_len; off += fragSize) {
+        size_t len = payload_build_test_return_rwdata_elf_len - off;
+        fragments[count].data = payload_build_test_return_rwdata_elf + off;
+        fragments[count].size = len < fragSize ? len : fragSize;
+        count++;
+    }
+    ELFLoaderFragments_t list = { fragments, count };
+
+    ELFLoaderContext_t* ctx = elfLoaderInitLoadAndRelocateFragments(&list, &env);
+    if (ctx == NULL) {
+        printf("InitLoadAndRelocateFragments failed\n");
+        return -1;
+    }
+    if (elfLoaderSetFunc(ctx, "local_main") != 0) {
+        printf("SetFunc failed\n");
+        elfLoaderFree(ctx);
+        return -1;
+    }
+    intptr_t result = elfLoaderRun(ctx, 0);
+    elfLoaderFree(ctx);
+    return result;
+}
+
+
+TEST_CASE("fragments", "[esp32-elfloader-fragments]") {
+    TEST_ASSERT( loadFragmentsAndRun(payload_build_test_return_rwdata_elf_len) == 0x12345678 );
+    TEST_ASSERT( loadFragmentsAndRun(512) == 0x12345678 );
+    TEST_ASSERT( loadFragmentsAndRun(13) == 0x12345678 );
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_heap_caps.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_return_rwdata_elf[];
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+TEST_CASE("instances with private data", "[esp32-elfloader-instance]") {
+    ELFLoaderContext_t *ctx = elfLoaderInitLoadAndRelocate(payload_build_test_return_rwdata_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    ELFLoaderContext_t *inst1 = elfLoaderInstantiate(ctx);
+    ELFLoaderContext_t *inst2 = elfLoaderInstantiate(ctx);
+    TEST_ASSERT( inst1 != NULL );
+    TEST_ASSERT( inst2 != NULL );
+
+    uint32_t *data1 = elfLoaderGetSymbol(inst1, "data");
+    uint32_t *data2 = elfLoaderGetSymbol(inst2, "data");
+    TEST_ASSERT( data1 != NULL && data2 != NULL && data1 != data2 );
+    *data1 = 0x11;
+    *(uint32_t*) elfLoaderGetSymbol(ctx, "data") = 0x22;
+    TEST_ASSERT( elfLoaderSetFunc(inst1, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderSetFunc(inst2, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(inst1, 0) == 0x11 );
+    TEST_ASSERT( elfLoaderRun(inst2, 0) == 0x12345678 );
+
+    elfLoaderFree(inst1);
+    elfLoaderFree(inst2);
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("instances share code", "[esp32-elfloader-instance]") {
+    ELFLoaderContext_t *ctx = elfLoaderInitLoadAndRelocate(payload_build_test_printf_multiplefuncs_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    ELFLoaderContext_t *inst = elfLoaderInstantiate(ctx);
+    TEST_ASSERT( inst != NULL );
+    TEST_ASSERT( elfLoaderGetSymbol(inst, "local_main") == elfLoaderGetSymbol(ctx, "local_main") );
+    TEST_ASSERT( elfLoaderSetFunc(inst, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(inst, 0) == 0 );
+    elfLoaderFree(inst);
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("instances benchmark", "[esp32-elfloader-instance][benchmark]") {
+    unsigned char *elfs[] = { payload_build_test_printf_multiplefuncs_elf, payload_build_test_return_rwdata_elf };
+    const char *names[] = { "multiplefuncs", "rwdata" };
+    const int count = 8;
+    for (int e = 0; e < 2; e++) {
+        for (int instances = 0; instances <= 1; instances++) {
+            size_t execFree = heap_caps_get_free_size(MALLOC_CAP_EXEC);
+            size_t dataFree = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+            ELFLoaderContext_t *ctxs[count];
+            for (int i = 0; i < count; i++) {
+                ctxs[i] = instances && i ? elfLoaderInstantiate(ctxs[0]) : elfLoaderInitLoadAndRelocate(elfs[e], &env);
+                TEST_ASSERT( ctxs[i] != NULL );
+            }
+            size_t execUsed = execFree - heap_caps_get_free_size(MALLOC_CAP_EXEC);
+            size_t dataUsed = dataFree - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+            for (int i = count - 1; i >= 0; i--) {
+                elfLoaderFree(ctxs[i]);
+            }
+            printf("%s, %i %s: %u exec and %u data heap bytes\n", names[e], count, instances ? "instances" : "loads", (unsigned int) execUsed, (unsigned int) dataUsed);
+        }
+    }
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "linkset.h"
+#include "registry.h"
+
+
+extern unsigned char payload_build_test_argvalue_elf[];
+extern unsigned char payload_build_test_return_value_elf[];
+extern unsigned char payload_build_test_return_rwdata_elf[];
+extern unsigned char payload_build_test_return_bss_elf[];
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+/* Built by the Makefile with the toolchain, the imports test is skipped without them */
+extern unsigned char payload_build_test_lib_elf[] __attribute__((weak));
+extern unsigned char payload_build_test_lib_user_elf[] __attribute__((weak));
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+static const ELFLoaderEnv_t emptyEnv = { NULL, 0 };
+
+
+TEST_CASE("link set", "[esp32-elfloader-linkset]") {
+    ELFLoaderContext_t *ctxs[] = {
+        elfLoaderInit(payload_build_test_argvalue_elf, &env),
+        elfLoaderInit(payload_build_test_return_rwdata_elf, &env)
+    };
+    ELFLoaderLinkSet_t *set = elfLoaderLinkSetLoad(ctxs, 2);
+    TEST_ASSERT( set != NULL );
+    TEST_ASSERT( elfLoaderLinkSetCount(set) == 2 );
+    TEST_ASSERT( elfLoaderLinkSetGetSymbol(set, "local_main") == elfLoaderGetSymbol(ctxs[0], "local_main") );
+    TEST_ASSERT( elfLoaderLinkSetGetSymbol(set, "data") == elfLoaderGetSymbol(ctxs[1], "data") );
+
+    ELFLoaderContext_t *ctx = elfLoaderLinkSetGet(set, 0);
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 1) == 2 );
+    ctx = elfLoaderLinkSetGet(set, 1);
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0x12345678 );
+
+    size_t exec, data;
+    elfLoaderLinkSetGetUsage(set, &exec, &data);
+    TEST_ASSERT( exec > 0 );
+    TEST_ASSERT( data > 0 );
+    elfLoaderLinkSetFree(set);
+
+    /* puts is nowhere */
+    ELFLoaderContext_t *alone = elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &emptyEnv);
+    TEST_ASSERT( elfLoaderLinkSetLoad(&alone, 1) == NULL );
+}
+
+
+TEST_CASE("link set imports", "[esp32-elfloader-linkset]") {
+    if (!payload_build_test_lib_elf || !payload_build_test_lib_user_elf) {
+        TEST_IGNORE_MESSAGE("test-lib payloads not built");
+    }
+    /* The client comes first: its imports are only resolved once the library is indexed */
+    ELFLoaderContext_t *ctxs[] = {
+        elfLoaderInit(payload_build_test_lib_user_elf, &env),
+        elfLoaderInit(payload_build_test_lib_elf, &env)
+    };
+    ELFLoaderLinkSet_t *set = elfLoaderLinkSetLoad(ctxs, 2);
+    TEST_ASSERT( set != NULL );
+    ELFLoaderContext_t *user = elfLoaderLinkSetGet(set, 0);
+    ELFLoaderContext_t *lib = elfLoaderLinkSetGet(set, 1);
+    uint8_t *libAdd = elfLoaderGetSymbol(lib, "lib_add");
+    uint8_t *userMain = elfLoaderGetSymbol(user, "local_main");
+    TEST_ASSERT( libAdd != NULL && userMain != NULL );
+    TEST_ASSERT( elfLoaderLinkSetGetSymbol(set, "lib_add") == libAdd );
+
+    /* Both modules are in the exec arena */
+    size_t exec, data;
+    elfLoaderLinkSetGetUsage(set, &exec, &data);
+    TEST_ASSERT( (size_t) (libAdd > userMain ? libAdd - userMain : userMain - libAdd) < exec );
+
+    /* local_main calls lib_add, then lib_apply calling back user_double */
+    TEST_ASSERT( elfLoaderSetFunc(user, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(user, 1) == 0x25 );
+    TEST_ASSERT( elfLoaderRun(user, 1) == 0x27 );
+    elfLoaderLinkSetFree(set);
+
+    /* lib_add is nowhere */
+    ELFLoaderContext_t *alone = elfLoaderInit(payload_build_test_lib_user_elf, &env);
+    TEST_ASSERT( elfLoaderLinkSetLoad(&alone, 1) == NULL );
+}
+
+
+TEST_CASE("link set benchmark", "[esp32-elfloader-linkset][benchmark]") {
+    unsigned char *elfs[] = { payload_build_test_argvalue_elf, payload_build_test_return_value_elf,
+                              payload_build_test_return_rwdata_elf, payload_build_test_return_bss_elf, payload_build_test_printf_multiplefuncs_elf
+                            };
+    const int count = sizeof(elfs) / sizeof(*elfs);
+    const int loads = 100;
+    for (int linked = 0; linked <= 1; linked++) {
+        size_t execFree = heap_caps_get_free_size(MALLOC_CAP_EXEC);
+        size_t dataFree = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        size_t execUsed = 0, dataUsed = 0;
+        int64_t time = 0;
+        for (int i = 0; i < loads; i++) {
+            ELFLoaderContext_t *ctxs[count];
+            for (int j = 0; j < count; j++) {
+                ctxs[j] = elfLoaderInit(elfs[j], &env);
+                TEST_ASSERT( ctxs[j] != NULL );
+            }
+            int64_t start = esp_timer_get_time();
+            if (linked) {
+                ELFLoaderLinkSet_t *set = elfLoaderLinkSetLoad(ctxs, count);
+                time += esp_timer_get_time() - start;
+                TEST_ASSERT( set != NULL );
+                execUsed = execFree - heap_caps_get_free_size(MALLOC_CAP_EXEC);
+                dataUsed = dataFree - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+                elfLoaderLinkSetFree(set);
+            } else {
+                ELFLoaderRegistry_t *registry = elfLoaderRegistryCreate();
+                for (int j = 0; j < count; j++) {
+                    char name[16];
+                    sprintf(name, "module-%i", j);
+                    TEST_ASSERT( elfLoaderRegistryLoad(registry, name, ctxs[j]) == 0 );
+                }
+                time += esp_timer_get_time() - start;
+                execUsed = execFree - heap_caps_get_free_size(MALLOC_CAP_EXEC);
+                dataUsed = dataFree - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+                elfLoaderRegistryDestroy(registry);
+            }
+        }
+        printf("%s: %i us/load, %u exec and %u data heap bytes\n", linked ? "link set" : "one by one", (int) (time / loads), (unsigned int) execUsed, (unsigned int) dataUsed);
+    }
+}
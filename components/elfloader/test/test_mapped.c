@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_printf_multiplestrings_elf[];
+extern unsigned int payload_build_test_printf_multiplestrings_elf_len;
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+extern unsigned int payload_build_test_printf_multiplefuncs_elf_len;
+extern unsigned char payload_build_test_return_rwdata_elf[];
+extern unsigned int payload_build_test_return_rwdata_elf_len;
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+/*
+ * The payloads are DRAM arrays without alignment: they are copied to a word
+ * aligned image, standing for a flash partition mapped on the data bus.
+ */
+static uint32_t *mapImage(const unsigned char *elf, size_t size) {
+    uint32_t *image = malloc(size);
+    if (image) {
+        memcpy(image, elf, size);
+    }
+    return image;
+}
+
+
+/* Sections allocated through the loader, the others being used in place */
+#define SECTIONS_MAX 8
+
+static struct {
+    uint32_t *exec[SECTIONS_MAX];
+    size_t execSize[SECTIONS_MAX];
+    unsigned int execCount;
+    size_t data;
+} allocated;
+
+static void *trackAlloc(void *arg, size_t size, size_t align, int exec) {
+    void *ptr = heap_caps_malloc(size, exec ? MALLOC_CAP_EXEC | MALLOC_CAP_32BIT : MALLOC_CAP_8BIT);
+    if (ptr && exec && allocated.execCount < SECTIONS_MAX) {
+        allocated.exec[allocated.execCount] = ptr;
+        allocated.execSize[allocated.execCount++] = size;
+    } else if (ptr && !exec) {
+        allocated.data += size;
+    }
+    return ptr;
+}
+
+static void trackFree(void *arg, void *ptr, int exec) {
+    heap_caps_free(ptr);
+}
+
+static const ELFLoaderAllocator_t tracker = { NULL, trackAlloc, trackFree };
+
+
+/* 1 when a word of the code sections, e.g. a literal, points into image: IRAM is read by words */
+static int codeReferences(const void *image, size_t size) {
+    for (unsigned int i = 0; i < allocated.execCount; i++) {
+        for (size_t j = 0; j < allocated.execSize[i] / 4; j++) {
+            uintptr_t word = allocated.exec[i][j];
+            if (word >= (uintptr_t) image && word < (uintptr_t) image + size) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/* Mapped, constants are used in place from image and code is copied. Otherwise all is copied */
+static ELFLoaderContext_t *load(const void *image, int mapped, const ELFLoaderAllocator_t *allocator) {
+    ELFLoaderContext_t *ctx = elfLoaderInit((void*) image, &env);
+    memset(&allocated, 0, sizeof(allocated));
+    if ((allocator && elfLoaderSetAllocator(ctx, allocator) != 0) || (mapped && elfLoaderSetMapped(ctx, image, NULL) != 0) || elfLoaderLoadAndRelocate(ctx) != 0) {
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+TEST_CASE("mapped load", "[esp32-elfloader-mapped]") {
+    unsigned char *elfs[] = { payload_build_test_printf_multiplestrings_elf, payload_build_test_printf_multiplefuncs_elf, payload_build_test_return_rwdata_elf };
+    unsigned int sizes[] = { payload_build_test_printf_multiplestrings_elf_len, payload_build_test_printf_multiplefuncs_elf_len, payload_build_test_return_rwdata_elf_len };
+    const intptr_t results[] = { 0, 0, 0x12345678 };
+    /* The printf payloads have a read-only .rodata without relocations, the rwdata one only a writable .data */
+    const int inPlace[] = { 1, 1, 0 };
+    for (int i = 0; i < 3; i++) {
+        uint32_t *image = mapImage(elfs[i], sizes[i]);
+        TEST_ASSERT( image != NULL );
+        ELFLoaderContext_t *ctx = load(image, 0, &tracker);
+        TEST_ASSERT( ctx != NULL );
+        size_t copiedData = allocated.data;
+        TEST_ASSERT( !codeReferences(image, sizes[i]) );
+        elfLoaderFree(ctx);
+
+        ctx = load(image, 1, &tracker);
+        TEST_ASSERT( ctx != NULL );
+        TEST_ASSERT( (allocated.data < copiedData) == inPlace[i] );
+        TEST_ASSERT( codeReferences(image, sizes[i]) == inPlace[i] );
+        TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+        TEST_ASSERT( elfLoaderRun(ctx, 0) == results[i] );
+        elfLoaderFree(ctx);
+        free(image);
+    }
+}
+
+
+TEST_CASE("mapped load benchmark", "[esp32-elfloader-mapped][benchmark]") {
+    const int loads = 100;
+    uint32_t *image = mapImage(payload_build_test_printf_multiplestrings_elf, payload_build_test_printf_multiplestrings_elf_len);
+    TEST_ASSERT( image != NULL );
+    for (int mapped = 0; mapped <= 1; mapped++) {
+        size_t execFree = heap_caps_get_free_size(MALLOC_CAP_EXEC);
+        size_t dataFree = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        size_t execUsed = 0, dataUsed = 0;
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < loads; i++) {
+            ELFLoaderContext_t *ctx = load(image, mapped, NULL);
+            TEST_ASSERT( ctx != NULL );
+            execUsed = execFree - heap_caps_get_free_size(MALLOC_CAP_EXEC);
+            dataUsed = dataFree - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+            elfLoaderFree(ctx);
+        }
+        printf("%s: %i us/load, %u exec and %u data heap bytes\n", mapped ? "mapped" : "copied", (int) ((esp_timer_get_time() - start) / loads), (unsigned int) execUsed, (unsigned int) dataUsed);
+    }
+    free(image);
+}
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "loader.h"
+#include "payload-build/test-return-rwdata-meta-obj.h"
+#include "payload-build/test-printf-multiplefuncs-meta-obj.h"
+
+
+extern unsigned char payload_build_test_return_rwdata_elf[];
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+TEST_CASE("meta requirements", "[esp32-elfloader-meta]") {
+    ELFLoaderRequirements_t scanned;
+    ELFLoaderRequirements_t meta;
+
+    ELFLoaderContext_t* ctx = elfLoaderInit(payload_build_test_return_rwdata_elf, &env);
+    TEST_ASSERT( elfLoaderGetRequirements(ctx, &scanned) == 0 );
+    elfLoaderFree(ctx);
+
+    ctx = elfLoaderInit(payload_build_test_return_rwdata_meta_elf, &env);
+    TEST_ASSERT( elfLoaderGetRequirements(ctx, &meta) == 0 );
+    TEST_ASSERT( memcmp(&scanned, &meta, sizeof(meta)) == 0 );
+    TEST_ASSERT( meta.exec > 0 );
+    TEST_ASSERT( meta.data == 4 );
+
+    TEST_ASSERT( elfLoaderLoadAndRelocate(ctx) == 0 );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0x12345678 );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("meta exports", "[esp32-elfloader-meta]") {
+    ELFLoaderContext_t* ctx = elfLoaderInitLoadAndRelocate(payload_build_test_printf_multiplefuncs_meta_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    const char *funcs[] = { "local_main", "local_main1", "local_main2", "local_main3" };
+    for (int i = 0; i < sizeof(funcs) / sizeof(*funcs); i++) {
+        TEST_ASSERT( elfLoaderSetFunc(ctx, funcs[i]) == 0 );
+        TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    }
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main4") != 0 );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "puts") != 0 );
+    elfLoaderFree(ctx);
+}
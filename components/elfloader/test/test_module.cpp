@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "unity.h"
+#include "loader.hpp"
+
+#if defined(__cpp_impl_coroutine)
+#include <atomic>
+#include <coroutine>
+#include <unistd.h>
+#endif
+
+
+extern "C" unsigned char payload_build_test_argvalue_elf[];
+extern "C" unsigned char payload_build_test_printf_multiplefuncs_elf[];
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static constexpr ELFLoaderEnv_t env = elfloader::makeEnv(exports);
+
+static_assert(sizeof(elfloader::Module) == sizeof(ELFLoaderContext_t*), "Module adds no state");
+static_assert(std::is_nothrow_move_constructible<elfloader::Module>::value, "Module moves are noexcept");
+static_assert(!std::is_copy_constructible<elfloader::Module>::value, "Module is move-only");
+
+
+TEST_CASE("module", "[esp32-elfloader-module]") {
+    std::vector<elfloader::Module> modules;
+    modules.push_back(elfloader::Module::load(payload_build_test_argvalue_elf, env));
+    modules.push_back(elfloader::Module::load(payload_build_test_printf_multiplefuncs_elf, env));
+    TEST_ASSERT( modules[0] );
+    TEST_ASSERT( modules[1] );
+
+    elfloader::Symbol<intptr_t(intptr_t)> argvalue = modules[0].symbol<intptr_t(intptr_t)>("local_main");
+    TEST_ASSERT( argvalue );
+    TEST_ASSERT( argvalue(0x11) == 0x12 );
+    TEST_ASSERT( !modules[0].symbol<int(int)>("local_main1") );
+
+    /* Moving a module keeps its symbols valid */
+    elfloader::Module moved = std::move(modules[0]);
+    TEST_ASSERT( !modules[0] );
+    TEST_ASSERT( moved.symbol<intptr_t(intptr_t)>("local_main").get() == argvalue.get() );
+    TEST_ASSERT( argvalue(0x11) == 0x12 );
+
+    moved = std::move(modules[1]);
+    TEST_ASSERT( moved.symbol<int(int)>("local_main1")(0) == 0 );
+    TEST_ASSERT( !modules[0].symbol<int(int)>("local_main") );
+}
+
+
+#if defined(__cpp_impl_coroutine)
+
+/* Eager coroutine freeing itself once done */
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {}
+    };
+};
+
+static Detached loadArgvalue(ELFLoaderContext_t *ctx, std::atomic<intptr_t> &result) {
+    elfloader::Module module = co_await elfloader::loadAsync(ctx);
+    elfloader::Symbol<intptr_t(intptr_t)> argvalue = module.symbol<intptr_t(intptr_t)>("local_main");
+    result = argvalue ? argvalue(0x11) : -1;
+}
+
+
+TEST_CASE("module async", "[esp32-elfloader-module]") {
+    std::atomic<intptr_t> result(0);
+    loadArgvalue(elfLoaderInit(payload_build_test_argvalue_elf, &env), result);
+    while (result == 0) {
+        usleep(1000);
+    }
+    TEST_ASSERT( result == 0x12 );
+
+    /* Not started: resumed at once, without a module */
+    result = 0;
+    loadArgvalue(nullptr, result);
+    TEST_ASSERT( result == -1 );
+}
+
+#endif
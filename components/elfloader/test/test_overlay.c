@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+extern unsigned char payload_build_test_printf_sections_elf[];
+/* Built by the Makefile with the toolchain, the eviction test is skipped without it */
+extern unsigned char payload_build_test_overlay_elf[] __attribute__((weak));
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts },
+    { "printf", (void*) printf }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+static ELFLoaderContext_t *loadOverlay(unsigned char *elf, size_t budget) {
+    ELFLoaderContext_t *ctx = elfLoaderInit(elf, &env);
+    if (elfLoaderSetOverlay(ctx, budget) != 0 || elfLoaderLoadAndRelocate(ctx) != 0) {
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+TEST_CASE("overlay load on demand", "[esp32-elfloader-overlay]") {
+    unsigned char *elfs[] = { payload_build_test_printf_multiplefuncs_elf, payload_build_test_printf_sections_elf };
+    for (int i = 0; i < 2; i++) {
+        ELFLoaderContext_t *ctx = loadOverlay(elfs[i], 4096);
+        TEST_ASSERT( ctx != NULL );
+        TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") == NULL );
+
+        int (*func)(int) = elfLoaderOverlayAcquire(ctx, "local_main");
+        TEST_ASSERT( func != NULL );
+        TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") == func );
+        TEST_ASSERT( func(0) == 0 );
+        elfLoaderOverlayRelease(ctx, func);
+        TEST_ASSERT( elfLoaderOverlayAcquire(ctx, "local_main") == func );
+        elfLoaderOverlayRelease(ctx, func);
+
+        ELFLoaderOverlayStats_t stats;
+        elfLoaderOverlayGetStats(ctx, &stats);
+        TEST_ASSERT( stats.misses == 1 && stats.hits == 1 && stats.evictions == 0 );
+        TEST_ASSERT( stats.resident > 0 && stats.resident <= 4096 );
+        TEST_ASSERT( elfLoaderOverlayAcquire(ctx, "missing") == NULL );
+        elfLoaderFree(ctx);
+    }
+}
+
+
+TEST_CASE("overlay budget", "[esp32-elfloader-overlay]") {
+    ELFLoaderContext_t *ctx = loadOverlay(payload_build_test_printf_multiplefuncs_elf, 16);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderOverlayAcquire(ctx, "local_main") == NULL );
+    ELFLoaderOverlayStats_t stats;
+    elfLoaderOverlayGetStats(ctx, &stats);
+    TEST_ASSERT( stats.resident == 0 );
+    elfLoaderFree(ctx);
+
+    /* Sections are set before loading */
+    ctx = elfLoaderInitLoadAndRelocate(payload_build_test_printf_multiplefuncs_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetOverlay(ctx, 4096) == -1 );
+    elfLoaderFree(ctx);
+}
+
+
+/* Resident bytes once the first count of names are acquired, with room for all */
+static size_t overlayResident(const char *const *names, int count) {
+    ELFLoaderContext_t *ctx = loadOverlay(payload_build_test_overlay_elf, 4096);
+    TEST_ASSERT( ctx != NULL );
+    for (int i = 0; i < count; i++) {
+        TEST_ASSERT( elfLoaderOverlayAcquire(ctx, names[i]) != NULL );
+    }
+    ELFLoaderOverlayStats_t stats;
+    elfLoaderOverlayGetStats(ctx, &stats);
+    elfLoaderFree(ctx);
+    return stats.resident;
+}
+
+
+TEST_CASE("overlay eviction", "[esp32-elfloader-overlay]") {
+    if (!payload_build_test_overlay_elf) {
+        TEST_IGNORE_MESSAGE("test-overlay payload not built");
+    }
+    /* Room for either function with its literals, not both */
+    const char *const names[] = { "overlay_value", "local_main" };
+    size_t first = overlayResident(names, 1);
+    size_t second = overlayResident(names + 1, 1);
+    size_t budget = first > second ? first : second;
+    TEST_ASSERT( budget < overlayResident(names, 2) );
+
+    ELFLoaderContext_t *ctx = loadOverlay(payload_build_test_overlay_elf, budget);
+    TEST_ASSERT( ctx != NULL );
+    ELFLoaderOverlayStats_t stats;
+    for (int i = 0; i < 6; i++) {
+        intptr_t (*func)(intptr_t) = elfLoaderOverlayAcquire(ctx, names[i % 2]);
+        TEST_ASSERT( func != NULL );
+        TEST_ASSERT( func(0x11) == (i % 2 ? 0x12 : 0x12345678) );
+        elfLoaderOverlayRelease(ctx, func);
+        elfLoaderOverlayGetStats(ctx, &stats);
+        TEST_ASSERT( stats.resident <= budget );
+    }
+    TEST_ASSERT( stats.misses == 6 && stats.hits == 0 && stats.evictions > 0 );
+
+    /* A pinned function is not evicted */
+    void *func = elfLoaderOverlayAcquire(ctx, "overlay_value");
+    TEST_ASSERT( func != NULL );
+    TEST_ASSERT( elfLoaderOverlayAcquire(ctx, "local_main") == NULL );
+    elfLoaderOverlayRelease(ctx, func);
+    TEST_ASSERT( elfLoaderOverlayAcquire(ctx, "local_main") != NULL );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("overlay benchmark", "[esp32-elfloader-overlay][benchmark]") {
+    const int loads = 100;
+    size_t execFree = heap_caps_get_free_size(MALLOC_CAP_EXEC);
+    ELFLoaderContext_t *ctx = loadOverlay(payload_build_test_printf_multiplefuncs_elf, 4096);
+    TEST_ASSERT( ctx != NULL );
+    size_t execUsed = 0;
+    int64_t missTime = 0, hitTime = 0;
+    for (int i = 0; i < loads; i++) {
+        int64_t start = esp_timer_get_time();
+        void *func = elfLoaderOverlayAcquire(ctx, "local_main");
+        missTime += esp_timer_get_time() - start;
+        TEST_ASSERT( func != NULL );
+        if (i == 0) {
+            execUsed = execFree - heap_caps_get_free_size(MALLOC_CAP_EXEC);
+        }
+        start = esp_timer_get_time();
+        elfLoaderOverlayRelease(ctx, func);
+        TEST_ASSERT( elfLoaderOverlayAcquire(ctx, "local_main") == func );
+        elfLoaderOverlayRelease(ctx, func);
+        hitTime += esp_timer_get_time() - start;
+        /* Evict it for the next miss */
+        elfLoaderFree(ctx);
+        ctx = loadOverlay(payload_build_test_printf_multiplefuncs_elf, 4096);
+        TEST_ASSERT( ctx != NULL );
+    }
+    elfLoaderFree(ctx);
+    printf("overlay: %i us/miss, %i us/hit, %u exec heap bytes\n", (int) (missTime / loads), (int) (hitTime / loads), (unsigned int) execUsed);
+}
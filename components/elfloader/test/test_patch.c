@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_return_if1_elf[];
+extern unsigned char payload_build_test_return_if2_elf[];
+extern unsigned char payload_build_test_return_rwdata_elf[];
+extern unsigned char payload_build_test_return_rwdata_volatile_elf[];
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+static const char *localMain[] = { "local_main" };
+
+
+TEST_CASE("hot patch", "[esp32-elfloader-patch]") {
+    ELFLoaderContext_t *ctx = elfLoaderInitLoadAndRelocate(payload_build_test_return_if1_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 2) == 0x12345678 );
+
+    TEST_ASSERT( elfLoaderPatch(ctx, elfLoaderInit(payload_build_test_return_if2_elf, &env), localMain, 1) == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 2) == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 1) == 0x12345678 );
+    TEST_ASSERT( *(uint32_t*) elfLoaderGetSymbol(ctx, "data") == 0x12345678 );
+    TEST_ASSERT( elfLoaderInstantiate(ctx) == NULL );
+
+    /* Back to the first version */
+    TEST_ASSERT( elfLoaderPatch(ctx, elfLoaderInit(payload_build_test_return_if1_elf, &env), localMain, 1) == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 2) == 0x12345678 );
+    const char *missing[] = { "missing" };
+    TEST_ASSERT( elfLoaderPatch(ctx, elfLoaderInit(payload_build_test_return_if2_elf, &env), missing, 1) == -1 );
+    TEST_ASSERT( elfLoaderRun(ctx, 2) == 0x12345678 );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("hot patch keeps data", "[esp32-elfloader-patch]") {
+    ELFLoaderContext_t *ctx = elfLoaderInitLoadAndRelocate(payload_build_test_return_rwdata_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    *(uint32_t*) elfLoaderGetSymbol(ctx, "data") = 0x11;
+    TEST_ASSERT( elfLoaderPatch(ctx, elfLoaderInit(payload_build_test_return_rwdata_volatile_elf, &env), localMain, 1) == 0 );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0x11 );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("hot patch benchmark", "[esp32-elfloader-patch][benchmark]") {
+    const int loads = 100;
+    int64_t patchTime = 0, reloadTime = 0;
+    for (int i = 0; i < loads; i++) {
+        ELFLoaderContext_t *ctx = elfLoaderInitLoadAndRelocate(payload_build_test_return_if1_elf, &env);
+        TEST_ASSERT( ctx != NULL );
+        int64_t start = esp_timer_get_time();
+        TEST_ASSERT( elfLoaderPatch(ctx, elfLoaderInit(payload_build_test_return_if2_elf, &env), localMain, 1) == 0 );
+        patchTime += esp_timer_get_time() - start;
+        elfLoaderFree(ctx);
+
+        start = esp_timer_get_time();
+        ctx = elfLoaderInitLoadAndRelocate(payload_build_test_return_if2_elf, &env);
+        reloadTime += esp_timer_get_time() - start;
+        TEST_ASSERT( ctx != NULL );
+        elfLoaderFree(ctx);
+    }
+    printf("patch: %i us, reload: %i us\n", (int) (patchTime / loads), (int) (reloadTime / loads));
+}
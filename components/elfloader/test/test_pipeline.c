@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "rom/ets_sys.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_printf_gdb_elf[];
+extern unsigned int payload_build_test_printf_gdb_elf_len;
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    int usPerKB;
+} slowSource_t;
+
+/* Reader throttled to a flash or network speed */
+static int slowRead(void *arg, off_t offset, void *buffer, size_t size) {
+    slowSource_t *src = arg;
+    if (offset + size > src->size) {
+        return -1;
+    }
+    memcpy(buffer, src->data + offset, size);
+    ets_delay_us(src->usPerKB * size / 1024);
+    return 0;
+}
+
+
+static ELFLoaderContext_t *load(const ELFLoaderReader_t *reader, int pipelined) {
+    ELFLoaderContext_t* ctx = elfLoaderInitReader(reader, &env);
+    elfLoaderSetPipelined(ctx, pipelined);
+    if (elfLoaderLoadAndRelocate(ctx) != 0) {
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+TEST_CASE("pipelined load", "[esp32-elfloader-pipeline]") {
+    slowSource_t src = { payload_build_test_printf_gdb_elf, payload_build_test_printf_gdb_elf_len, 0 };
+    ELFLoaderReader_t reader = { &src, slowRead };
+    ELFLoaderContext_t* ctx = load(&reader, 1);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    elfLoaderFree(ctx);
+
+    src.size /= 2;
+    TEST_ASSERT( load(&reader, 1) == NULL );
+}
+
+
+TEST_CASE("pipelined load benchmark", "[esp32-elfloader-pipeline][benchmark]") {
+    const int loops = 10;
+    slowSource_t src = { payload_build_test_printf_gdb_elf, payload_build_test_printf_gdb_elf_len, 0 };
+    ELFLoaderReader_t reader = { &src, slowRead };
+    for (src.usPerKB = 0; src.usPerKB <= 1000; src.usPerKB += 500) {
+        printf("%4i us/KB reader:", src.usPerKB);
+        for (int pipelined = 0; pipelined <= 1; pipelined++) {
+            int64_t start = esp_timer_get_time();
+            for (int i = 0; i < loops; i++) {
+                ELFLoaderContext_t* ctx = load(&reader, pipelined);
+                TEST_ASSERT( ctx != NULL );
+                elfLoaderFree(ctx);
+            }
+            printf(" %s %i us/load", pipelined ? "pipelined" : "serial", (int) ((esp_timer_get_time() - start) / loops));
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+extern unsigned char payload_build_test_return_rwdata_elf[];
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts },
+    { "printf", (void*) printf }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+/* Executable memory simulated by a first or best fit heap in an IRAM block, its block list kept apart */
+#define ARENA_SIZE 2048
+#define ARENA_BLOCKS 64
+
+typedef struct {
+    size_t offset;
+    size_t size;
+    int used;
+} Block_t;
+
+typedef struct {
+    uint8_t *data;
+    Block_t blocks[ARENA_BLOCKS];
+    unsigned int count;
+    int bestFit;
+} Arena_t;
+
+
+/* Bytes from the start of b to an address aligned to align */
+static size_t arenaPadding(Arena_t *arena, Block_t *b, size_t align) {
+    uintptr_t start = (uintptr_t) arena->data + b->offset;
+    return ((start + align - 1) & ~(uintptr_t) (align - 1)) - start;
+}
+
+
+/* Split b at size bytes, the second block free. 0 when the block list is full */
+static int arenaSplit(Arena_t *arena, Block_t *b, size_t size) {
+    if (arena->count == ARENA_BLOCKS) {
+        return 0;
+    }
+    memmove(b + 1, b, (arena->blocks + arena->count - b) * sizeof(Block_t));
+    arena->count++;
+    b[1].offset = b->offset + size;
+    b[1].size = b->size - size;
+    b[1].used = 0;
+    b->size = size;
+    return 1;
+}
+
+
+static void *arenaAlloc(void *arg, size_t size, size_t align, int exec) {
+    Arena_t *arena = arg;
+    if (!exec) {
+        return heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    size = (size + 3) & ~3;
+    align = align < 4 ? 4 : align;
+    Block_t *found = NULL;
+    for (unsigned int i = 0; i < arena->count; i++) {
+        Block_t *b = &arena->blocks[i];
+        if (b->used || b->size < arenaPadding(arena, b, align) + size || (found && b->size >= found->size)) {
+            continue;
+        }
+        found = b;
+        if (!arena->bestFit) {
+            break;
+        }
+    }
+    if (!found) {
+        return NULL;
+    }
+    size_t padding = arenaPadding(arena, found, align);
+    if (padding) {
+        if (!arenaSplit(arena, found, padding)) {
+            return NULL;
+        }
+        found++;
+    }
+    if (found->size > size && !arenaSplit(arena, found, size)) {
+        return NULL;
+    }
+    found->used = 1;
+    return arena->data + found->offset;
+}
+
+
+static void arenaFree(void *arg, void *ptr, int exec) {
+    Arena_t *arena = arg;
+    if (!exec) {
+        heap_caps_free(ptr);
+        return;
+    }
+    unsigned int i = 0;
+    while (arena->blocks[i].offset != (uint8_t*) ptr - arena->data) {
+        i++;
+    }
+    arena->blocks[i].used = 0;
+    if (i + 1 < arena->count && !arena->blocks[i + 1].used) {
+        arena->blocks[i].size += arena->blocks[i + 1].size;
+        memmove(&arena->blocks[i + 1], &arena->blocks[i + 2], (arena->count - i - 2) * sizeof(Block_t));
+        arena->count--;
+    }
+    if (i > 0 && !arena->blocks[i - 1].used) {
+        arena->blocks[i - 1].size += arena->blocks[i].size;
+        memmove(&arena->blocks[i], &arena->blocks[i + 1], (arena->count - i - 1) * sizeof(Block_t));
+        arena->count--;
+    }
+}
+
+
+static size_t arenaLargest(Arena_t *arena) {
+    size_t largest = 0;
+    for (unsigned int i = 0; i < arena->count; i++) {
+        if (!arena->blocks[i].used && arena->blocks[i].size > largest) {
+            largest = arena->blocks[i].size;
+        }
+    }
+    return largest;
+}
+
+
+static size_t arenaFreeSize(Arena_t *arena) {
+    size_t size = 0;
+    for (unsigned int i = 0; i < arena->count; i++) {
+        size += arena->blocks[i].used ? 0 : arena->blocks[i].size;
+    }
+    return size;
+}
+
+
+static ELFLoaderContext_t *loadRebasable(unsigned char *elf, const ELFLoaderAllocator_t *allocator) {
+    ELFLoaderContext_t *ctx = elfLoaderInit(elf, &env);
+    if ((allocator && elfLoaderSetAllocator(ctx, allocator) != 0) || elfLoaderSetRebasable(ctx, 1) != 0 || elfLoaderLoadAndRelocate(ctx) != 0) {
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+/* Fill the arena with modules, then unload every other one: returns the number of modules left */
+static unsigned int fragment(Arena_t *arena, const ELFLoaderAllocator_t *allocator, ELFLoaderContext_t **ctxs, unsigned int max) {
+    unsigned char *elfs[] = { payload_build_test_printf_multiplefuncs_elf, payload_build_test_return_rwdata_elf };
+    arena->count = 1;
+    arena->bestFit = 0;
+    arena->blocks[0].offset = 0;
+    arena->blocks[0].size = ARENA_SIZE;
+    arena->blocks[0].used = 0;
+    unsigned int count = 0;
+    while (count < max && (ctxs[count] = loadRebasable(elfs[count % 2], allocator)) != NULL) {
+        count++;
+    }
+    unsigned int left = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (i % 4 < 2) {
+            elfLoaderFree(ctxs[i]);
+        } else {
+            ctxs[left++] = ctxs[i];
+        }
+    }
+    return left;
+}
+
+
+TEST_CASE("rebase", "[esp32-elfloader-rebase]") {
+    ELFLoaderContext_t *ctx = loadRebasable(payload_build_test_printf_multiplefuncs_elf, NULL);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    TEST_ASSERT( elfLoaderRebase(ctx, 1) >= 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    TEST_ASSERT( elfLoaderInstantiate(ctx) == NULL );
+    elfLoaderFree(ctx);
+
+    /* Data is moved with its content */
+    ctx = loadRebasable(payload_build_test_return_rwdata_elf, NULL);
+    TEST_ASSERT( ctx != NULL );
+    *(uint32_t*) elfLoaderGetSymbol(ctx, "data") = 0x11;
+    TEST_ASSERT( elfLoaderRebase(ctx, 0) >= 0 );
+    TEST_ASSERT( elfLoaderRebase(ctx, 1) >= 0 );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0x11 );
+    elfLoaderFree(ctx);
+
+    ctx = elfLoaderInitLoadAndRelocate(payload_build_test_return_rwdata_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderRebase(ctx, 1) == -1 );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("rebase keeps literals below the code", "[esp32-elfloader-rebase]") {
+    Arena_t arena;
+    arena.data = heap_caps_malloc(ARENA_SIZE, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+    TEST_ASSERT( arena.data != NULL );
+    ELFLoaderAllocator_t allocator = { &arena, arenaAlloc, arenaFree };
+    arena.count = 1;
+    arena.bestFit = 0;
+    arena.blocks[0].offset = 0;
+    arena.blocks[0].size = ARENA_SIZE;
+    arena.blocks[0].used = 0;
+
+    /* The literals are allocated first, then the code */
+    ELFLoaderContext_t *ctx = loadRebasable(payload_build_test_printf_multiplefuncs_elf, &allocator);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( arena.count == 3 && arena.blocks[1].offset == (uint8_t*) elfLoaderGetTextAddr(ctx) - arena.data );
+    size_t literalSize = arena.blocks[0].size;
+    size_t textSize = arena.blocks[1].size;
+    elfLoaderFree(ctx);
+
+    /*
+     * A hole for the code at the bottom, and one for the literals above it,
+     * used while loading: best fit moves the literals to their hole, then
+     * the code to its own, below the literals out of reach of its L32R.
+     */
+    size_t sizes[] = { textSize, 4, literalSize, 4, ARENA_SIZE - textSize - literalSize - 8 };
+    arena.count = 0;
+    for (size_t offset = 0; arena.count < 5; offset += sizes[arena.count++]) {
+        arena.blocks[arena.count].offset = offset;
+        arena.blocks[arena.count].size = sizes[arena.count];
+        arena.blocks[arena.count].used = arena.count < 4;
+    }
+    ctx = loadRebasable(payload_build_test_printf_multiplefuncs_elf, &allocator);
+    TEST_ASSERT( ctx != NULL );
+    arena.blocks[0].used = 0;
+    arena.blocks[2].used = 0;
+    arena.bestFit = 1;
+    TEST_ASSERT( elfLoaderRebase(ctx, 1) > 0 );
+
+    /* The code moved back or not at all, the literals are below it */
+    size_t text = (uint8_t*) elfLoaderGetTextAddr(ctx) - arena.data;
+    for (unsigned int i = 0; i < arena.count; i++) {
+        Block_t *b = &arena.blocks[i];
+        if (b->used && b->offset != textSize && b->offset != textSize + 4 + literalSize) {
+            TEST_ASSERT( b->offset <= text );
+        }
+    }
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    elfLoaderFree(ctx);
+    heap_caps_free(arena.data);
+}
+
+
+TEST_CASE("compact fragmented memory", "[esp32-elfloader-rebase]") {
+    Arena_t arena;
+    arena.data = heap_caps_malloc(ARENA_SIZE, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+    TEST_ASSERT( arena.data != NULL );
+    ELFLoaderAllocator_t allocator = { &arena, arenaAlloc, arenaFree };
+    ELFLoaderContext_t *ctxs[32];
+    unsigned int count = fragment(&arena, &allocator, ctxs, 32);
+    TEST_ASSERT( count > 2 );
+    TEST_ASSERT( arenaLargest(&arena) < arenaFreeSize(&arena) );
+
+    TEST_ASSERT( elfLoaderCompact(ctxs, count, 1) > 0 );
+    TEST_ASSERT( arenaLargest(&arena) == arenaFreeSize(&arena) );
+    for (unsigned int i = 0; i < count; i++) {
+        TEST_ASSERT( elfLoaderSetFunc(ctxs[i], "local_main") == 0 );
+        TEST_ASSERT( elfLoaderRun(ctxs[i], 0) == (i % 2 ? 0x12345678 : 0) );
+        elfLoaderFree(ctxs[i]);
+    }
+    TEST_ASSERT( arenaFreeSize(&arena) == ARENA_SIZE );
+    heap_caps_free(arena.data);
+}
+
+
+TEST_CASE("compact benchmark", "[esp32-elfloader-rebase][benchmark]") {
+    const int runs = 10;
+    Arena_t arena;
+    arena.data = heap_caps_malloc(ARENA_SIZE, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+    TEST_ASSERT( arena.data != NULL );
+    ELFLoaderAllocator_t allocator = { &arena, arenaAlloc, arenaFree };
+    ELFLoaderContext_t *ctxs[32];
+    int64_t time = 0;
+    size_t before = 0, after = 0;
+    int moves = 0;
+    for (int r = 0; r < runs; r++) {
+        unsigned int count = fragment(&arena, &allocator, ctxs, 32);
+        before = arenaLargest(&arena);
+        int64_t start = esp_timer_get_time();
+        moves = elfLoaderCompact(ctxs, count, 1);
+        time += esp_timer_get_time() - start;
+        after = arenaLargest(&arena);
+        TEST_ASSERT( moves > 0 );
+        for (unsigned int i = 0; i < count; i++) {
+            elfLoaderFree(ctxs[i]);
+        }
+    }
+    printf("compact: %i us, %i moves, largest free block %u -> %u of %u bytes\n", (int) (time / runs), moves, (unsigned int) before, (unsigned int) after, ARENA_SIZE);
+    heap_caps_free(arena.data);
+}
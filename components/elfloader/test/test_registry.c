@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "registry.h"
+
+
+extern unsigned char payload_build_test_argvalue_elf[];
+extern unsigned char payload_build_test_return_value_elf[];
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+/* Built by the Makefile with the toolchain, the imports test is skipped without them */
+extern unsigned char payload_build_test_lib_elf[] __attribute__((weak));
+extern unsigned char payload_build_test_lib_user_elf[] __attribute__((weak));
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+static const ELFLoaderEnv_t emptyEnv = { NULL, 0 };
+
+
+static intptr_t registryRun(ELFLoaderRegistry_t *registry, const char *name, intptr_t arg) {
+    ELFLoaderContext_t *ctx = elfLoaderRegistryGet(registry, name);
+    if (ctx == NULL || elfLoaderSetFunc(ctx, "local_main") != 0) {
+        return -1;
+    }
+    return elfLoaderRun(ctx, arg);
+}
+
+
+TEST_CASE("module registry", "[esp32-elfloader-registry]") {
+    ELFLoaderRegistry_t *registry = elfLoaderRegistryCreate();
+
+    /* puts is neither in the env nor published by a module */
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "printf", elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &emptyEnv)) != 0 );
+    TEST_ASSERT( elfLoaderRegistryGet(registry, "printf") == NULL );
+
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "arg", elfLoaderInit(payload_build_test_argvalue_elf, &env)) == 0 );
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "value", elfLoaderInit(payload_build_test_return_value_elf, &env)) == 0 );
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "value", elfLoaderInit(payload_build_test_return_value_elf, &env)) != 0 );
+    TEST_ASSERT( registryRun(registry, "arg", 1) == 2 );
+    TEST_ASSERT( registryRun(registry, "value", 1) == 0x12345678 );
+
+    /* Symbols are looked up in load order */
+    TEST_ASSERT( elfLoaderRegistryGetSymbol(registry, "local_main") == elfLoaderGetSymbol(elfLoaderRegistryGet(registry, "arg"), "local_main") );
+    TEST_ASSERT( elfLoaderRegistryUnload(registry, "arg") == 0 );
+    TEST_ASSERT( elfLoaderRegistryUnload(registry, "arg") != 0 );
+    TEST_ASSERT( elfLoaderRegistryGetSymbol(registry, "local_main") == elfLoaderGetSymbol(elfLoaderRegistryGet(registry, "value"), "local_main") );
+    TEST_ASSERT( elfLoaderRegistryUnload(registry, "value") == 0 );
+    TEST_ASSERT( elfLoaderRegistryGetSymbol(registry, "local_main") == NULL );
+
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "arg", elfLoaderInit(payload_build_test_argvalue_elf, &env)) == 0 );
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "value", elfLoaderInit(payload_build_test_return_value_elf, &env)) == 0 );
+    elfLoaderRegistryDestroy(registry);
+}
+
+
+/* Records the module freeing its sections first, arg being its name */
+static const char *firstFreed;
+
+static void *orderAlloc(void *arg, size_t size, size_t align, int exec) {
+    if (!exec) {
+        return heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    return heap_caps_malloc((size + 3) & ~3, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+}
+
+static void orderFree(void *arg, void *ptr, int exec) {
+    if (!firstFreed) {
+        firstFreed = arg;
+    }
+    heap_caps_free(ptr);
+}
+
+static const ELFLoaderAllocator_t libAllocator = { "lib", orderAlloc, orderFree };
+static const ELFLoaderAllocator_t userAllocator = { "user", orderAlloc, orderFree };
+
+
+static ELFLoaderContext_t *initWith(unsigned char *elf, const ELFLoaderAllocator_t *allocator) {
+    ELFLoaderContext_t *ctx = elfLoaderInit(elf, &env);
+    elfLoaderSetAllocator(ctx, allocator);
+    return ctx;
+}
+
+
+TEST_CASE("module registry imports", "[esp32-elfloader-registry]") {
+    if (!payload_build_test_lib_elf || !payload_build_test_lib_user_elf) {
+        TEST_IGNORE_MESSAGE("test-lib payloads not built");
+    }
+    ELFLoaderRegistry_t *registry = elfLoaderRegistryCreate();
+
+    /* lib_add is neither in the env nor published by a module */
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "user", elfLoaderInit(payload_build_test_lib_user_elf, &env)) != 0 );
+
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "lib", initWith(payload_build_test_lib_elf, &libAllocator)) == 0 );
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "user", initWith(payload_build_test_lib_user_elf, &userAllocator)) == 0 );
+    /* (1 + 0x10) doubled by the callback of lib_apply, plus one, plus the calls count */
+    TEST_ASSERT( registryRun(registry, "user", 1) == 0x25 );
+    TEST_ASSERT( registryRun(registry, "user", 1) == 0x27 );
+    TEST_ASSERT( elfLoaderRegistryGetSymbol(registry, "lib_add") == elfLoaderGetSymbol(elfLoaderRegistryGet(registry, "lib"), "lib_add") );
+
+    /* The library is in use until its client is unloaded */
+    TEST_ASSERT( elfLoaderRegistryUnload(registry, "lib") == -1 );
+    TEST_ASSERT( registryRun(registry, "user", 1) == 0x29 );
+    TEST_ASSERT( elfLoaderRegistryUnload(registry, "user") == 0 );
+    TEST_ASSERT( elfLoaderRegistryUnload(registry, "lib") == 0 );
+
+    /* Clients are destroyed before the library loaded first */
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "lib", initWith(payload_build_test_lib_elf, &libAllocator)) == 0 );
+    TEST_ASSERT( elfLoaderRegistryLoad(registry, "user", initWith(payload_build_test_lib_user_elf, &userAllocator)) == 0 );
+    firstFreed = NULL;
+    elfLoaderRegistryDestroy(registry);
+    TEST_ASSERT( firstFreed != NULL && strcmp(firstFreed, "user") == 0 );
+}
+
+
+static ELFLoaderRegistry_t *churnRegistry;
+static volatile int churnStop;
+
+
+/* Look up local_main and call it while its module is loaded and unloaded */
+static void *lookupThread(void *arg) {
+    int *lookups = arg;
+    while (!churnStop) {
+        int token = elfLoaderRegistryEnter(churnRegistry);
+        intptr_t (*local_main)(intptr_t) = elfLoaderRegistryGetSymbol(churnRegistry, "local_main");
+        if (local_main && local_main(1) != 2) {
+            *lookups = -1;
+            churnStop = 1;
+        }
+        elfLoaderRegistryLeave(churnRegistry, token);
+        if (*lookups >= 0) {
+            (*lookups)++;
+        }
+    }
+    return NULL;
+}
+
+
+/* The second module, also publishing local_main, is only loaded after the first one */
+static void *churnThread(void *arg) {
+    int *cycles = arg;
+    while (!churnStop) {
+        if (elfLoaderRegistryLoad(churnRegistry, "arg", elfLoaderInit(payload_build_test_argvalue_elf, &env)) != 0
+                || elfLoaderRegistryLoad(churnRegistry, "value", elfLoaderInit(payload_build_test_return_value_elf, &env)) != 0
+                || elfLoaderRegistryUnload(churnRegistry, "value") != 0
+                || elfLoaderRegistryUnload(churnRegistry, "arg") != 0) {
+            *cycles = -1;
+            churnStop = 1;
+        } else {
+            (*cycles)++;
+        }
+    }
+    return NULL;
+}
+
+
+TEST_CASE("module registry concurrent lookups", "[esp32-elfloader-registry][benchmark]") {
+    for (int threads = 1; threads <= 4; threads *= 2) {
+        pthread_t thread[5];
+        int counts[5] = { 0 };
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, 8192);
+        churnRegistry = elfLoaderRegistryCreate();
+        churnStop = 0;
+        int64_t start = esp_timer_get_time();
+        TEST_ASSERT( pthread_create(&thread[0], &attr, churnThread, &counts[0]) == 0 );
+        for (int i = 1; i <= threads; i++) {
+            TEST_ASSERT( pthread_create(&thread[i], &attr, lookupThread, &counts[i]) == 0 );
+        }
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        churnStop = 1;
+        int lookups = 0;
+        for (int i = 0; i <= threads; i++) {
+            TEST_ASSERT( pthread_join(thread[i], NULL) == 0 );
+            TEST_ASSERT( counts[i] >= 0 );
+            lookups += i ? counts[i] : 0;
+        }
+        int64_t elapsed = esp_timer_get_time() - start;
+        pthread_attr_destroy(&attr);
+        elfLoaderRegistryDestroy(churnRegistry);
+        printf("%i threads: %i lookups/s, %i load/unload cycles/s\n", threads, (int) ((int64_t) lookups * 1000000 / elapsed), (int) ((int64_t) counts[0] * 1000000 / elapsed));
+    }
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_return_if1_elf[];
+extern unsigned char payload_build_test_return_if2_elf[];
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+extern unsigned int payload_build_test_printf_multiplefuncs_elf_len;
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+/* puts at another address, for the kept sections to be fixed up */
+static int movedPuts(const char *s) {
+    return puts(s);
+}
+
+static const ELFLoaderSymbol_t movedExports[] = {
+    { "puts", (void*) movedPuts }
+};
+static const ELFLoaderEnv_t movedEnv = { movedExports, sizeof(movedExports) / sizeof(*movedExports) };
+
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    int reads;
+} FailingSource_t;
+
+/* Reader failing once src->reads reads are done, never when negative */
+static int failingRead(void *arg, off_t offset, void *buffer, size_t size) {
+    FailingSource_t *src = arg;
+    if (src->reads == 0 || offset + size > src->size) {
+        return -1;
+    }
+    if (src->reads > 0) {
+        src->reads--;
+    }
+    memcpy(buffer, src->data + offset, size);
+    return 0;
+}
+
+
+/* Code sections of the module, word sized to be read from IRAM */
+#define SECTIONS_MAX 8
+#define SAVED_WORDS 256
+
+static struct {
+    uint32_t *exec[SECTIONS_MAX];
+    size_t execWords[SECTIONS_MAX];
+    unsigned int execCount;
+} allocated;
+
+static void *trackAlloc(void *arg, size_t size, size_t align, int exec) {
+    if (!exec) {
+        return heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    size = (size + 3) & ~3;
+    void *ptr = heap_caps_malloc(size, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+    if (ptr && allocated.execCount < SECTIONS_MAX) {
+        allocated.exec[allocated.execCount] = ptr;
+        allocated.execWords[allocated.execCount++] = size / 4;
+    }
+    return ptr;
+}
+
+static void trackFree(void *arg, void *ptr, int exec) {
+    heap_caps_free(ptr);
+}
+
+static const ELFLoaderAllocator_t tracker = { NULL, trackAlloc, trackFree };
+
+
+/* Compare the first count code sections to saved, or save them when save is set. Returns 1 when equal */
+static int execSnapshot(unsigned int count, uint32_t *saved, int save) {
+    int equal = 1;
+    size_t n = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        for (size_t j = 0; j < allocated.execWords[i]; j++, n++) {
+            TEST_ASSERT( n < SAVED_WORDS );
+            if (save) {
+                saved[n] = allocated.exec[i][j];
+            } else if (saved[n] != allocated.exec[i][j]) {
+                equal = 0;
+            }
+        }
+    }
+    return equal;
+}
+
+
+TEST_CASE("reload", "[esp32-elfloader-reload]") {
+    ELFLoaderContext_t *ctx = elfLoaderInitLoadAndRelocate(payload_build_test_return_if1_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 2) == 0x12345678 );
+    uint32_t *data = elfLoaderGetSymbol(ctx, "data");
+
+    /* Same version: nothing to copy */
+    TEST_ASSERT( elfLoaderReload(ctx, elfLoaderInit(payload_build_test_return_if1_elf, &env)) == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 2) == 0x12345678 );
+
+    /* The code changed, the data did not and keeps its value */
+    *data = 0x11;
+    int copied = elfLoaderReload(ctx, elfLoaderInit(payload_build_test_return_if2_elf, &env));
+    TEST_ASSERT( copied > 0 );
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "data") == data );
+    TEST_ASSERT( *data == 0x11 );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 2) == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 1) == 0x12345678 );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("reload failure", "[esp32-elfloader-reload]") {
+    static uint32_t saved[SAVED_WORDS];
+    allocated.execCount = 0;
+    ELFLoaderContext_t *ctx = elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &env);
+    TEST_ASSERT( elfLoaderSetAllocator(ctx, &tracker) == 0 );
+    TEST_ASSERT( elfLoaderLoadAndRelocate(ctx) == 0 );
+    unsigned int execCount = allocated.execCount;
+    TEST_ASSERT( execCount > 0 );
+    execSnapshot(execCount, saved, 1);
+    void *func = elfLoaderGetSymbol(ctx, "local_main");
+
+    /* Reads failing in turn later, some of the reloads failing within the fixups of puts */
+    FailingSource_t src = { payload_build_test_printf_multiplefuncs_elf, payload_build_test_printf_multiplefuncs_elf_len, 0 };
+    ELFLoaderReader_t reader = { &src, failingRead };
+    int r = -1;
+    for (int reads = 0; r < 0; reads++) {
+        src.reads = reads;
+        r = elfLoaderReload(ctx, elfLoaderInitReader(&reader, &movedEnv));
+        if (r < 0) {
+            TEST_ASSERT( execSnapshot(execCount, saved, 0) );
+            TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") == func );
+        }
+    }
+    /* The same version, fixed up in place, its source read from then on */
+    src.reads = -1;
+    TEST_ASSERT( r == 0 );
+    TEST_ASSERT( !execSnapshot(execCount, saved, 0) );
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") == func );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("reload benchmark", "[esp32-elfloader-reload][benchmark]") {
+    unsigned char *elfs[] = { payload_build_test_printf_multiplefuncs_elf, payload_build_test_return_if2_elf };
+    const char *names[] = { "unchanged", "changed" };
+    const int loads = 100;
+    for (int e = 0; e < 2; e++) {
+        int64_t reloadTime = 0, loadTime = 0;
+        for (int i = 0; i < loads; i++) {
+            unsigned char *old = e ? payload_build_test_return_if1_elf : elfs[e];
+            ELFLoaderContext_t *ctx = elfLoaderInitLoadAndRelocate(old, &env);
+            TEST_ASSERT( ctx != NULL );
+            int64_t start = esp_timer_get_time();
+            TEST_ASSERT( elfLoaderReload(ctx, elfLoaderInit(elfs[e], &env)) >= 0 );
+            reloadTime += esp_timer_get_time() - start;
+            elfLoaderFree(ctx);
+
+            start = esp_timer_get_time();
+            ctx = elfLoaderInitLoadAndRelocate(elfs[e], &env);
+            loadTime += esp_timer_get_time() - start;
+            TEST_ASSERT( ctx != NULL );
+            elfLoaderFree(ctx);
+        }
+        printf("%s: reload %i us, load %i us\n", names[e], (int) (reloadTime / loads), (int) (loadTime / loads));
+    }
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_argvalue_elf[];
+extern unsigned int payload_build_test_argvalue_elf_len;
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+extern unsigned int payload_build_test_printf_multiplefuncs_elf_len;
+extern unsigned char payload_build_test_printf_gdb_elf[];
+extern unsigned int payload_build_test_printf_gdb_elf_len;
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+static ELFLoaderContext_t *load(void *elf, unsigned int threads) {
+    ELFLoaderContext_t* ctx = elfLoaderInit(elf, &env);
+    if (elfLoaderSetRelocationThreads(ctx, threads) != 0 || elfLoaderLoadAndRelocate(ctx) != 0) {
+        elfLoaderFree(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+/* Sections placed one after the other in fixed buffers: two loads get the same addresses */
+#define ARENA_WORDS 256
+
+typedef struct {
+    uint32_t *exec;
+    uint32_t *data;
+    size_t execUsed;
+    size_t dataUsed;
+} Arena_t;
+
+
+static void *arenaAlloc(void *arg, size_t size, size_t align, int exec) {
+    Arena_t *arena = arg;
+    uint8_t *base = (uint8_t*) (exec ? arena->exec : arena->data);
+    size_t *used = exec ? &arena->execUsed : &arena->dataUsed;
+    size_t offset = (((uintptr_t) base + *used + align - 1) & ~(uintptr_t) (align - 1)) - (uintptr_t) base;
+    if (offset + size > ARENA_WORDS * 4) {
+        return NULL;
+    }
+    *used = offset + size;
+    return base + offset;
+}
+
+
+/* Load ctx in the emptied arena, then copy the arena: IRAM is only read and written by words */
+static int arenaLoad(Arena_t *arena, ELFLoaderContext_t *ctx, unsigned int threads, uint32_t *copy) {
+    for (int i = 0; i < ARENA_WORDS; i++) {
+        arena->exec[i] = 0;
+        arena->data[i] = 0;
+    }
+    arena->execUsed = 0;
+    arena->dataUsed = 0;
+    ELFLoaderAllocator_t allocator = { arena, arenaAlloc, NULL };
+    int r = -1;
+    if (elfLoaderSetAllocator(ctx, &allocator) == 0 && elfLoaderSetRelocationThreads(ctx, threads) == 0 && elfLoaderLoadAndRelocate(ctx) == 0) {
+        for (int i = 0; i < ARENA_WORDS; i++) {
+            copy[i] = arena->exec[i];
+            copy[ARENA_WORDS + i] = arena->data[i];
+        }
+        r = 0;
+    }
+    elfLoaderFree(ctx);
+    return r;
+}
+
+
+#define FRAGMENTS 5
+
+typedef struct {
+    const unsigned char *data;
+    pthread_t thread;
+    int foreign;
+} ownerSource_t;
+
+/* Reader recording calls from another thread than the loading one */
+static int ownerRead(void *arg, off_t offset, void *buffer, size_t size) {
+    ownerSource_t *src = arg;
+    if (!pthread_equal(pthread_self(), src->thread)) {
+        src->foreign = 1;
+    }
+    memcpy(buffer, src->data + offset, size);
+    return 0;
+}
+
+
+TEST_CASE("parallel relocation", "[esp32-elfloader-relocate]") {
+    /* Relocated by the workers with the threshold lowered by the test build */
+    TEST_ASSERT( ELFLOADER_RELOC_PARALLEL_MIN <= 8 );
+    Arena_t arena = { heap_caps_malloc(ARENA_WORDS * 4, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT), heap_caps_malloc(ARENA_WORDS * 4, MALLOC_CAP_8BIT), 0, 0 };
+    TEST_ASSERT( arena.exec != NULL && arena.data != NULL );
+    static uint32_t serial[2 * ARENA_WORDS], parallel[2 * ARENA_WORDS];
+    TEST_ASSERT( arenaLoad(&arena, elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &env), 1, serial) == 0 );
+    for (unsigned int threads = 2; threads <= ELFLOADER_RELOC_THREADS_MAX; threads++) {
+        TEST_ASSERT( arenaLoad(&arena, elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &env), threads, parallel) == 0 );
+        TEST_ASSERT( memcmp(serial, parallel, sizeof(serial)) == 0 );
+    }
+
+    /* Each worker reads the fragments with its own cursor */
+    ELFLoaderFragment_t fragments[FRAGMENTS];
+    size_t fragSize = (payload_build_test_printf_multiplefuncs_elf_len + FRAGMENTS - 1) / FRAGMENTS;
+    for (int i = 0; i < FRAGMENTS; i++) {
+        size_t off = i * fragSize;
+        fragments[i].data = payload_build_test_printf_multiplefuncs_elf + off;
+        fragments[i].size = payload_build_test_printf_multiplefuncs_elf_len - off < fragSize ? payload_build_test_printf_multiplefuncs_elf_len - off : fragSize;
+    }
+    ELFLoaderFragments_t list = { fragments, FRAGMENTS };
+    TEST_ASSERT( arenaLoad(&arena, elfLoaderInitFragments(&list, &env), ELFLOADER_RELOC_THREADS_MAX, parallel) == 0 );
+    TEST_ASSERT( memcmp(serial, parallel, sizeof(serial)) == 0 );
+
+    /* A reader is only called by the loading thread */
+    ownerSource_t src = { payload_build_test_printf_multiplefuncs_elf, pthread_self(), 0 };
+    ELFLoaderReader_t reader = { &src, ownerRead };
+    TEST_ASSERT( arenaLoad(&arena, elfLoaderInitReader(&reader, &env), ELFLOADER_RELOC_THREADS_MAX, parallel) == 0 );
+    TEST_ASSERT( memcmp(serial, parallel, sizeof(serial)) == 0 );
+    TEST_ASSERT( !src.foreign );
+    heap_caps_free(arena.exec);
+    heap_caps_free(arena.data);
+
+    ELFLoaderContext_t* ctx = load(payload_build_test_printf_multiplefuncs_elf, 2);
+    TEST_ASSERT( ctx != NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main3") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    elfLoaderFree(ctx);
+
+    ctx = elfLoaderInit(payload_build_test_argvalue_elf, &env);
+    TEST_ASSERT( elfLoaderSetRelocationThreads(ctx, ELFLOADER_RELOC_THREADS_MAX + 1) != 0 );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("parallel relocation benchmark", "[esp32-elfloader-relocate][benchmark]") {
+    const int loops = 20;
+    struct {
+        unsigned char *elf;
+        unsigned int *len;
+    } modules[] = {
+        { payload_build_test_argvalue_elf, &payload_build_test_argvalue_elf_len },
+        { payload_build_test_printf_multiplefuncs_elf, &payload_build_test_printf_multiplefuncs_elf_len },
+        { payload_build_test_printf_gdb_elf, &payload_build_test_printf_gdb_elf_len },
+    };
+    for (int m = 0; m < sizeof(modules) / sizeof(*modules); m++) {
+        printf("%6i bytes:", *modules[m].len);
+        for (unsigned int threads = 1; threads <= 2; threads++) {
+            int64_t start = esp_timer_get_time();
+            for (int i = 0; i < loops; i++) {
+                ELFLoaderContext_t* ctx = load(modules[m].elf, threads);
+                TEST_ASSERT( ctx != NULL );
+                elfLoaderFree(ctx);
+            }
+            printf(" %i threads %i us/load", threads, (int) ((esp_timer_get_time() - start) / loops));
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "slots.h"
+
+
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+extern unsigned int payload_build_test_printf_multiplefuncs_elf_len;
+extern unsigned char payload_build_test_return_rwdata_elf[];
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts },
+    { "printf", (void*) printf }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+/* Reader checking that the slot being loaded is not given out before the end of the load */
+static ELFLoaderSlots_t *loading;
+static int loadingSeen;
+
+static int slotCheckingRead(void *arg, off_t offset, void *buffer, size_t size) {
+    if (offset + size > payload_build_test_printf_multiplefuncs_elf_len) {
+        return -1;
+    }
+    loadingSeen |= elfLoaderSlotsGet(loading, 0) != NULL;
+    memcpy(buffer, payload_build_test_printf_multiplefuncs_elf + offset, size);
+    return 0;
+}
+
+
+TEST_CASE("slots", "[esp32-elfloader-slots]") {
+    ELFLoaderSlots_t *slots = elfLoaderSlotsCreate(2, 1024, 256);
+    TEST_ASSERT( slots != NULL );
+    TEST_ASSERT( elfLoaderSlotsLoad(slots, NULL) == -1 );
+    ELFLoaderReader_t reader = { NULL, slotCheckingRead };
+    loading = slots;
+    loadingSeen = 0;
+    TEST_ASSERT( elfLoaderSlotsLoad(slots, elfLoaderInitReader(&reader, &env)) == 0 );
+    TEST_ASSERT( !loadingSeen );
+    TEST_ASSERT( elfLoaderSlotsGet(slots, 0) != NULL );
+    TEST_ASSERT( elfLoaderSlotsLoad(slots, elfLoaderInit(payload_build_test_return_rwdata_elf, &env)) == 1 );
+    TEST_ASSERT( elfLoaderSlotsLoad(slots, elfLoaderInit(payload_build_test_return_rwdata_elf, &env)) == -1 );
+
+    ELFLoaderContext_t *ctx = elfLoaderSlotsGet(slots, 1);
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0x12345678 );
+
+    /* The slot is reused as it was */
+    ctx = elfLoaderSlotsGet(slots, 0);
+    void *func = elfLoaderGetSymbol(ctx, "local_main");
+    size_t execFree = heap_caps_get_free_size(MALLOC_CAP_EXEC);
+    TEST_ASSERT( elfLoaderSlotsUnload(slots, ctx) == 0 );
+    TEST_ASSERT( elfLoaderSlotsGet(slots, 0) == NULL );
+    TEST_ASSERT( elfLoaderSlotsLoad(slots, elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &env)) == 0 );
+    ctx = elfLoaderSlotsGet(slots, 0);
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") == func );
+    TEST_ASSERT( heap_caps_get_free_size(MALLOC_CAP_EXEC) == execFree );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    elfLoaderSlotsDestroy(slots);
+
+    /* Sections larger than a slot */
+    slots = elfLoaderSlotsCreate(1, 16, 16);
+    TEST_ASSERT( slots != NULL );
+    TEST_ASSERT( elfLoaderSlotsLoad(slots, elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &env)) == -1 );
+    TEST_ASSERT( elfLoaderSlotsGet(slots, 0) == NULL );
+    elfLoaderSlotsDestroy(slots);
+}
+
+
+TEST_CASE("slots benchmark", "[esp32-elfloader-slots][benchmark]") {
+    unsigned char *elfs[] = { payload_build_test_printf_multiplefuncs_elf, payload_build_test_return_rwdata_elf };
+    const int loads = 100;
+    ELFLoaderSlots_t *slots = elfLoaderSlotsCreate(2, 1024, 256);
+    TEST_ASSERT( slots != NULL );
+    for (int slot = 0; slot <= 1; slot++) {
+        size_t execLargest = heap_caps_get_largest_free_block(MALLOC_CAP_EXEC);
+        size_t dataLargest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+        int64_t loadTime = 0, freeTime = 0;
+        ELFLoaderContext_t *ctxs[2] = { NULL, NULL };
+        /* Loads and unloads interleaved, one module staying loaded each time */
+        for (int i = 0; i < loads; i++) {
+            int64_t start = esp_timer_get_time();
+            if (slot) {
+                TEST_ASSERT( elfLoaderSlotsLoad(slots, elfLoaderInit(elfs[i % 2], &env)) >= 0 );
+            } else {
+                ctxs[i % 2] = elfLoaderInitLoadAndRelocate(elfs[i % 2], &env);
+                TEST_ASSERT( ctxs[i % 2] != NULL );
+            }
+            loadTime += esp_timer_get_time() - start;
+            start = esp_timer_get_time();
+            if (slot) {
+                ELFLoaderContext_t *ctx = elfLoaderSlotsGet(slots, (i + 1) % 2);
+                if (ctx) {
+                    elfLoaderSlotsUnload(slots, ctx);
+                }
+            } else {
+                elfLoaderFree(ctxs[(i + 1) % 2]);
+                ctxs[(i + 1) % 2] = NULL;
+            }
+            freeTime += esp_timer_get_time() - start;
+        }
+        for (int i = 0; i < 2; i++) {
+            elfLoaderFree(ctxs[i]);
+            if (elfLoaderSlotsGet(slots, i)) {
+                elfLoaderSlotsUnload(slots, elfLoaderSlotsGet(slots, i));
+            }
+        }
+        printf("%s: %i us/load, %i us/unload, largest free block %i exec and %i data bytes\n", slot ? "slots" : "heap", (int) (loadTime / loads), (int) (freeTime / loads),
+               (int) (heap_caps_get_largest_free_block(MALLOC_CAP_EXEC) - execLargest), (int) (heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) - dataLargest));
+    }
+    elfLoaderSlotsDestroy(slots);
+}
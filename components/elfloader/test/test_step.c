@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+extern unsigned int payload_build_test_printf_multiplefuncs_elf_len;
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+static size_t bytesRead;
+
+static int countingRead(void *arg, off_t offset, void *buffer, size_t size) {
+    if (offset + size > payload_build_test_printf_multiplefuncs_elf_len) {
+        return -1;
+    }
+    memcpy(buffer, payload_build_test_printf_multiplefuncs_elf + offset, size);
+    bytesRead += size;
+    return 0;
+}
+
+
+TEST_CASE("incremental load", "[esp32-elfloader-step]") {
+    ELFLoaderContext_t* ref = elfLoaderInitLoadAndRelocate(payload_build_test_printf_multiplefuncs_elf, &env);
+    TEST_ASSERT( ref != NULL );
+
+    ELFLoaderContext_t* ctx = elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &env);
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") == NULL );
+    int r, steps = 0;
+    while ((r = elfLoaderStep(ctx, 1)) > 0) {
+        steps++;
+    }
+    TEST_ASSERT( r == ELFLOADER_STEP_DONE );
+    TEST_ASSERT( steps > 10 );
+    TEST_ASSERT( elfLoaderStep(ctx, 1) == ELFLOADER_STEP_DONE );
+    TEST_ASSERT( (char*) elfLoaderGetSymbol(ctx, "local_main3") - (char*) elfLoaderGetTextAddr(ctx) == (char*) elfLoaderGetSymbol(ref, "local_main3") - (char*) elfLoaderGetTextAddr(ref) );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main3") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    elfLoaderFree(ctx);
+    elfLoaderFree(ref);
+
+    ctx = elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &env);
+    TEST_ASSERT( elfLoaderStep(ctx, 4) > 0 );
+    elfLoaderCancel(ctx);
+    TEST_ASSERT( elfLoaderStep(ctx, 4) == -1 );
+    TEST_ASSERT( elfLoaderStep(ctx, 4) == -1 );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("incremental load step bound", "[esp32-elfloader-step]") {
+    ELFLoaderReader_t reader = { NULL, countingRead };
+    ELFLoaderContext_t* ctx = elfLoaderInitReader(&reader, &env);
+    size_t maxRead = 0;
+    int r;
+    do {
+        bytesRead = 0;
+        r = elfLoaderStep(ctx, 1);
+        if (bytesRead > maxRead) {
+            maxRead = bytesRead;
+        }
+    } while (r > 0);
+    TEST_ASSERT( r == ELFLOADER_STEP_DONE );
+    TEST_ASSERT( maxRead <= ELFLOADER_STEP_CHUNK );
+    elfLoaderFree(ctx);
+
+    ctx = elfLoaderInitReader(&reader, &env);
+    bytesRead = 0;
+    TEST_ASSERT( elfLoaderStep(ctx, 1000000) == ELFLOADER_STEP_DONE );
+    TEST_ASSERT( bytesRead > ELFLOADER_STEP_CHUNK );
+    elfLoaderFree(ctx);
+}
+
+
+TEST_CASE("incremental load benchmark", "[esp32-elfloader-step][benchmark]") {
+    int64_t start = esp_timer_get_time();
+    ELFLoaderContext_t* ctx = elfLoaderInitLoadAndRelocate(payload_build_test_printf_multiplefuncs_elf, &env);
+    TEST_ASSERT( ctx != NULL );
+    printf("one shot: %i us\n", (int) (esp_timer_get_time() - start));
+    elfLoaderFree(ctx);
+    for (unsigned int budget = 1; budget <= 64; budget *= 4) {
+        ctx = elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &env);
+        int64_t total = 0, worst = 0;
+        int r, calls = 0;
+        do {
+            int64_t t = esp_timer_get_time();
+            r = elfLoaderStep(ctx, budget);
+            t = esp_timer_get_time() - t;
+            total += t;
+            worst = t > worst ? t : worst;
+            calls++;
+        } while (r > 0);
+        TEST_ASSERT( r == ELFLOADER_STEP_DONE );
+        printf("budget %2i: %3i calls, %i us total, %i us worst call\n", budget, calls, (int) total, (int) worst);
+        elfLoaderFree(ctx);
+    }
+}
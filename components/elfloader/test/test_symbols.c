@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+typedef struct {
+    int (*main)(int);
+    int (*main1)(int);
+    int (*main2)(int);
+    int (*main3)(int);
+} plugin_t;
+
+static const char *const pluginNames[] = { "local_main", "local_main1", "local_main2", "local_main3" };
+
+
+TEST_CASE("symbols", "[esp32-elfloader-symbols]") {
+    ELFLoaderContext_t* ctx = elfLoaderInit(payload_build_test_printf_multiplefuncs_elf, &env);
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") == NULL );
+    TEST_ASSERT( elfLoaderLoadAndRelocate(ctx) == 0 );
+
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") != NULL );
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main") != elfLoaderGetSymbol(ctx, "local_main1") );
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "local_main4") == NULL );
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "puts") == NULL );
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, "") == NULL );
+
+    plugin_t plugin;
+    TEST_ASSERT( elfLoaderGetSymbols(ctx, pluginNames, (void**) &plugin, sizeof(pluginNames) / sizeof(*pluginNames)) == 0 );
+    TEST_ASSERT( plugin.main == elfLoaderGetSymbol(ctx, "local_main") );
+    TEST_ASSERT( plugin.main(0) == 0 );
+    TEST_ASSERT( plugin.main1(0) == 0 );
+    TEST_ASSERT( plugin.main2(0) == 0 );
+    TEST_ASSERT( plugin.main3(0) == 0 );
+
+    /* A local symbol is not indexed, here the one of .text starting with local_main1 */
+    TEST_ASSERT( elfLoaderGetSymbol(ctx, ".text") == NULL );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, ".text") == 0 );
+    TEST_ASSERT( elfLoaderRun(ctx, 0) == 0 );
+    TEST_ASSERT( elfLoaderSetFunc(ctx, "local_main4") == -1 );
+
+    const char *const missing[] = { "local_main", "local_main4" };
+    void *symbols[2];
+    TEST_ASSERT( elfLoaderGetSymbols(ctx, missing, symbols, 2) != 0 );
+    TEST_ASSERT( symbols[0] != NULL );
+    TEST_ASSERT( symbols[1] == NULL );
+
+    elfLoaderFree(ctx);
+}
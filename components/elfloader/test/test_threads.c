@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <pthread.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "loader.h"
+
+
+extern unsigned char payload_build_test_printf_multiplefuncs_elf[];
+
+
+static const ELFLoaderSymbol_t exports[] = {
+    { "puts", (void*) puts }
+};
+static const ELFLoaderEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
+
+
+#define LOADS 20
+
+static void *loadThread(void *arg) {
+    int *failed = arg;
+    for (int i = 0; i < LOADS; i++) {
+        ELFLoaderContext_t* ctx = elfLoaderInitLoadAndRelocate(payload_build_test_printf_multiplefuncs_elf, &env);
+        int (*local_main)(int) = ctx ? ELFLOADER_GET_FUNC(ctx, int (*)(int), "local_main") : NULL;
+        if (!local_main || local_main(0) != 0) {
+            (*failed)++;
+        }
+        elfLoaderFree(ctx);
+    }
+    return NULL;
+}
+
+
+TEST_CASE("concurrent loads", "[esp32-elfloader-threads]") {
+    for (int threads = 1; threads <= 4; threads *= 2) {
+        pthread_t thread[4];
+        int failed[4] = { 0 };
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, 8192);
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < threads; i++) {
+            TEST_ASSERT( pthread_create(&thread[i], &attr, loadThread, &failed[i]) == 0 );
+        }
+        for (int i = 0; i < threads; i++) {
+            TEST_ASSERT( pthread_join(thread[i], NULL) == 0 );
+            TEST_ASSERT( failed[i] == 0 );
+        }
+        int64_t elapsed = esp_timer_get_time() - start;
+        pthread_attr_destroy(&attr);
+        printf("%i threads: %i loads/s\n", threads, (int) ((int64_t) threads * LOADS * 1000000 / elapsed));
+    }
+}
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+#
+# Pack elf modules into a bundle readable by bundle.c
+#
+# Usage: elfbundle.py -o bundle.bin [name=]module.elf ...
+#
+# The module name defaults to the file name without extension.
+#
+
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = 0x42464c45
+VERSION = 1
+HEADER = struct.Struct('<6I')
+ENTRY = struct.Struct('<5I')
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+
+def align(n, a=4):
+    return (n + a - 1) & ~(a - 1)
+
+
+def pack(modules):
+    names = [name for name, _ in modules]
+    if len(set(names)) != len(names):
+        raise ValueError('duplicate module names')
+    for name in names:
+        if len(name.encode()) > 32:
+            raise ValueError('module name too long: %s' % name)
+
+    pool = b''
+    poolOffsets = {}
+    for name in names:
+        poolOffsets[name] = len(pool)
+        pool += name.encode() + b'\0'
+
+    dirOffset = HEADER.size
+    poolOffset = dirOffset + ENTRY.size * len(modules)
+    offset = align(poolOffset + len(pool))
+
+    entries = []
+    body = b''
+    for name, data in modules:
+        pad = align(offset + len(body)) - (offset + len(body))
+        body += b'\0' * pad
+        entries.append((fnv1a(name.encode()), poolOffsets[name], offset + len(body), len(data), fnv1a(data), name))
+        body += data
+    entries.sort(key=lambda e: (e[0], e[5]))
+
+    out = HEADER.pack(MAGIC, VERSION, len(entries), dirOffset, poolOffset, len(pool))
+    for e in entries:
+        out += ENTRY.pack(*e[:5])
+    out += pool
+    out += b'\0' * (align(len(out)) - len(out))
+    return out + body
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Pack elf modules into a bundle')
+    parser.add_argument('-o', '--output', required=True, help='output bundle file')
+    parser.add_argument('modules', nargs='+', help='[name=]module.elf')
+    args = parser.parse_args()
+
+    modules = []
+    for arg in args.modules:
+        if '=' in arg:
+            name, path = arg.split('=', 1)
+        else:
+            path = arg
+            name = os.path.splitext(os.path.basename(path))[0]
+        with open(path, 'rb') as f:
+            modules.append((name, f.read()))
+
+    with open(args.output, 'wb') as f:
+        f.write(pack(modules))
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+#
+# Build a delta rebuilding new.elf from old.elf, applied on the device by delta.c
+#
+# Usage: elfdelta.py old.elf new.elf -o module.delta
+#
+# Delta layout, little endian:
+#
+#   header   uint32_t magic "ELFD", version, oldSize, oldHash, newSize, newHash
+#   ops      uint8_t 0x01 COPY, uint32_t oldOffset, uint32_t size
+#            uint8_t 0x02 ADD, uint32_t size, size bytes
+#
+# Hashes are 32 bits FNV-1a. Sections whose content did not change are
+# found in the old file wherever they moved and cost a single COPY.
+#
+
+import argparse
+import struct
+import sys
+
+MAGIC = 0x44464c45
+VERSION = 1
+HEADER = struct.Struct('<6I')
+COPY = 0x01
+ADD = 0x02
+BLOCK = 8
+MIN_COPY = 12
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+
+def sections(elf):
+    """(offset, size) of the sections with file data, in file order"""
+    if elf[:4] != b'\x7fELF':
+        return []
+    shoff, = struct.unpack_from('<I', elf, 0x20)
+    shentsize, shnum = struct.unpack_from('<HH', elf, 0x2e)
+    result = []
+    for n in range(1, shnum):
+        _, shtype, _, _, offset, size = struct.unpack_from('<6I', elf, shoff + n * shentsize)
+        if shtype != 8 and size:  # SHT_NOBITS
+            result.append((offset, size))
+    result.append((shoff, shnum * shentsize))
+    return sorted(result)
+
+
+class Differ:
+    def __init__(self, old):
+        self.old = old
+        self.blocks = {}
+        for o in range(len(old) - BLOCK + 1):
+            self.blocks.setdefault(old[o:o + BLOCK], []).append(o)
+        self.sections = {}
+        for offset, size in sections(old):
+            self.sections.setdefault(old[offset:offset + size], offset)
+
+    def match(self, new, p, hint):
+        """Longest match of new[p:] in old, trying the end of the previous copy first"""
+        best = (0, 0)
+        candidates = self.blocks.get(new[p:p + BLOCK], [])
+        if hint is not None:
+            candidates = [hint] + candidates
+        for o in candidates[:64]:
+            n = 0
+            while p + n < len(new) and o + n < len(self.old) and new[p + n] == self.old[o + n]:
+                n += 1
+            if n > best[1]:
+                best = (o, n)
+        return best
+
+    def diff(self, new):
+        starts = {offset: size for offset, size in sections(new)}
+        ops = []
+        literal = bytearray()
+        hint = None
+        p = 0
+        while p < len(new):
+            size = starts.get(p)
+            if size and new[p:p + size] in self.sections:
+                o, n = self.sections[new[p:p + size]], size
+            else:
+                o, n = self.match(new, p, hint)
+            if n >= MIN_COPY:
+                if literal:
+                    ops.append((ADD, bytes(literal)))
+                    literal = bytearray()
+                ops.append((COPY, o, n))
+                hint = o + n
+                p += n
+            else:
+                literal.append(new[p])
+                hint = None
+                p += 1
+        if literal:
+            ops.append((ADD, bytes(literal)))
+        return ops
+
+
+def encode(old, new, ops):
+    out = HEADER.pack(MAGIC, VERSION, len(old), fnv1a(old), len(new), fnv1a(new))
+    for op in ops:
+        if op[0] == COPY:
+            out += struct.pack('<BII', COPY, op[1], op[2])
+        else:
+            out += struct.pack('<BI', ADD, len(op[1])) + op[1]
+    return out
+
+
+def apply(old, delta):
+    """Reference applier, used to check the delta before writing it"""
+    magic, version, oldSize, oldHash, newSize, newHash = HEADER.unpack_from(delta, 0)
+    assert magic == MAGIC and version == VERSION
+    assert oldSize == len(old) and oldHash == fnv1a(old)
+    out = bytearray()
+    p = HEADER.size
+    while p < len(delta):
+        if delta[p] == COPY:
+            o, n = struct.unpack_from('<II', delta, p + 1)
+            out += old[o:o + n]
+            p += 9
+        else:
+            n, = struct.unpack_from('<I', delta, p + 1)
+            out += delta[p + 5:p + 5 + n]
+            p += 5 + n
+    assert len(out) == newSize and fnv1a(out) == newHash
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build a delta between two elf modules')
+    parser.add_argument('old', help='module currently on the device')
+    parser.add_argument('new', help='updated module')
+    parser.add_argument('-o', '--output', required=True, help='output delta file')
+    args = parser.parse_args()
+
+    with open(args.old, 'rb') as f:
+        old = f.read()
+    with open(args.new, 'rb') as f:
+        new = f.read()
+
+    delta = encode(old, new, Differ(old).diff(new))
+    if apply(old, delta) != new:
+        sys.stderr.write('delta check failed\n')
+        return 1
+    with open(args.output, 'wb') as f:
+        f.write(delta)
+    sys.stderr.write('%s: %i bytes, delta %i bytes (%i%%)\n' % (args.new, len(new), len(delta), 100 * len(delta) // max(len(new), 1)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+#
+# Add a .elfloader.meta section to an elf module
+#
+# Usage: elfmeta.py module.elf [-o module-meta.elf]
+#
+# The section describes the module up front so the loader does not scan the
+# section headers and the symbol table: memory requirements, sections to
+# load, imported symbols and exported symbols. It is added as the last
+# section, where the loader looks for it.
+#
+# Section layout, all fields are little endian uint32_t:
+#
+#   header    magic "ELFM", version, execSize, dataSize, bssSize, align,
+#             symtabOffset, symtabCount, strtabOffset,
+#             sectionCount, importCount, exportCount
+#   sections  secIdx, flags (1: exec, 2: nobits, 4: .text), offset, size, align, relSecIdx
+#   imports   symIdx, nameOffset (in .strtab), sorted by symIdx
+#   exports   nameHash, nameOffset (in .strtab), secIdx, value, sorted by nameHash
+#
+# Hashes are 32 bits FNV-1a.
+#
+
+import argparse
+import struct
+import sys
+
+MAGIC = 0x4d464c45
+VERSION = 1
+NAME = b'.elfloader.meta'
+
+SHT_PROGBITS = 1
+SHT_SYMTAB = 2
+SHT_RELA = 4
+SHT_NOBITS = 8
+SHF_ALLOC = 0x2
+SHF_EXECINSTR = 0x4
+STB_GLOBAL = 1
+STB_WEAK = 2
+
+EHDR = struct.Struct('<16sHHIIIIIHHHHHH')
+SHDR = struct.Struct('<10I')
+SYM = struct.Struct('<IIIBBH')
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+
+def align(n, a):
+    return (n + a - 1) & ~(a - 1)
+
+
+def cstr(data, off):
+    return data[off:data.index(b'\0', off)]
+
+
+def build(elf):
+    ehdr = list(EHDR.unpack_from(elf, 0))
+    if ehdr[0][:4] != b'\x7fELF':
+        raise ValueError('not an elf file')
+    shoff, shnum, shstrndx = ehdr[6], ehdr[12], ehdr[13]
+    shdrs = [list(SHDR.unpack_from(elf, shoff + n * SHDR.size)) for n in range(shnum)]
+    shstrtab = shdrs[shstrndx]
+    names = [cstr(elf, shstrtab[4] + h[0]) for h in shdrs]
+    if NAME in names:
+        raise ValueError('module already has a %s section' % NAME.decode())
+
+    symtab = strtab = None
+    for n, h in enumerate(shdrs):
+        if names[n] == b'.symtab':
+            symtab = h
+        elif names[n] == b'.strtab':
+            strtab = h
+    if symtab is None or strtab is None:
+        raise ValueError('missing .symtab or .strtab section')
+
+    # Sections loaded by the loader, with their relocation section
+    sections = {}
+    execSize = dataSize = bssSize = 0
+    maxAlign = 1
+    for n, h in enumerate(shdrs):
+        _, shtype, flags, _, offset, size, _, _, addralign, _ = h
+        if n == 0 or not (flags & SHF_ALLOC) or not size:
+            continue
+        a = max(addralign, 1)
+        maxAlign = max(maxAlign, a)
+        f = 0
+        if flags & SHF_EXECINSTR:
+            f |= 1
+            execSize = align(execSize, a) + size
+        elif shtype == SHT_NOBITS:
+            bssSize = align(bssSize, a) + size
+        else:
+            dataSize = align(dataSize, a) + size
+        if shtype == SHT_NOBITS:
+            f |= 2
+        if names[n] == b'.text':
+            f |= 4
+        sections[n] = [n, f, offset, size, a, 0]
+    for n, h in enumerate(shdrs):
+        if h[1] == SHT_RELA and h[7] in sections:
+            sections[h[7]][5] = n
+
+    # Undefined symbols are imports, defined global ones are exports
+    imports = []
+    exports = []
+    for i in range(symtab[5] // SYM.size):
+        st_name, st_value, _, st_info, _, st_shndx = SYM.unpack_from(elf, symtab[4] + i * SYM.size)
+        bind = st_info >> 4
+        if not st_name or bind not in (STB_GLOBAL, STB_WEAK):
+            continue
+        name = cstr(elf, strtab[4] + st_name)
+        if st_shndx == 0:
+            imports.append((i, st_name))
+        elif st_shndx in sections:
+            exports.append((fnv1a(name), st_name, st_shndx, st_value))
+    exports.sort()
+
+    meta = struct.pack('<12I', MAGIC, VERSION, execSize, dataSize, bssSize, maxAlign,
+                       symtab[4], symtab[5] // SYM.size, strtab[4],
+                       len(sections), len(imports), len(exports))
+    for n in sorted(sections):
+        meta += struct.pack('<6I', *sections[n])
+    for e in imports:
+        meta += struct.pack('<2I', *e)
+    for e in exports:
+        meta += struct.pack('<4I', *e)
+
+    # Drop the section header table when it ends the file, then append the
+    # meta data, a new .shstrtab and the new section header table
+    out = bytearray(elf)
+    if shoff + shnum * SHDR.size == len(out):
+        del out[shoff:]
+    out += b'\0' * (align(len(out), 4) - len(out))
+    metaOffset = len(out)
+    out += meta
+    strOffset = len(out)
+    strtabData = elf[shstrtab[4]:shstrtab[4] + shstrtab[5]]
+    metaName = len(strtabData)
+    out += strtabData + NAME + b'\0'
+    shstrtab[4] = strOffset
+    shstrtab[5] = len(strtabData) + len(NAME) + 1
+    out += b'\0' * (align(len(out), 4) - len(out))
+    newShoff = len(out)
+    shdrs.append([metaName, SHT_PROGBITS, 0, 0, metaOffset, len(meta), 0, 0, 4, 0])
+    for h in shdrs:
+        out += SHDR.pack(*h)
+    ehdr[6] = newShoff
+    ehdr[12] = len(shdrs)
+    EHDR.pack_into(out, 0, *ehdr)
+    return bytes(out), execSize, dataSize, bssSize, len(imports), len(exports)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Add a .elfloader.meta section to an elf module')
+    parser.add_argument('module', help='elf module')
+    parser.add_argument('-o', '--output', help='output file, default: update the module')
+    args = parser.parse_args()
+
+    with open(args.module, 'rb') as f:
+        elf = f.read()
+    try:
+        out, execSize, dataSize, bssSize, imports, exports = build(elf)
+    except ValueError as e:
+        sys.stderr.write('%s: %s\n' % (args.module, e))
+        return 1
+    with open(args.output or args.module, 'wb') as f:
+        f.write(out)
+    sys.stderr.write('%s: exec %i, data %i, bss %i, %i imports, %i exports\n' % (args.module, execSize, dataSize, bssSize, imports, exports))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
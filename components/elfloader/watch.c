@@ -0,0 +1,142 @@
+/*
+ * Reload of an elf module each time its file changes, for linux
+ *
+ * Copyright (C) 2017 by niicoooo <1niicoooo1@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * The file is polled with stat. Each version is read in memory and loaded
+ * from there, so that the file can be rewritten while the module runs: the
+ * version loaded stays readable for the next elfLoaderReload. A version
+ * that fails to load, e.g. a file being written, is skipped and the loaded
+ * one kept.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "watch.h"
+
+
+#if INTERFACE
+#include "loader.h"
+
+/* Called after the first load, copied being -1, then after each reload with the number of sections copied. Stops watching when not 0 */
+typedef int (*ELFLoaderWatchCallback_t)(void *arg, ELFLoaderContext_t *ctx, int copied);
+
+#endif
+
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MSG(...) printf(__VA_ARGS__); printf("\n");
+#define ERR(...) printf(__VA_ARGS__); printf("\n");
+
+typedef struct {
+    char *data;
+    FILE *fd;
+} ELFLoaderWatchImage_t;
+
+
+static void freeImage(ELFLoaderWatchImage_t *image) {
+    if (image->fd) {
+        fclose(image->fd);
+    }
+    free(image->data);
+    memset(image, 0, sizeof(ELFLoaderWatchImage_t));
+}
+
+
+static int readImage(const char *path, ELFLoaderWatchImage_t *image) {
+    memset(image, 0, sizeof(ELFLoaderWatchImage_t));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        ERR("Cannot open %s", path);
+        return -1;
+    }
+    long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    image->data = size > 0 ? malloc(size) : NULL;
+    if (!image->data || fseek(f, 0, SEEK_SET) != 0 || fread(image->data, 1, size, f) != (size_t) size) {
+        ERR("Cannot read %s", path);
+        fclose(f);
+        freeImage(image);
+        return -1;
+    }
+    fclose(f);
+    image->fd = fmemopen(image->data, size, "rb");
+    if (!image->fd) {
+        freeImage(image);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int sameFile(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+
+/*
+ * Load the module at path, then poll the file every interval ms and reload
+ * it with elfLoaderReload when it changes, until the callback returns not
+ * 0. Returns 0, or -1 when the first load fails.
+ */
+int elfLoaderWatch(const char *path, const ELFLoaderEnv_t *env, unsigned int interval, ELFLoaderWatchCallback_t callback, void *arg) {
+    ELFLoaderWatchImage_t image;
+    ELFLoaderWatchImage_t next;
+    struct stat loaded;
+    struct stat st;
+    if (stat(path, &loaded) != 0 || readImage(path, &image) != 0) {
+        return -1;
+    }
+    ELFLoaderContext_t *ctx = elfLoaderInit(image.fd, env);
+    if (elfLoaderLoadAndRelocate(ctx) != 0) {
+        ERR("Load of %s failed", path);
+        elfLoaderFree(ctx);
+        freeImage(&image);
+        return -1;
+    }
+    int stop = callback(arg, ctx, -1);
+    while (!stop) {
+        usleep(interval * 1000);
+        if (stat(path, &st) != 0 || sameFile(&st, &loaded)) {
+            continue;
+        }
+        loaded = st;
+        if (readImage(path, &next) != 0) {
+            continue;
+        }
+        int copied = elfLoaderReload(ctx, elfLoaderInit(next.fd, env));
+        if (copied < 0) {
+            ERR("Reload of %s failed, keeping the loaded version", path);
+            freeImage(&next);
+            continue;
+        }
+        MSG("Reloaded %s: %i sections copied", path, copied);
+        freeImage(&image);
+        image = next;
+        stop = callback(arg, ctx, copied);
+    }
+    elfLoaderFree(ctx);
+    freeImage(&image);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,10 @@
+/* This file was automatically generated.  Do not edit! */
+
+#include "loader.h"
+
+/* Called after the first load, copied being -1, then after each reload with the number of sections copied. Stops watching when not 0 */
+typedef int (*ELFLoaderWatchCallback_t)(void *arg, ELFLoaderContext_t *ctx, int copied);
+
+#if defined(__linux__)
+int elfLoaderWatch(const char *path,const ELFLoaderEnv_t *env,unsigned int interval,ELFLoaderWatchCallback_t callback,void *arg);
+#endif